@@ -1,10 +1,26 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include "gamelib.h"
 
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
 #include <time.h>
+#include <unistd.h>
+
+/* Lunghezza della mappa generata da genera_mappa. */
+#define LUNGHEZZA_MAPPA 15
 
 /* Statistiche base per il combattimento di un nemico. */
 typedef struct {
@@ -14,1369 +30,6504 @@ typedef struct {
 } NemicoStats;
 
 /*
- * Stato globale del gioco: elenco dei giocatori,
- * puntatori alle mappe e contatori.
+ * Arena della sessione di gioco: blocchi di memoria in cui gli oggetti
+ * vengono allocati in sequenza e liberati tutti insieme.
+ * I blocchi restano allocati e vengono riusati dopo un azzeramento.
+ */
+#define ARENA_BLOCCO (64 * 1024)
+
+/*
+ * Oltre ARENA_BLOCCO_GRANDE di blocchi l'arena prende blocchi da 2 MiB
+ * allineati e chiesti come pagine grandi: la fork dei salvataggi copia
+ * una voce della tabella delle pagine per blocco invece di 512.
  */
-static Giocatore *giocatori[MAX_GIOCATORI];
-static int num_giocatori = 0;
-static int mappa_chiusa = 0;
-static int rng_init = 0;
-static int undici_virgola_cinque_usato = 0;
+#define ARENA_BLOCCO_GRANDE (2 * 1024 * 1024)
 
-static Zona_mondoreale *prima_zona_mondoreale = NULL;
-static Zona_soprasotto *prima_zona_soprasotto = NULL;
+typedef struct Blocco_arena {
+    struct Blocco_arena *prossimo;
+    size_t dimensione;
+    size_t usati;
+    int grande;
+    max_align_t dati[];
+} Blocco_arena;
+
+typedef struct {
+    Blocco_arena *primo;
+    Blocco_arena *corrente;
+    size_t riservati;
+} Arena;
 
-static char vincitori[3][NOME_MAX];
-static int vincitori_count = 0;
-static int partite_giocate = 0;
+/* Punto dell'arena a cui si puo' tornare liberando quanto allocato dopo. */
+typedef struct {
+    Blocco_arena *blocco;
+    size_t usati;
+} Segno_arena;
 
 /*
- * Stampa effetto macchina da scrivere.
- * nanosec_delay controlla la velocità di stampa.
+ * Stato del gioco: elenco dei giocatori,
+ * puntatori alle mappe e contatori.
+ * vivi contiene gli indici dei giocatori ancora in gioco: la rimozione
+ * di un morto e' uno scambio con l'ultimo elemento.
+ * Ogni thread ha la sua partita, quindi lo stato e' locale al thread.
  */
-void stampa_lenta(long nanosec_delay, const char *fmt, ...)
-{
-    char buffer[2048];
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(buffer, sizeof(buffer), fmt, args);
-    va_end(args);
+static _Thread_local Arena arena_partita;
+static _Thread_local Segno_arena segno_mappa;
+static _Thread_local Giocatore *giocatori = NULL;
+static _Thread_local int num_giocatori = 0;
+static _Thread_local int *vivi = NULL;
+static _Thread_local int num_vivi = 0;
+static _Thread_local int mappa_chiusa = 0;
+static _Thread_local int rng_init = 0;
+static _Thread_local uint64_t stato_rng = 0;
+static _Thread_local int undici_virgola_cinque_usato = 0;
 
-    struct timespec ts;
-    ts.tv_sec = 0;
-    ts.tv_nsec = nanosec_delay;
-    for (const char *p = buffer; *p; ++p) {
-        fputc(*p, stdout);
-        fflush(stdout);
-        nanosleep(&ts, NULL);
-    }
-}
+static _Thread_local Zona *prima_zona = NULL;
 
-/* Inizializza il generatore di numeri casuali una sola volta. */
-static void init_rng(void)
-{
-    if (!rng_init) {
-        srand((unsigned)time(NULL));
-        rng_init = 1;
-    }
-}
+/*
+ * Catene di zone tenute vive dalle versioni di annulla/ripeti: finche'
+ * ce n'e' una, liberare la mappa ricicla le zone invece di riportare
+ * indietro l'arena. mappa_salvata indica che la catena corrente
+ * appartiene gia' a una versione, quindi va solo staccata.
+ */
+static _Thread_local int catene_salvate = 0;
+static _Thread_local int mappa_salvata = 0;
 
 /*
- * Restituisce un intero casuale compreso tra min e max inclusi.
+ * Mappa virtuale generata dal seme: le zone occupate dai giocatori
+ * sono materializzate e indicizzate per indice in zone_materializzate.
  */
-static int randint(int min, int max)
-{
-    int range = max - min + 1;
-    return min + (rand() % range);
-}
+static _Thread_local int mappa_virtuale_attiva = 0;
+static _Thread_local Mappa_virtuale mappa_virtuale;
+static _Thread_local Tabella_zone zone_materializzate;
 
 /*
- * Svuota il buffer di input fino a newline/EOF.
+ * Aggiornamento del mondo a fine round: con le regole attive, durante la
+ * partita i nemici di tutte le zone stanno in nemici_mondo, due bit per
+ * mondo a partire dal Mondo Reale (un byte per zona fino a quattro mondi),
+ * che prevale sulla mappa. Con la mappa a liste colonne_mondo da' la zona
+ * di ogni indice. Se si registra la storia, nemici_precedenti tiene i
+ * nemici di prima dell'ultimo aggiornamento per trovare le zone cambiate.
  */
-static void clear_input_line(void)
-{
-    int ch;
-    while ((ch = getchar()) != '\n' && ch != EOF) {
-    }
-}
+#if NUM_MONDI <= 4
+typedef uint8_t Nemici_zona;
+#elif NUM_MONDI <= 8
+typedef uint16_t Nemici_zona;
+#elif NUM_MONDI <= 16
+typedef uint32_t Nemici_zona;
+#else
+typedef uint64_t Nemici_zona;
+#endif
+
+static _Thread_local Regole_mondo regole_mondo;
+static _Thread_local Nemici_zona *nemici_mondo = NULL;
+static _Thread_local Nemici_zona *nemici_precedenti = NULL;
+static _Thread_local Zona **colonne_mondo = NULL;
+static _Thread_local size_t lunghezza_mondo = 0;
 
 /*
- * Legge un intero da tastiera con verifica:
- * ripete la richiesta finché il valore non è nel range.
+ * Modello di mappa condiviso dalle partite successive: la sessione
+ * tiene un riferimento finche' non se ne crea un altro o termina il gioco.
  */
+static Modello_mappa *modello_condiviso = NULL;
 
-static int leggi_intero(const char *prompt, int min, int max)
-{
-    int valore;
-    int letti;
-    /* Loop del menu di configurazione: termina solo quando la mappa è chiusa. */
-    do {
-        stampa_lenta(15000000L, "%s", prompt);
-        letti = scanf("%d", &valore);
-        if (letti != 1) {
-            stampa_lenta(15000000L, "Input non valido.\n");
-            clear_input_line();
-            continue;
-        }
-        if (valore < min || valore > max) {
-            stampa_lenta(15000000L, "Valore fuori range (%d-%d).\n", min, max);
-        }
-        clear_input_line();
-    } while (letti != 1 || valore < min || valore > max);
-    return valore;
-}
 
 /*
- * Legge una stringa (nome giocatore) e rimuove il newline finale.
- * Se l'utente inserisce una riga vuota usa un nome di default.
+ * Interfaccia a schermo intero: il retro viene composto ad ogni
+ * aggiornamento, il fronte ricorda cosa c'e' sul terminale.
+ * Si riscrivono solo le celle che differiscono tra i due.
  */
+#define SCHERMO_RIGHE 24
+#define SCHERMO_COLONNE 80
+#define SCHERMO_RIGA_MESSAGGI 17
+#define SCHERMO_NUM_MESSAGGI 5
+#define SCHERMO_RIGA_PROMPT 22
+/* Righe per i mondi: se sono di piu' si vedono quello del giocatore e i vicini. */
+#define SCHERMO_MONDI (NUM_MONDI < 3 ? NUM_MONDI : 3)
 
-static void leggi_stringa(const char *prompt, char *dest, size_t max_len)
-{
-    stampa_lenta(15000000L, "%s", prompt);
-    if (fgets(dest, (int)max_len, stdin) == NULL) {
-        dest[0] = '\0';
-        return;
-    }
-    dest[strcspn(dest, "\n")] = '\0';
-    if (dest[0] == '\0') {
-        strncpy(dest, "Giocatore", max_len);
-        dest[max_len - 1] = '\0';
-    }
-}
+static int schermo_richiesto = 0;
+static int schermo_attivo = 0;
+static char schermo_fronte[SCHERMO_RIGHE][SCHERMO_COLONNE];
+static char schermo_retro[SCHERMO_RIGHE][SCHERMO_COLONNE];
+static char messaggi[SCHERMO_NUM_MESSAGGI][SCHERMO_COLONNE + 1];
+static int messaggio_aperto = 0;
 
-static const char *nome_tipo_zona(Tipo_zona tipo)
+/* Con silenzioso attivo stampa_lenta non scrive nulla (partite simulate). */
+static _Thread_local int silenzioso = 0;
+
+/*
+ * Ingresso e uscita impostati da chi ospita il motore, per thread.
+ * Senza io_esterno si usa il terminale: stdin, stdout e nanosleep.
+ */
+static _Thread_local Gioco_io io_corrente;
+static _Thread_local int io_esterno = 0;
+
+/*
+ * Imposta l'ingresso e l'uscita del thread corrente (la struttura
+ * viene copiata); con NULL si torna al terminale.
+ */
+void gioco_imposta_io(const Gioco_io *io)
 {
-    switch (tipo) {
-    case bosco:
-        return "bosco";
-    case scuola:
-        return "scuola";
-    case laboratorio:
-        return "laboratorio";
-    case caverna:
-        return "caverna";
-    case strada:
-        return "strada";
-    case giardino:
-        return "giardino";
-    case supermercato:
-        return "supermercato";
-    case centrale_elettrica:
-        return "centrale_elettrica";
-    case deposito_abbandonato:
-        return "deposito_abbandonato";
-    case stazione_polizia:
-        return "stazione_polizia";
-    default:
-        return "sconosciuto";
+    if (io) {
+        io_corrente = *io;
+        io_esterno = 1;
+    } else {
+        memset(&io_corrente, 0, sizeof(io_corrente));
+        io_esterno = 0;
     }
 }
 
-static const char *nome_nemico(Tipo_nemico nemico)
+/* Invia testo gia' pronto all'uscita corrente. */
+static void scrivi_uscita(const char *testo, size_t len)
 {
-    switch (nemico) {
-    case nessun_nemico:
-        return "nessun_nemico";
-    case billi:
-        return "billi";
-    case democane:
-        return "democane";
-    case demotorzone:
-        return "demotorzone";
-    default:
-        return "sconosciuto";
+    if (io_esterno) {
+        if (io_corrente.scrivi && len > 0) {
+            io_corrente.scrivi(io_corrente.contesto, testo, len);
+        }
+        return;
     }
+    fwrite(testo, 1, len, stdout);
+    fflush(stdout);
 }
 
-static const char *nome_oggetto(Tipo_oggetto oggetto)
+/* Secondi dall'epoca secondo l'orologio corrente. */
+static int64_t ora_corrente(void)
 {
-    switch (oggetto) {
-    case nessun_oggetto:
-        return "nessun_oggetto";
-    case bicicletta:
-        return "bicicletta";
-    case maglietta_fuocoinferno:
-        return "maglietta_fuocoinferno";
-    case bussola:
-        return "bussola";
-    case schitarrata_metallica:
-        return "schitarrata_metallica";
-    default:
-        return "sconosciuto";
+    if (io_esterno && io_corrente.orologio) {
+        return io_corrente.orologio(io_corrente.contesto);
     }
+    return (int64_t)time(NULL);
 }
 
-
 /*
- * Restituisce le statistiche base del nemico scelto.
+ * Scrive un testo nel retro a partire da riga/colonna,
+ * troncandolo al bordo dello schermo.
  */
-static NemicoStats stats_nemico(Tipo_nemico nemico)
+static void schermo_scrivi(int riga, int colonna, const char *fmt, ...)
 {
-    NemicoStats s;
-    switch (nemico) {
-    case billi:
-        s.hp = 12;
-        s.attacco = 8;
-        s.difesa = 8;
-        break;
-    case democane:
-        s.hp = 16;
-        s.attacco = 10;
-        s.difesa = 10;
-        break;
-    case demotorzone:
-        s.hp = 24;
-        s.attacco = 14;
-        s.difesa = 12;
-        break;
-    case nessun_nemico:
-    default:
-        s.hp = 0;
-        s.attacco = 0;
-        s.difesa = 0;
-        break;
+    char testo[SCHERMO_COLONNE + 1];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(testo, sizeof(testo), fmt, args);
+    va_end(args);
+    for (const char *p = testo; *p && colonna < SCHERMO_COLONNE; ++p, ++colonna) {
+        schermo_retro[riga][colonna] = *p == '\n' ? ' ' : *p;
     }
-    return s;
 }
 
-/* Alloca e inizializza una zona del Mondo Reale. */
-static Zona_mondoreale *crea_zona_mr(Tipo_zona tipo, Tipo_nemico nemico, Tipo_oggetto oggetto)
+/* Svuota una riga del retro. */
+static void schermo_pulisci_riga(int riga)
 {
-    Zona_mondoreale *z = (Zona_mondoreale *)malloc(sizeof(Zona_mondoreale));
-    if (!z) {
-        return NULL;
-    }
-    z->tipo = tipo;
-    z->nemico = nemico;
-    z->oggetto = oggetto;
-    z->avanti = NULL;
-    z->indietro = NULL;
-    z->link_soprasotto = NULL;
-    return z;
+    memset(schermo_retro[riga], ' ', SCHERMO_COLONNE);
 }
 
-/* Alloca e inizializza una zona del Soprasotto. */
-static Zona_soprasotto *crea_zona_ss(Tipo_zona tipo, Tipo_nemico nemico)
+/* Segna una riga del fronte come sconosciuta, cosi' verra' ridisegnata. */
+static void schermo_invalida_riga(int riga)
 {
-    Zona_soprasotto *z = (Zona_soprasotto *)malloc(sizeof(Zona_soprasotto));
-    if (!z) {
-        return NULL;
-    }
-    z->tipo = tipo;
-    z->nemico = nemico;
-    z->avanti = NULL;
-    z->indietro = NULL;
-    z->link_mondoreale = NULL;
-    return z;
+    memset(schermo_fronte[riga], 0, SCHERMO_COLONNE);
 }
 
 /*
- * Libera la memoria di tutte le mappe
- * e ripristina i puntatori globali.
+ * Confronta retro e fronte e invia al terminale solo le celle cambiate:
+ * ogni tratto modificato costa uno spostamento del cursore piu' i caratteri.
+ * Tratti separati da pochi caratteri uguali vengono uniti, perche'
+ * riscriverli costa meno di una nuova sequenza di posizionamento.
+ * Nel caso peggiore ogni cella e' un tratto a se': fino a 8 byte di
+ * "\033[r;cH" piu' il carattere, e un byte per il terminatore di snprintf.
  */
+_Static_assert(SCHERMO_RIGHE < 100 && SCHERMO_COLONNE < 100, "posizione del cursore oltre 8 byte");
 
-static void libera_mappa(void)
+static void schermo_aggiorna(void)
 {
-    Zona_mondoreale *cur_mr = prima_zona_mondoreale;
-    while (cur_mr) {
-        Zona_mondoreale *next = cur_mr->avanti;
-        free(cur_mr);
-        cur_mr = next;
-    }
-    prima_zona_mondoreale = NULL;
-
-    Zona_soprasotto *cur_ss = prima_zona_soprasotto;
-    while (cur_ss) {
-        Zona_soprasotto *next = cur_ss->avanti;
-        free(cur_ss);
-        cur_ss = next;
+    char uscita[SCHERMO_RIGHE * SCHERMO_COLONNE * (8 + 1) + 1];
+    size_t n = 0;
+    for (int r = 0; r < SCHERMO_RIGHE; r++) {
+        int c = 0;
+        while (c < SCHERMO_COLONNE) {
+            if (schermo_retro[r][c] == schermo_fronte[r][c]) {
+                c++;
+                continue;
+            }
+            int fine = c + 1;
+            int uguali = 0;
+            for (int k = c + 1; k < SCHERMO_COLONNE && uguali < 6; k++) {
+                if (schermo_retro[r][k] == schermo_fronte[r][k]) {
+                    uguali++;
+                } else {
+                    uguali = 0;
+                    fine = k + 1;
+                }
+            }
+            n += (size_t)snprintf(uscita + n, sizeof(uscita) - n, "\033[%d;%dH", r + 1, c + 1);
+            memcpy(uscita + n, &schermo_retro[r][c], (size_t)(fine - c));
+            memcpy(&schermo_fronte[r][c], &schermo_retro[r][c], (size_t)(fine - c));
+            n += (size_t)(fine - c);
+            c = fine;
+        }
     }
-    prima_zona_soprasotto = NULL;
+    scrivi_uscita(uscita, n);
 }
 
 /*
- * Libera la memoria dei giocatori e azzera lo stato.
+ * Aggiunge testo all'area messaggi: le righe complete scorrono verso l'alto,
+ * l'ultima riga resta aperta finche' non arriva un newline.
  */
-static void libera_giocatori(void)
+static void schermo_messaggio(const char *testo)
 {
-    for (int i = 0; i < MAX_GIOCATORI; i++) {
-        free(giocatori[i]);
-        giocatori[i] = NULL;
+    for (const char *p = testo; *p; ++p) {
+        if (!messaggio_aperto) {
+            memmove(messaggi[0], messaggi[1], sizeof(messaggi[0]) * (SCHERMO_NUM_MESSAGGI - 1));
+            messaggi[SCHERMO_NUM_MESSAGGI - 1][0] = '\0';
+            messaggio_aperto = 1;
+        }
+        if (*p == '\n') {
+            messaggio_aperto = 0;
+            continue;
+        }
+        char *riga = messaggi[SCHERMO_NUM_MESSAGGI - 1];
+        size_t len = strlen(riga);
+        if (len < SCHERMO_COLONNE) {
+            riga[len] = *p;
+            riga[len + 1] = '\0';
+        }
+    }
+    for (int i = 0; i < SCHERMO_NUM_MESSAGGI; i++) {
+        schermo_pulisci_riga(SCHERMO_RIGA_MESSAGGI + i);
+        schermo_scrivi(SCHERMO_RIGA_MESSAGGI + i, 0, "%s", messaggi[i]);
     }
-    num_giocatori = 0;
-    undici_virgola_cinque_usato = 0;
 }
 
 /*
- * Conta quante zone esistono nella mappa del Mondo Reale.
+ * Mostra la richiesta nella riga di input e aggiorna il terminale,
+ * lasciando il cursore subito dopo il testo.
  */
-static int conta_zone_mr(void)
+static void schermo_prompt(const char *prompt)
 {
-    int count = 0;
-    Zona_mondoreale *cur = prima_zona_mondoreale;
-    while (cur) {
-        count++;
-        cur = cur->avanti;
-    }
-    return count;
+    schermo_pulisci_riga(SCHERMO_RIGA_PROMPT);
+    schermo_scrivi(SCHERMO_RIGA_PROMPT, 0, "%s", prompt);
+    schermo_aggiorna();
+    size_t len = strlen(prompt);
+    char cursore[32];
+    int n = snprintf(cursore, sizeof(cursore), "\033[%d;%dH", SCHERMO_RIGA_PROMPT + 1,
+                     (int)(len < SCHERMO_COLONNE ? len : SCHERMO_COLONNE - 1) + 1);
+    scrivi_uscita(cursore, (size_t)n);
 }
 
 /*
- * Conta quante zone del Soprasotto hanno il demotorzone.
+ * Dopo la lettura l'eco del terminale ha scritto nella riga di input
+ * e in quella successiva: il fronte non e' piu' affidabile li'.
  */
-static int conta_demotorzone_ss(void)
+static void schermo_dopo_input(void)
 {
-    int count = 0;
-    Zona_soprasotto *cur = prima_zona_soprasotto;
-    while (cur) {
-        if (cur->nemico == demotorzone) {
-            count++;
-        }
-        cur = cur->avanti;
+    schermo_invalida_riga(SCHERMO_RIGA_PROMPT);
+    schermo_invalida_riga(SCHERMO_RIGA_PROMPT + 1);
+}
+
+/* Entra nello schermo intero: terminale pulito e fronte da ridisegnare. */
+static void schermo_apri(void)
+{
+    schermo_attivo = 1;
+    messaggio_aperto = 0;
+    memset(messaggi, 0, sizeof(messaggi));
+    memset(schermo_fronte, ' ', sizeof(schermo_fronte));
+    memset(schermo_retro, ' ', sizeof(schermo_retro));
+    scrivi_uscita("\033[2J\033[H", 7);
+}
+
+/* Torna alla stampa lineare sotto l'ultima riga dello schermo. */
+static void schermo_chiudi(void)
+{
+    if (!schermo_attivo) {
+        return;
     }
-    return count;
+    schermo_attivo = 0;
+    char cursore[32];
+    int n = snprintf(cursore, sizeof(cursore), "\033[%d;1H\n", SCHERMO_RIGHE);
+    scrivi_uscita(cursore, (size_t)n);
 }
 
 /*
- * Estrae casualmente un tipo di zona.
+ * Attiva o disattiva l'interfaccia a schermo intero per le prossime partite.
  */
-static Tipo_zona random_tipo_zona(void)
+void alterna_schermo_intero(void)
 {
-    return (Tipo_zona)randint(0, stazione_polizia);
+    schermo_richiesto = !schermo_richiesto;
+    stampa_lenta(15000000L, "Schermo intero %s.\n", schermo_richiesto ? "attivato" : "disattivato");
 }
 
 /*
- * Estrae casualmente un nemico per il Mondo Reale.
+ * Tasti premuti mentre stampa_lenta scriveva: vengono usati
+ * dalla prossima lettura come se fossero stati digitati li'.
+ * salta_attesa resta attivo fino alla lettura successiva, cosi'
+ * dopo un tasto tutto il testo in arrivo esce subito.
  */
-static Tipo_nemico random_nemico_mr(void)
+#define ANTICIPO_MAX 256
+
+static char anticipo[ANTICIPO_MAX];
+static size_t anticipo_len = 0;
+static _Thread_local int salta_attesa = 0;
+static struct termios terminale_originale;
+static int terminale_grezzo = 0;
+
+/* Ripristina il terminale se e' in modalita' grezza. */
+static void ripristina_terminale(void)
 {
-    int r = randint(1, 100);
-    if (r <= 40) {
-        return nessun_nemico;
-    }
-    if (r <= 70) {
-        return democane;
+    if (terminale_grezzo) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &terminale_originale);
+        terminale_grezzo = 0;
     }
-    return billi;
+}
+
+/* Con Ctrl-C il terminale deve tornare com'era prima di uscire. */
+static void gestisci_interruzione(int segnale)
+{
+    ripristina_terminale();
+    signal(segnale, SIG_DFL);
+    raise(segnale);
 }
 
 /*
- * Estrae casualmente un nemico per il Soprasotto.
+ * Porta il terminale in modalita' non canonica senza eco, cosi' i tasti
+ * arrivano subito a poll. Restituisce 0 se stdin non e' un terminale.
  */
-static Tipo_nemico random_nemico_ss(void)
+static int terminale_in_grezzo(void)
 {
-    int r = randint(1, 100);
-    if (r <= 45) {
-        return nessun_nemico;
+    static int gestore_installato = 0;
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &terminale_originale) != 0) {
+        return 0;
+    }
+    if (!gestore_installato) {
+        signal(SIGINT, gestisci_interruzione);
+        gestore_installato = 1;
     }
-    if (r <= 80) {
-        return democane;
+    struct termios grezzo = terminale_originale;
+    grezzo.c_lflag &= (tcflag_t) ~(ICANON | ECHO);
+    grezzo.c_cc[VMIN] = 0;
+    grezzo.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &grezzo) != 0) {
+        return 0;
     }
-    return demotorzone;
+    terminale_grezzo = 1;
+    return 1;
 }
 
 /*
- * Estrae casualmente un oggetto per il Mondo Reale.
+ * Sposta nel buffer di anticipo i tasti gia' disponibili,
+ * gestendo il backspace come farebbe il terminale.
  */
-static Tipo_oggetto random_oggetto(void)
+static void accumula_anticipo(void)
 {
-    int r = randint(1, 100);
-    if (r <= 40) {
-        return nessun_oggetto;
+    char letti[64];
+    ssize_t n = read(STDIN_FILENO, letti, sizeof(letti));
+    for (ssize_t i = 0; i < n; i++) {
+        if (letti[i] == 127 || letti[i] == '\b') {
+            if (anticipo_len > 0 && anticipo[anticipo_len - 1] != '\n') {
+                anticipo_len--;
+            }
+        } else if (anticipo_len < ANTICIPO_MAX) {
+            anticipo[anticipo_len++] = letti[i] == '\r' ? '\n' : letti[i];
+        }
     }
-    return (Tipo_oggetto)randint(bicicletta, schitarrata_metallica);
 }
 
 /*
- * Aggancia in coda una coppia di zone mondoreale/soprasotto mantenendo i link.
+ * Stampa effetto macchina da scrivere.
+ * nanosec_delay controlla la velocità di stampa.
+ * Con lo schermo intero attivo il testo finisce nell'area messaggi.
+ * Su terminale l'attesa tra i caratteri e' una poll su stdin:
+ * un tasto premuto fa uscire subito il resto del testo e viene conservato.
+ * Con un ingresso/uscita esterno l'attesa e' quella dell'ospite.
  */
-static void append_coppia(Zona_mondoreale *mr, Zona_soprasotto *ss)
+void stampa_lenta(long nanosec_delay, const char *fmt, ...)
 {
-    mr->link_soprasotto = ss;
-    ss->link_mondoreale = mr;
-
-    if (!prima_zona_mondoreale) {
-        prima_zona_mondoreale = mr;
-    } else {
-        Zona_mondoreale *cur = prima_zona_mondoreale;
-        while (cur->avanti) {
-            cur = cur->avanti;
-        }
-        cur->avanti = mr;
-        mr->indietro = cur;
+    if (silenzioso || (io_esterno && !io_corrente.scrivi)) {
+        return;
     }
+    char buffer[2048];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
 
-    if (!prima_zona_soprasotto) {
-        prima_zona_soprasotto = ss;
-    } else {
-        Zona_soprasotto *cur = prima_zona_soprasotto;
-        while (cur->avanti) {
-            cur = cur->avanti;
-        }
-        cur->avanti = ss;
-        ss->indietro = cur;
+    if (schermo_attivo) {
+        schermo_messaggio(buffer);
+        return;
     }
-}
 
-/*
- * Crea da zero la mappa di gioco con 15 zone per mondo,
- * assegnando tipo, nemico e oggetto in modo casuale e
- * garantendo la presenza di un solo demotorzone nel Soprasotto.
- */
-
-static void genera_mappa(void)
-{
-    libera_mappa();
-    for (int i = 0; i < 15; i++) {
-        Tipo_zona tipo = random_tipo_zona();
-        Tipo_nemico nemico_mr = random_nemico_mr();
-        Tipo_oggetto oggetto = random_oggetto();
-        Tipo_nemico nemico_ss = random_nemico_ss();
-
-        Zona_mondoreale *mr = crea_zona_mr(tipo, nemico_mr, oggetto);
-        Zona_soprasotto *ss = crea_zona_ss(tipo, nemico_ss);
-        if (!mr || !ss) {
-            free(mr);
-            free(ss);
-            stampa_lenta(15000000L, "Errore di allocazione durante la generazione della mappa.\n");
-            libera_mappa();
+    if (io_esterno) {
+        size_t len = strlen(buffer);
+        if (salta_attesa || !io_corrente.attendi) {
+            scrivi_uscita(buffer, len);
             return;
         }
-        append_coppia(mr, ss);
+        for (size_t i = 0; i < len; i++) {
+            scrivi_uscita(buffer + i, 1);
+            if (io_corrente.attendi(io_corrente.contesto, nanosec_delay)) {
+                salta_attesa = 1;
+                scrivi_uscita(buffer + i + 1, len - i - 1);
+                break;
+            }
+        }
+        return;
     }
 
-    if (conta_demotorzone_ss() == 0) {
-        int pos = randint(1, 15);
-        Zona_soprasotto *cur = prima_zona_soprasotto;
-        for (int i = 1; i < pos && cur; i++) {
-            cur = cur->avanti;
-        }
-        if (cur) {
-            cur->nemico = demotorzone;
-        }
+    if (salta_attesa || anticipo_len > 0) {
+        fputs(buffer, stdout);
+        fflush(stdout);
+        return;
     }
-    while (conta_demotorzone_ss() > 1) {
-        Zona_soprasotto *cur = prima_zona_soprasotto;
-        int trovato = 0;
-        while (cur) {
-            if (cur->nemico == demotorzone) {
-                if (!trovato) {
-                    trovato = 1;
-                } else {
-                    cur->nemico = democane;
-                }
+
+    if (terminale_in_grezzo()) {
+        int attesa_ms = (int)((nanosec_delay + 999999L) / 1000000L);
+        struct pollfd pfd;
+        pfd.fd = STDIN_FILENO;
+        pfd.events = POLLIN;
+        for (const char *p = buffer; *p; ++p) {
+            fputc(*p, stdout);
+            fflush(stdout);
+            if (poll(&pfd, 1, attesa_ms) > 0) {
+                accumula_anticipo();
+                salta_attesa = 1;
+                fputs(p + 1, stdout);
+                fflush(stdout);
+                break;
             }
-            cur = cur->avanti;
         }
+        ripristina_terminale();
+        return;
     }
-    stampa_lenta(15000000L, "Mappa generata con 15 zone per ciascun mondo.\n");
-}
-
-/*
- * Chiede all'utente il nemico del Mondo Reale per una zona.
- */
-static int scegli_nemico_mr(void)
-{
-    stampa_lenta(15000000L, "Nemici Mondo Reale: 0) nessun_nemico 1) billi 2) democane\n");
-    return leggi_intero("Scelta nemico MR: ", 0, 2);
-}
 
-/*
- * Chiede all'utente il nemico del Soprasotto.
- */
-static int scegli_nemico_ss(int demotorzone_disponibile)
-{
-    if (demotorzone_disponibile) {
-        stampa_lenta(15000000L, "Nemici Soprasotto: 0) nessun_nemico 2) democane 3) demotorzone\n");
-        int scelta;
-        do {
-            scelta = leggi_intero("Scelta nemico SS: ", 0, 3);
-        } while (scelta == 1);
-        return scelta;
+    struct timespec ts;
+    ts.tv_sec = 0;
+    ts.tv_nsec = nanosec_delay;
+    for (const char *p = buffer; *p; ++p) {
+        fputc(*p, stdout);
+        fflush(stdout);
+        nanosleep(&ts, NULL);
     }
-    stampa_lenta(15000000L, "Nemici Soprasotto: 0) nessun_nemico 2) democane\n");
-    int scelta;
-    do {
-        scelta = leggi_intero("Scelta nemico SS: ", 0, 2);
-    } while (scelta == 1);
-    return scelta;
-}
-
-/*
- * Chiede all'utente l'oggetto da associare a una zona.
- */
-static int scegli_oggetto(void)
-{
-    stampa_lenta(15000000L, "Oggetti: 0) nessun_oggetto 1) bicicletta 2) maglietta_fuocoinferno 3) bussola 4) schitarrata_metallica\n");
-    return leggi_intero("Scelta oggetto: ", 0, 4);
 }
 
 /*
- * Inserisce una nuova coppia di zone in posizione scelta,
- * mantenendo la corrispondenza tra Mondo Reale e Soprasotto.
+ * Contabilita' della memoria per sottosistema. I blocchi presi con
+ * mem_alloca portano davanti un'intestazione con dimensione e
+ * sottosistema, cosi' mem_libera sa cosa scalare; possono essere liberati
+ * da un thread diverso, quindi i loro contatori sono del processo.
+ * Zone e giocatori stanno nell'arena della partita e sono contati per
+ * thread: ogni thread gioca una partita alla volta, e' la sua impronta.
  */
+typedef union {
+    max_align_t allineamento;
+    struct {
+        size_t dimensione;
+        int sottosistema;
+    } info;
+} Intestazione_memoria;
 
-static void inserisci_zona(void)
-{
-    int len = conta_zone_mr();
-    int pos = leggi_intero("Posizione di inserimento (1..len+1): ", 1, len + 1);
-    Tipo_zona tipo = random_tipo_zona();
+typedef struct {
+    _Atomic int64_t vivi;
+    _Atomic int64_t picco;
+    atomic_uint_least64_t allocazioni;
+    atomic_uint_least64_t liberazioni;
+} Contatori_processo;
 
-    int demotorzone_disponibile = conta_demotorzone_ss() == 0;
-    Tipo_nemico nemico_mr = (Tipo_nemico)scegli_nemico_mr();
-    Tipo_nemico nemico_ss = (Tipo_nemico)scegli_nemico_ss(demotorzone_disponibile);
-    Tipo_oggetto oggetto = (Tipo_oggetto)scegli_oggetto();
+static Contatori_processo memoria_processo[memoria_numero_sottosistemi];
+static _Thread_local Contatori_memoria memoria_partita[memoria_numero_sottosistemi];
 
-    Zona_mondoreale *mr = crea_zona_mr(tipo, nemico_mr, oggetto);
-    Zona_soprasotto *ss = crea_zona_ss(tipo, nemico_ss);
-    if (!mr || !ss) {
-        free(mr);
-        free(ss);
-        stampa_lenta(15000000L, "Errore di allocazione durante l'inserimento.\n");
-        return;
+/* Aggiunge byte (negativi se liberati) e blocchi allocati o liberati. */
+static void memoria_conta(Sottosistema_memoria s, int64_t byte, int64_t blocchi)
+{
+    Contatori_processo *c = &memoria_processo[s];
+    int64_t vivi = atomic_fetch_add_explicit(&c->vivi, byte, memory_order_relaxed) + byte;
+    int64_t picco = atomic_load_explicit(&c->picco, memory_order_relaxed);
+    while (vivi > picco &&
+           !atomic_compare_exchange_weak_explicit(&c->picco, &picco, vivi, memory_order_relaxed, memory_order_relaxed)) {
     }
-
-    mr->link_soprasotto = ss;
-    ss->link_mondoreale = mr;
-
-    if (pos == 1) {
-        mr->avanti = prima_zona_mondoreale;
-        if (prima_zona_mondoreale) {
-            prima_zona_mondoreale->indietro = mr;
-        }
-        prima_zona_mondoreale = mr;
-
-        ss->avanti = prima_zona_soprasotto;
-        if (prima_zona_soprasotto) {
-            prima_zona_soprasotto->indietro = ss;
-        }
-        prima_zona_soprasotto = ss;
-    } else {
-        Zona_mondoreale *cur_mr = prima_zona_mondoreale;
-        Zona_soprasotto *cur_ss = prima_zona_soprasotto;
-        for (int i = 1; i < pos - 1 && cur_mr && cur_ss; i++) {
-            cur_mr = cur_mr->avanti;
-            cur_ss = cur_ss->avanti;
-        }
-        mr->avanti = cur_mr->avanti;
-        if (cur_mr->avanti) {
-            cur_mr->avanti->indietro = mr;
-        }
-        cur_mr->avanti = mr;
-        mr->indietro = cur_mr;
-
-        ss->avanti = cur_ss->avanti;
-        if (cur_ss->avanti) {
-            cur_ss->avanti->indietro = ss;
-        }
-        cur_ss->avanti = ss;
-        ss->indietro = cur_ss;
+    if (blocchi > 0) {
+        atomic_fetch_add_explicit(&c->allocazioni, (uint64_t)blocchi, memory_order_relaxed);
+    } else if (blocchi < 0) {
+        atomic_fetch_add_explicit(&c->liberazioni, (uint64_t)-blocchi, memory_order_relaxed);
     }
-    stampa_lenta(15000000L, "Zona inserita in posizione %d.\n", pos);
 }
 
-/*
- * Rimuove una coppia di zone dalla posizione indicata,
- * aggiornando i puntatori della lista e le posizioni dei giocatori.
- */
-
-static void cancella_zona(void)
+/* Come memoria_conta, per zone e giocatori della partita del thread. */
+static void memoria_conta_partita(Sottosistema_memoria s, int64_t byte, int64_t blocchi)
 {
-    int len = conta_zone_mr();
-    if (len == 0) {
-        stampa_lenta(15000000L, "Non ci sono zone da cancellare.\n");
-        return;
+    Contatori_memoria *c = &memoria_partita[s];
+    c->vivi += byte;
+    if (c->vivi > c->picco) {
+        c->picco = c->vivi;
     }
-    int pos = leggi_intero("Posizione da cancellare (1..len): ", 1, len);
+    if (blocchi > 0) {
+        c->allocazioni += (uint64_t)blocchi;
+    } else {
+        c->liberazioni += (uint64_t)-blocchi;
+    }
+}
 
-    Zona_mondoreale *cur_mr = prima_zona_mondoreale;
-    Zona_soprasotto *cur_ss = prima_zona_soprasotto;
-    for (int i = 1; i < pos && cur_mr && cur_ss; i++) {
-        cur_mr = cur_mr->avanti;
-        cur_ss = cur_ss->avanti;
+static void *mem_alloca(Sottosistema_memoria s, size_t dimensione)
+{
+    if (dimensione > SIZE_MAX - sizeof(Intestazione_memoria)) {
+        return NULL;
     }
-    if (!cur_mr || !cur_ss) {
-        stampa_lenta(15000000L, "Posizione non valida.\n");
-        return;
+    Intestazione_memoria *h = (Intestazione_memoria *)malloc(sizeof(Intestazione_memoria) + dimensione);
+    if (!h) {
+        return NULL;
     }
+    h->info.dimensione = dimensione;
+    h->info.sottosistema = (int)s;
+    memoria_conta(s, (int64_t)dimensione, 1);
+    return h + 1;
+}
 
-    if (cur_mr->indietro) {
-        cur_mr->indietro->avanti = cur_mr->avanti;
-    } else {
-        prima_zona_mondoreale = cur_mr->avanti;
+static void *mem_calloca(Sottosistema_memoria s, size_t numero, size_t dimensione)
+{
+    if (dimensione != 0 && numero > (SIZE_MAX - sizeof(Intestazione_memoria)) / dimensione) {
+        return NULL;
     }
-    if (cur_mr->avanti) {
-        cur_mr->avanti->indietro = cur_mr->indietro;
+    Intestazione_memoria *h = (Intestazione_memoria *)calloc(1, sizeof(Intestazione_memoria) + numero * dimensione);
+    if (!h) {
+        return NULL;
     }
+    h->info.dimensione = numero * dimensione;
+    h->info.sottosistema = (int)s;
+    memoria_conta(s, (int64_t)(numero * dimensione), 1);
+    return h + 1;
+}
 
-    if (cur_ss->indietro) {
-        cur_ss->indietro->avanti = cur_ss->avanti;
-    } else {
-        prima_zona_soprasotto = cur_ss->avanti;
+/* Come realloc: se fallisce il blocco originale resta valido. */
+static void *mem_rialloca(Sottosistema_memoria s, void *p, size_t dimensione)
+{
+    if (!p) {
+        return mem_alloca(s, dimensione);
+    }
+    if (dimensione > SIZE_MAX - sizeof(Intestazione_memoria)) {
+        return NULL;
     }
-    if (cur_ss->avanti) {
-        cur_ss->avanti->indietro = cur_ss->indietro;
+    Intestazione_memoria *h = (Intestazione_memoria *)p - 1;
+    size_t prima = h->info.dimensione;
+    h = (Intestazione_memoria *)realloc(h, sizeof(Intestazione_memoria) + dimensione);
+    if (!h) {
+        return NULL;
     }
+    h->info.dimensione = dimensione;
+    memoria_conta((Sottosistema_memoria)h->info.sottosistema, (int64_t)dimensione - (int64_t)prima, 0);
+    return h + 1;
+}
 
-    for (int i = 0; i < MAX_GIOCATORI; i++) {
-        if (!giocatori[i]) {
-            continue;
-        }
-        if (giocatori[i]->pos_mondoreale == cur_mr) {
-            giocatori[i]->pos_mondoreale = prima_zona_mondoreale;
-        }
-        if (giocatori[i]->pos_soprasotto == cur_ss) {
-            giocatori[i]->pos_soprasotto = prima_zona_soprasotto;
-        }
+static void mem_libera(void *p)
+{
+    if (!p) {
+        return;
     }
+    Intestazione_memoria *h = (Intestazione_memoria *)p - 1;
+    memoria_conta((Sottosistema_memoria)h->info.sottosistema, -(int64_t)h->info.dimensione, -1);
+    free(h);
+}
 
-    free(cur_mr);
-    free(cur_ss);
-    stampa_lenta(15000000L, "Zona cancellata.\n");
+static const char *nome_sottosistema(Sottosistema_memoria s)
+{
+    switch (s) {
+    case memoria_arena:
+        return "arena";
+    case memoria_zone:
+        return "zone";
+    case memoria_giocatori:
+        return "giocatori";
+    case memoria_mappe:
+        return "mappe";
+    case memoria_mondo:
+        return "mondo";
+    case memoria_storia:
+        return "storia";
+    case memoria_classifica:
+        return "classifica";
+    case memoria_simulazione:
+        return "simulazione";
+    case memoria_traccia:
+        return "traccia";
+    default:
+        return "?";
+    }
 }
 
-/*
- * Stampa i campi di una zona del Mondo Reale.
- */
-static void stampa_zona_mr(Zona_mondoreale *z, int idx)
+/* Contatori di un sottosistema: del thread per zone e giocatori, del processo per gli altri. */
+static Contatori_memoria leggi_contatori(Sottosistema_memoria s)
 {
-    if (!z) {
-        return;
+    if (s == memoria_zone || s == memoria_giocatori) {
+        return memoria_partita[s];
     }
-    stampa_lenta(15000000L, "[%d] tipo=%s nemico=%s oggetto=%s\n", idx, nome_tipo_zona(z->tipo),
-           nome_nemico(z->nemico), nome_oggetto(z->oggetto));
+    const Contatori_processo *p = &memoria_processo[s];
+    Contatori_memoria c;
+    c.vivi = atomic_load_explicit(&p->vivi, memory_order_relaxed);
+    c.picco = atomic_load_explicit(&p->picco, memory_order_relaxed);
+    c.allocazioni = atomic_load_explicit(&p->allocazioni, memory_order_relaxed);
+    c.liberazioni = atomic_load_explicit(&p->liberazioni, memory_order_relaxed);
+    return c;
 }
 
 /*
- * Stampa i campi di una zona del Soprasotto.
+ * Copia i contatori di memoria: zone e giocatori sono quelli della
+ * partita del thread chiamante, gli altri sottosistemi di tutto il processo.
  */
-static void stampa_zona_ss(Zona_soprasotto *z, int idx)
+void memoria_statistiche(Contatori_memoria conti[memoria_numero_sottosistemi])
 {
-    if (!z) {
-        return;
+    for (int s = 0; s < memoria_numero_sottosistemi; s++) {
+        conti[s] = leggi_contatori((Sottosistema_memoria)s);
     }
-    stampa_lenta(15000000L, "[%d] tipo=%s nemico=%s\n", idx, nome_tipo_zona(z->tipo),
-           nome_nemico(z->nemico));
 }
 
 /*
- * Stampa tutte le zone di una delle due mappe.
+ * Stampa i sottosistemi che hanno ancora memoria in uso e ne
+ * restituisce il numero. Gli anelli della traccia restano per tutto
+ * il processo e non contano come perdita.
  */
-static void stampa_mappa(void)
+int memoria_rapporto(void)
 {
-    int scelta = leggi_intero("Stampa mappa: 0) Mondo Reale 1) Soprasotto: ", 0, 1);
-    if (scelta == 0) {
-        Zona_mondoreale *cur = prima_zona_mondoreale;
-        int idx = 1;
-        while (cur) {
-            stampa_zona_mr(cur, idx++);
-            cur = cur->avanti;
+    int perdite = 0;
+    for (int s = 0; s < memoria_numero_sottosistemi; s++) {
+        Contatori_memoria c = leggi_contatori((Sottosistema_memoria)s);
+        if (s == memoria_traccia || c.vivi == 0) {
+            continue;
         }
-    } else {
-        Zona_soprasotto *cur = prima_zona_soprasotto;
-        int idx = 1;
-        while (cur) {
-            stampa_zona_ss(cur, idx++);
-            cur = cur->avanti;
+        if (perdite++ == 0) {
+            stampa_lenta(15000000L, "Memoria non liberata:\n");
         }
+        stampa_lenta(15000000L, "  %-11s %lld byte (%llu allocazioni, %llu liberazioni, picco %lld)\n",
+                     nome_sottosistema((Sottosistema_memoria)s), (long long)c.vivi,
+                     (unsigned long long)c.allocazioni, (unsigned long long)c.liberazioni,
+                     (long long)c.picco);
     }
+    return perdite;
 }
 
 /*
- * Stampa una zona specifica del Mondo Reale e la sua speculare.
+ * Funzione di mescolamento di splitmix64: da un contatore
+ * produce 64 bit pseudo-casuali ben distribuiti.
  */
-static void stampa_zona_scelta(void)
+static uint64_t mescola64(uint64_t x)
 {
-    int len = conta_zone_mr();
-    if (len == 0) {
-        stampa_lenta(15000000L, "Mappa vuota.\n");
-        return;
-    }
-    int pos = leggi_intero("Posizione zona (1..len): ", 1, len);
-    Zona_mondoreale *cur_mr = prima_zona_mondoreale;
-    Zona_soprasotto *cur_ss = prima_zona_soprasotto;
-    for (int i = 1; i < pos && cur_mr && cur_ss; i++) {
-        cur_mr = cur_mr->avanti;
-        cur_ss = cur_ss->avanti;
-    }
-    stampa_lenta(15000000L, "Mondo Reale: ");
-    stampa_zona_mr(cur_mr, pos);
-    stampa_lenta(15000000L, "Soprasotto: ");
-    stampa_zona_ss(cur_ss, pos);
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
 }
 
 /*
- * Chiude la fase di creazione della mappa verificando i vincoli:
- * almeno 15 zone e un solo demotorzone nel Soprasotto.
+ * Gruppo di 16 bit di indice dato nel flusso che parte dall'hash h:
+ * i primi quattro sono in h, ogni quattro successivi si rimescola.
  */
-
-static void chiudi_mappa(void)
+static uint32_t hash_16(uint64_t h, int gruppo)
 {
-    int len = conta_zone_mr();
-    int demotorzone_count = conta_demotorzone_ss();
-    if (len < 15) {
-        stampa_lenta(15000000L, "Servono almeno 15 zone per chiudere la mappa.\n");
-        return;
+    for (; gruppo >= 4; gruppo -= 4) {
+        h = mescola64(h);
     }
-    if (demotorzone_count != 1) {
-        stampa_lenta(15000000L, "Deve esserci esattamente un demotorzone nel Soprasotto.\n");
-        return;
+    return (uint32_t)((h >> (16 * gruppo)) & 0xFFFF);
+}
+
+/* Imposta il seme del generatore del thread corrente. */
+static void semina_rng(uint64_t seme)
+{
+    stato_rng = seme;
+    rng_init = 1;
+}
+
+/* Inizializza il generatore di numeri casuali una sola volta. */
+static void init_rng(void)
+{
+    if (!rng_init) {
+        semina_rng((uint64_t)ora_corrente());
     }
-    mappa_chiusa = 1;
-    stampa_lenta(15000000L, "Mappa chiusa correttamente.\n");
 }
 
 /*
- * Menu interattivo per costruire la mappa; resta attivo
- * finché non si chiama con successo chiudi_mappa().
+ * Restituisce un intero casuale compreso tra min e max inclusi.
+ * Il generatore e' splitmix64 su un contatore locale al thread.
  */
-
-static void menu_imposta_mappa(void)
+static int randint(int min, int max)
 {
-    int scelta;
-    do {
-        stampa_lenta(15000000L, "\n--- Menu Impostazione Mappa ---\n");
-        stampa_lenta(15000000L, "1) genera_mappa\n");
-        stampa_lenta(15000000L, "2) inserisci_zona\n");
-        stampa_lenta(15000000L, "3) cancella_zona\n");
-        stampa_lenta(15000000L, "4) stampa_mappa\n");
-        stampa_lenta(15000000L, "5) stampa_zona\n");
-        stampa_lenta(15000000L, "6) chiudi_mappa\n");
-        scelta = leggi_intero("Scelta: ", 1, 6);
-        switch (scelta) {
-        case 1:
-            genera_mappa();
-            break;
-        case 2:
-            inserisci_zona();
-            break;
-        case 3:
-            cancella_zona();
-            break;
-        case 4:
-            stampa_mappa();
-            break;
-        case 5:
-            stampa_zona_scelta();
-            break;
-        case 6:
-            chiudi_mappa();
-            break;
-        default:
-            break;
-        }
-    } while (!mappa_chiusa);
+    int range = max - min + 1;
+    return min + (int)(mescola64(stato_rng++) % (uint64_t)range);
 }
 
 /*
- * Imposta le statistiche iniziali del giocatore (d20),
- * applica eventuali modifiche e prepara lo zaino vuoto.
+ * Legge una riga di input senza il newline finale.
+ * Prima consuma i tasti anticipati durante la stampa (mostrandoli,
+ * perche' il terminale non ne aveva fatto l'eco), poi legge da stdin
+ * il resto della riga. Restituisce 0 a fine input.
+ * Con un ingresso esterno la riga arriva dall'ospite.
  */
-
-static void inizializza_giocatore(Giocatore *g)
+static int leggi_riga(char *dest, size_t max_len)
 {
-    int dado = randint(1, 20);
-    g->attacco_psichico = dado;
-    g->difesa_psichica = dado;
-    g->fortuna = dado;
-
-    stampa_lenta(15000000L, "Valori iniziali (d20=%d): attacco=%d difesa=%d fortuna=%d\n",
-           dado, g->attacco_psichico, g->difesa_psichica, g->fortuna);
-
-    stampa_lenta(15000000L, "Scegli modifica: 1) +3 attacco, -3 difesa 2) +3 difesa, -3 attacco 3) nessuna\n");
-    int scelta = leggi_intero("Scelta: ", 1, 3);
-    if (scelta == 1) {
-        g->attacco_psichico += 3;
-        g->difesa_psichica -= 3;
-    } else if (scelta == 2) {
-        g->difesa_psichica += 3;
-        g->attacco_psichico -= 3;
+    size_t len = 0;
+    salta_attesa = 0;
+    if (io_esterno) {
+        if (!io_corrente.leggi_riga || !io_corrente.leggi_riga(io_corrente.contesto, dest, max_len)) {
+            dest[0] = '\0';
+            return 0;
+        }
+        return 1;
     }
-
-    if (!undici_virgola_cinque_usato) {
-        int scelta_speciale = leggi_intero("Vuoi diventare UndiciVirgolaCinque? 1) si 2) no: ", 1, 2);
-        if (scelta_speciale == 1) {
-            g->attacco_psichico += 4;
-            g->difesa_psichica += 4;
-            g->fortuna -= 7;
-            snprintf(g->nome, NOME_MAX, "UndiciVirgolaCinque_%s", g->nome);
-            undici_virgola_cinque_usato = 1;
+    while (anticipo_len > 0) {
+        char c = anticipo[0];
+        memmove(anticipo, anticipo + 1, --anticipo_len);
+        fputc(c, stdout);
+        if (c == '\n') {
+            fflush(stdout);
+            dest[len] = '\0';
+            return 1;
+        }
+        if (len + 1 < max_len) {
+            dest[len++] = c;
         }
     }
+    fflush(stdout);
 
-    if (g->attacco_psichico < 1) {
-        g->attacco_psichico = 1;
-    }
-    if (g->difesa_psichica < 1) {
-        g->difesa_psichica = 1;
-    }
-    if (g->fortuna < 1) {
-        g->fortuna = 1;
-    }
-    if (g->attacco_psichico > 20) {
-        g->attacco_psichico = 20;
+    char resto[256];
+    if (fgets(resto, sizeof(resto), stdin) == NULL) {
+        dest[len] = '\0';
+        return len > 0;
     }
-    if (g->difesa_psichica > 20) {
-        g->difesa_psichica = 20;
+    int riga_completa = strchr(resto, '\n') != NULL;
+    resto[strcspn(resto, "\n")] = '\0';
+    for (const char *p = resto; *p && len + 1 < max_len; ++p) {
+        dest[len++] = *p;
     }
-    if (g->fortuna > 20) {
-        g->fortuna = 20;
+    dest[len] = '\0';
+    /* Una riga piu' lunga del buffer viene scartata fino al newline. */
+    while (!riga_completa && fgets(resto, sizeof(resto), stdin) != NULL) {
+        riga_completa = strchr(resto, '\n') != NULL;
     }
+    return 1;
+}
 
-    for (int i = 0; i < ZAINO_MAX; i++) {
-        g->zaino[i] = nessun_oggetto;
+/*
+ * Legge un comando numerico per il menu principale.
+ * Restituisce 1 se la riga contiene un intero.
+ */
+int leggi_comando(int *valore)
+{
+    char riga[256];
+    if (!leggi_riga(riga, sizeof(riga))) {
+        return 0;
     }
+    return sscanf(riga, "%d", valore) == 1;
 }
 
 /*
- * Fase di setup del gioco: crea i giocatori, azzera stato precedente
- * e avvia il menu di creazione mappa.
+ * Legge un intero da tastiera con verifica:
+ * ripete la richiesta finché il valore non è nel range.
  */
 
-void imposta_gioco(void)
+static int leggi_intero(const char *prompt, int min, int max)
 {
-    init_rng();
-
-    libera_mappa();
-    libera_giocatori();
-    mappa_chiusa = 0;
-
-    num_giocatori = leggi_intero("Numero giocatori (1-4): ", 1, 4);
-    for (int i = 0; i < num_giocatori; i++) {
-        giocatori[i] = (Giocatore *)malloc(sizeof(Giocatore));
-        if (!giocatori[i]) {
-            stampa_lenta(15000000L, "Errore di allocazione giocatore.\n");
-            libera_giocatori();
-            return;
-        }
-        memset(giocatori[i], 0, sizeof(Giocatore));
-        leggi_stringa("Nome giocatore: ", giocatori[i]->nome, NOME_MAX);
-        inizializza_giocatore(giocatori[i]);
-    }
+    int valore = min;
+    int letti;
+    char riga[256];
+    /* Loop del menu di configurazione: termina solo quando la mappa è chiusa. */
+    do {
+        if (schermo_attivo) {
+            schermo_prompt(prompt);
+        } else {
+            stampa_lenta(15000000L, "%s", prompt);
+        }
+        /* Come scanf("%d"), le righe vuote non contano come risposta. */
+        do {
+            letti = leggi_riga(riga, sizeof(riga));
+        } while (letti && riga[strspn(riga, " \t")] == '\0');
+        if (schermo_attivo) {
+            schermo_dopo_input();
+        }
+        if (!letti || sscanf(riga, "%d", &valore) != 1) {
+            letti = 0;
+            stampa_lenta(15000000L, "Input non valido.\n");
+            continue;
+        }
+        if (valore < min || valore > max) {
+            stampa_lenta(15000000L, "Valore fuori range (%d-%d).\n", min, max);
+        }
+    } while (letti != 1 || valore < min || valore > max);
+    return valore;
+}
+
+/*
+ * Legge una stringa (nome giocatore) e rimuove il newline finale.
+ * Se l'utente inserisce una riga vuota usa un nome di default.
+ */
+
+static void leggi_stringa(const char *prompt, char *dest, size_t max_len)
+{
+    stampa_lenta(15000000L, "%s", prompt);
+    if (!leggi_riga(dest, max_len)) {
+        dest[0] = '\0';
+        return;
+    }
+    if (dest[0] == '\0') {
+        strncpy(dest, "Giocatore", max_len);
+        dest[max_len - 1] = '\0';
+    }
+}
+
+static const char *nome_tipo_zona(Tipo_zona tipo)
+{
+    switch (tipo) {
+    case bosco:
+        return "bosco";
+    case scuola:
+        return "scuola";
+    case laboratorio:
+        return "laboratorio";
+    case caverna:
+        return "caverna";
+    case strada:
+        return "strada";
+    case giardino:
+        return "giardino";
+    case supermercato:
+        return "supermercato";
+    case centrale_elettrica:
+        return "centrale_elettrica";
+    case deposito_abbandonato:
+        return "deposito_abbandonato";
+    case stazione_polizia:
+        return "stazione_polizia";
+    default:
+        return "sconosciuto";
+    }
+}
+
+static const char *nome_nemico(Tipo_nemico nemico)
+{
+    switch (nemico) {
+    case nessun_nemico:
+        return "nessun_nemico";
+    case billi:
+        return "billi";
+    case democane:
+        return "democane";
+    case demotorzone:
+        return "demotorzone";
+    default:
+        return "sconosciuto";
+    }
+}
+
+/*
+ * Regole di ciascun mondo, indicizzate dal mondo. Il nemico di una zona
+ * nuova si estrae con un d100: vale la prima fascia la cui soglia arriva
+ * al tiro, e i nemici delle fasce sono gli unici ammessi nel mondo (il
+ * demotorzone solo nell'ultimo; altrove la sua fascia da' un democane).
+ * A fine round in una zona vuota compare uno dei due nemici di comparsa,
+ * scelto con un bit casuale. I mondi oltre quelli descritti seguono
+ * le regole dell'ultimo e prendono il suo nome con la profondita'.
+ */
+#define FASCE_NEMICO 3
+#define MONDO_DEMOTORZONE (NUM_MONDI - 1)
+
+_Static_assert(NUM_MONDI >= 2, "servono almeno il Mondo Reale e il Soprasotto");
+
+typedef struct {
+    const char *nome;
+    const char *sigla;
+    struct {
+        Tipo_nemico nemico;
+        int soglia;
+    } fasce[FASCE_NEMICO];
+    Tipo_nemico comparsa[2];
+} Descrizione_mondo;
+
+static const Descrizione_mondo mondi_descritti[] = {
+    {"Mondo Reale", "MR", {{nessun_nemico, 40}, {democane, 70}, {billi, 100}}, {billi, democane}},
+    {"Soprasotto", "SS", {{nessun_nemico, 45}, {democane, 80}, {demotorzone, 100}}, {democane, democane}},
+};
+
+#define MONDI_DESCRITTI ((int)(sizeof(mondi_descritti) / sizeof(mondi_descritti[0])))
+
+static const Descrizione_mondo *descrizione_mondo(int mondo)
+{
+    return &mondi_descritti[mondo < MONDI_DESCRITTI ? mondo : MONDI_DESCRITTI - 1];
+}
+
+#define NOME_MONDO_MAX 32
+
+static char nomi_mondi[NUM_MONDI][NOME_MONDO_MAX];
+static char sigle_mondi[NUM_MONDI][8];
+static pthread_once_t nomi_mondi_composti = PTHREAD_ONCE_INIT;
+
+static void componi_nomi_mondi(void)
+{
+    for (int m = 0; m < NUM_MONDI; m++) {
+        const Descrizione_mondo *d = descrizione_mondo(m);
+        if (m < MONDI_DESCRITTI) {
+            snprintf(nomi_mondi[m], sizeof(nomi_mondi[m]), "%s", d->nome);
+            snprintf(sigle_mondi[m], sizeof(sigle_mondi[m]), "%s", d->sigla);
+        } else {
+            snprintf(nomi_mondi[m], sizeof(nomi_mondi[m]), "%s %d", d->nome, m - MONDI_DESCRITTI + 2);
+            snprintf(sigle_mondi[m], sizeof(sigle_mondi[m]), "%s%d", d->sigla, m - MONDI_DESCRITTI + 2);
+        }
+    }
+}
+
+static const char *nome_mondo(int mondo)
+{
+    if (mondo < 0 || mondo >= NUM_MONDI) {
+        return "sconosciuto";
+    }
+    pthread_once(&nomi_mondi_composti, componi_nomi_mondi);
+    return nomi_mondi[mondo];
+}
+
+/* Sigla del mondo per le intestazioni brevi (MR, SS, ...). */
+static const char *sigla_mondo(int mondo)
+{
+    pthread_once(&nomi_mondi_composti, componi_nomi_mondi);
+    return sigle_mondi[mondo];
+}
+
+/* Nemico di una zona nuova nel mondo per un tiro di d100. */
+static Tipo_nemico nemico_da_tiro(int mondo, int tiro)
+{
+    const Descrizione_mondo *d = descrizione_mondo(mondo);
+    for (int k = 0; k < FASCE_NEMICO - 1; k++) {
+        if (tiro <= d->fasce[k].soglia) {
+            return d->fasce[k].nemico;
+        }
+    }
+    return d->fasce[FASCE_NEMICO - 1].nemico;
+}
+
+/* Indica se il nemico puo' stare nel mondo. */
+static int nemico_ammesso(int mondo, Tipo_nemico nemico)
+{
+    if (nemico == demotorzone && mondo != MONDO_DEMOTORZONE) {
+        return 0;
+    }
+    const Descrizione_mondo *d = descrizione_mondo(mondo);
+    for (int k = 0; k < FASCE_NEMICO; k++) {
+        if (d->fasce[k].nemico == nemico) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const char *nome_oggetto(Tipo_oggetto oggetto)
+{
+    switch (oggetto) {
+    case nessun_oggetto:
+        return "nessun_oggetto";
+    case bicicletta:
+        return "bicicletta";
+    case maglietta_fuocoinferno:
+        return "maglietta_fuocoinferno";
+    case bussola:
+        return "bussola";
+    case schitarrata_metallica:
+        return "schitarrata_metallica";
+    default:
+        return "sconosciuto";
+    }
+}
+
+
+/*
+ * Restituisce le statistiche base del nemico scelto.
+ */
+static NemicoStats stats_nemico(Tipo_nemico nemico)
+{
+    NemicoStats s;
+    switch (nemico) {
+    case billi:
+        s.hp = 12;
+        s.attacco = 8;
+        s.difesa = 8;
+        break;
+    case democane:
+        s.hp = 16;
+        s.attacco = 10;
+        s.difesa = 10;
+        break;
+    case demotorzone:
+        s.hp = 24;
+        s.attacco = 14;
+        s.difesa = 12;
+        break;
+    case nessun_nemico:
+    default:
+        s.hp = 0;
+        s.attacco = 0;
+        s.difesa = 0;
+        break;
+    }
+    return s;
+}
+
+/*
+ * Traccia degli eventi di gioco: ogni thread scrive in un suo anello
+ * di record binari di dimensione fissa, senza lock (e' l'unico scrittore).
+ * Quando l'anello e' pieno si sovrascrivono gli eventi piu' vecchi.
+ * Gli anelli stanno in una lista globale (inserimento con CAS) e vengono
+ * riusati dai thread successivi quando il loro thread termina.
+ */
+#define TRACCIA_CAPACITA 65536
+#define TRACCIA_MAGIC "CSTRACC1"
+
+typedef struct Anello_traccia {
+    struct Anello_traccia *prossimo;
+    atomic_int in_uso;
+    uint32_t id;
+    atomic_size_t scritti;
+    Evento_traccia eventi[TRACCIA_CAPACITA];
+} Anello_traccia;
+
+static atomic_int traccia_attiva = 0;
+static _Atomic(Anello_traccia *) anelli_traccia = NULL;
+static atomic_uint anelli_creati = 0;
+static _Thread_local Anello_traccia *anello_thread = NULL;
+static pthread_key_t chiave_traccia;
+static pthread_once_t chiave_traccia_creata = PTHREAD_ONCE_INIT;
+
+/* Alla fine del thread il suo anello torna disponibile (gli eventi restano). */
+static void rilascia_anello_traccia(void *anello)
+{
+    atomic_store_explicit(&((Anello_traccia *)anello)->in_uso, 0, memory_order_release);
+}
+
+static void crea_chiave_traccia(void)
+{
+    pthread_key_create(&chiave_traccia, rilascia_anello_traccia);
+}
+
+/* Anello del thread corrente: se ne riusa uno libero o se ne aggiunge uno. */
+static Anello_traccia *anello_traccia(void)
+{
+    if (anello_thread) {
+        return anello_thread;
+    }
+    pthread_once(&chiave_traccia_creata, crea_chiave_traccia);
+    Anello_traccia *a = atomic_load_explicit(&anelli_traccia, memory_order_acquire);
+    for (; a; a = a->prossimo) {
+        int libero = 0;
+        if (atomic_compare_exchange_strong(&a->in_uso, &libero, 1)) {
+            break;
+        }
+    }
+    if (!a) {
+        a = (Anello_traccia *)mem_alloca(memoria_traccia, sizeof(Anello_traccia));
+        if (!a) {
+            return NULL;
+        }
+        atomic_init(&a->in_uso, 1);
+        atomic_init(&a->scritti, 0);
+        a->id = atomic_fetch_add(&anelli_creati, 1) + 1;
+        a->prossimo = atomic_load_explicit(&anelli_traccia, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&anelli_traccia, &a->prossimo, a,
+                                                      memory_order_release, memory_order_relaxed)) {
+        }
+    }
+    pthread_setspecific(chiave_traccia, a);
+    anello_thread = a;
+    return a;
+}
+
+/*
+ * Registra un evento del giocatore g (NULL se non riguarda un giocatore).
+ * Con la traccia disattivata costa solo la lettura di un flag.
+ */
+static void traccia(Tipo_evento tipo, const Giocatore *g, int dettaglio, int32_t valore, int32_t valore2)
+{
+    if (!atomic_load_explicit(&traccia_attiva, memory_order_relaxed)) {
+        return;
+    }
+    Anello_traccia *a = anello_traccia();
+    if (!a) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    size_t n = atomic_load_explicit(&a->scritti, memory_order_relaxed);
+    Evento_traccia *e = &a->eventi[n % TRACCIA_CAPACITA];
+    e->istante_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    e->giocatore = g ? (uint32_t)(g - giocatori) : UINT32_MAX;
+    e->valore = valore;
+    e->valore2 = valore2;
+    e->tipo = (uint8_t)tipo;
+    e->dettaglio = (uint8_t)dettaglio;
+    atomic_store_explicit(&a->scritti, n + 1, memory_order_release);
+}
+
+/*
+ * Attiva o disattiva la traccia; attivandola si svuotano gli anelli.
+ * Va chiamata quando non ci sono partite in corso in altri thread.
+ */
+void traccia_abilita(int attiva)
+{
+    if (attiva) {
+        for (Anello_traccia *a = atomic_load(&anelli_traccia); a; a = a->prossimo) {
+            atomic_store(&a->scritti, 0);
+        }
+    }
+    atomic_store(&traccia_attiva, attiva);
+}
+
+/*
+ * Salva gli eventi di tutti gli anelli nel formato binario:
+ * intestazione TRACCIA_MAGIC, poi per ogni anello id (32 bit),
+ * numero di eventi (64 bit) e i record in ordine di scrittura.
+ * Restituisce 0 in caso di errore.
+ */
+int traccia_salva(const char *percorso)
+{
+    FILE *f = fopen(percorso, "wb");
+    if (!f) {
+        return 0;
+    }
+    int ok = fwrite(TRACCIA_MAGIC, 8, 1, f) == 1;
+    for (Anello_traccia *a = atomic_load(&anelli_traccia); a && ok; a = a->prossimo) {
+        size_t scritti = atomic_load_explicit(&a->scritti, memory_order_acquire);
+        uint64_t n = scritti < TRACCIA_CAPACITA ? scritti : TRACCIA_CAPACITA;
+        uint32_t id = a->id;
+        ok = fwrite(&id, sizeof(id), 1, f) == 1 && fwrite(&n, sizeof(n), 1, f) == 1;
+        for (size_t i = scritti - (size_t)n; i < scritti && ok; i++) {
+            ok = fwrite(&a->eventi[i % TRACCIA_CAPACITA], sizeof(Evento_traccia), 1, f) == 1;
+        }
+    }
+    return fclose(f) == 0 && ok;
+}
+
+static const char *nome_evento(Tipo_evento tipo)
+{
+    switch (tipo) {
+    case evento_inizio_turno:
+    case evento_fine_turno:
+        return "turno";
+    case evento_movimento:
+        return "movimento";
+    case evento_cambio_mondo:
+        return "cambio_mondo";
+    case evento_round_combattimento:
+        return "round_combattimento";
+    case evento_uso_oggetto:
+        return "uso_oggetto";
+    case evento_morte:
+        return "morte";
+    case evento_vittoria:
+        return "vittoria";
+    default:
+        return "sconosciuto";
+    }
+}
+
+/*
+ * Converte una traccia binaria nel formato JSON di Chrome/Perfetto:
+ * i turni diventano intervalli (B/E), gli altri eventi istanti.
+ * Ogni anello e' una riga (tid) della timeline. Restituisce 0 in caso di errore.
+ */
+int traccia_esporta_chrome(const char *binario, const char *json)
+{
+    FILE *in = fopen(binario, "rb");
+    if (!in) {
+        return 0;
+    }
+    char magic[8];
+    if (fread(magic, 8, 1, in) != 1 || memcmp(magic, TRACCIA_MAGIC, 8) != 0) {
+        fclose(in);
+        return 0;
+    }
+    FILE *out = fopen(json, "w");
+    if (!out) {
+        fclose(in);
+        return 0;
+    }
+    fputs("{\"traceEvents\":[\n", out);
+    int primo = 1;
+    int ok = 1;
+    uint32_t id;
+    uint64_t n;
+    while (ok && fread(&id, sizeof(id), 1, in) == 1) {
+        ok = fread(&n, sizeof(n), 1, in) == 1;
+        for (uint64_t i = 0; i < n && ok; i++) {
+            Evento_traccia e;
+            if (fread(&e, sizeof(e), 1, in) != 1) {
+                ok = 0;
+                break;
+            }
+            Tipo_evento tipo = (Tipo_evento)e.tipo;
+            const char *fase = tipo == evento_inizio_turno ? "B" : (tipo == evento_fine_turno ? "E" : "i");
+            fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u%s,"
+                         "\"args\":{\"giocatore\":%ld,\"dettaglio\":%u,\"valore\":%d,\"valore2\":%d}}",
+                    primo ? "" : ",\n", nome_evento(tipo), fase, (double)e.istante_ns / 1000.0, id,
+                    *fase == 'i' ? ",\"s\":\"t\"" : "",
+                    e.giocatore == UINT32_MAX ? -1L : (long)e.giocatore, e.dettaglio, e.valore, e.valore2);
+            primo = 0;
+        }
+    }
+    fputs("\n]}\n", out);
+    fclose(in);
+    return fclose(out) == 0 && ok;
+}
+
+/*
+ * Attiva o disattiva la traccia dal menu: alla disattivazione gli eventi
+ * vengono salvati in FILE_TRACCIA e convertiti in FILE_TRACCIA_JSON.
+ */
+#define FILE_TRACCIA "traccia.bin"
+#define FILE_TRACCIA_JSON "traccia.json"
+
+void alterna_traccia(void)
+{
+    if (!atomic_load(&traccia_attiva)) {
+        traccia_abilita(1);
+        stampa_lenta(15000000L, "Traccia eventi attivata.\n");
+        return;
+    }
+    traccia_abilita(0);
+    if (!traccia_salva(FILE_TRACCIA) || !traccia_esporta_chrome(FILE_TRACCIA, FILE_TRACCIA_JSON)) {
+        stampa_lenta(15000000L, "Errore durante il salvataggio della traccia.\n");
+        return;
+    }
+    stampa_lenta(15000000L, "Traccia salvata in %s e %s.\n", FILE_TRACCIA, FILE_TRACCIA_JSON);
+}
+
+/*
+ * Mappa di calore delle simulazioni: ogni thread (o processo figlio) conta
+ * gli eventi per zona nel proprio array, senza sincronizzazione; gli array
+ * vengono sommati alla fine. Fuori dalle simulazioni calore_thread e' NULL
+ * e il conteggio costa un confronto.
+ */
+static _Thread_local Mappa_calore *calore_thread = NULL;
+
+int mappa_calore_crea(Mappa_calore *c, size_t lunghezza)
+{
+    c->lunghezza = lunghezza;
+    c->zone = (Contatori_zona *)mem_calloca(memoria_simulazione, NUM_MONDI * lunghezza, sizeof(Contatori_zona));
+    if (!c->zone) {
+        c->lunghezza = 0;
+        return 0;
+    }
+    return 1;
+}
+
+void mappa_calore_libera(Mappa_calore *c)
+{
+    mem_libera(c->zone);
+    c->zone = NULL;
+    c->lunghezza = 0;
+}
+
+/* Somma i contatori di parziale in totale (stessa lunghezza). */
+static void somma_calore(Mappa_calore *totale, const Mappa_calore *parziale)
+{
+    for (size_t i = 0; i < NUM_MONDI * totale->lunghezza; i++) {
+        for (int k = 0; k < calore_numero_eventi; k++) {
+            totale->zone[i].eventi[k] += parziale->zone[i].eventi[k];
+        }
+    }
+}
+
+/* Conta un evento nella zona del giocatore g, nel mondo in cui si trova. */
+static void conta_calore(const Giocatore *g, Evento_calore evento)
+{
+    Mappa_calore *c = calore_thread;
+    if (!c || !g->pos) {
+        return;
+    }
+    size_t indice = g->pos->indice;
+    if (indice < c->lunghezza) {
+        c->zone[NUM_MONDI * indice + (size_t)g->mondo].eventi[evento]++;
+    }
+}
+
+/* Posizione dei campi di una Zona_compatta: i nemici dei mondi sono consecutivi. */
+#define ZC_BIT_TIPO 0
+#define ZC_BIT_NEMICO(mondo) (4 + 2 * (mondo))
+#define ZC_BIT_OGGETTO ZC_BIT_NEMICO(NUM_MONDI)
+
+/* Compone una zona compatta dai suoi campi, con un nemico per mondo. */
+static Zona_compatta zc_componi(Tipo_zona tipo, const Tipo_nemico nemici[NUM_MONDI], Tipo_oggetto oggetto)
+{
+    Zona_compatta z = (Zona_compatta)((Zona_compatta)tipo << ZC_BIT_TIPO);
+    for (int m = 0; m < NUM_MONDI; m++) {
+        z |= (Zona_compatta)((Zona_compatta)nemici[m] << ZC_BIT_NEMICO(m));
+    }
+    return (Zona_compatta)(z | (Zona_compatta)oggetto << ZC_BIT_OGGETTO);
+}
+
+static Tipo_zona zc_tipo(Zona_compatta z)
+{
+    return (Tipo_zona)((z >> ZC_BIT_TIPO) & 0xF);
+}
+
+static Tipo_nemico zc_nemico(Zona_compatta z, int mondo)
+{
+    return (Tipo_nemico)((z >> ZC_BIT_NEMICO(mondo)) & 0x3);
+}
+
+static Tipo_oggetto zc_oggetto(Zona_compatta z)
+{
+    return (Tipo_oggetto)((z >> ZC_BIT_OGGETTO) & 0x7);
+}
+
+static Zona_compatta zc_con_nemico(Zona_compatta z, int mondo, Tipo_nemico nemico)
+{
+    return (Zona_compatta)((z & ~((Zona_compatta)0x3 << ZC_BIT_NEMICO(mondo))) |
+                           (Zona_compatta)nemico << ZC_BIT_NEMICO(mondo));
+}
+
+/* Indica se tipo, oggetto e nemici di ogni mondo della zona sono validi. */
+static int zona_ammessa(Zona_compatta z)
+{
+    if (zc_tipo(z) > stazione_polizia || zc_oggetto(z) > schitarrata_metallica) {
+        return 0;
+    }
+    for (int m = 0; m < NUM_MONDI; m++) {
+        if (!nemico_ammesso(m, zc_nemico(z, m))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Conta i bit a 1 di una parola (popcount portabile). */
+static unsigned conta_bit(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (unsigned)((x * 0x0101010101010101ULL) >> 56);
+}
+
+/* Mappa un blocco grande allineato a 2 MiB. Restituisce NULL se manca memoria. */
+static Blocco_arena *blocco_grande(void)
+{
+    size_t n = ARENA_BLOCCO_GRANDE;
+    char *p = (char *)mmap(NULL, 2 * n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    char *inizio = (char *)(((uintptr_t)p + n - 1) & ~(uintptr_t)(n - 1));
+    if (inizio > p) {
+        munmap(p, (size_t)(inizio - p));
+    }
+    if (inizio + n < p + 2 * n) {
+        munmap(inizio + n, (size_t)(p + 2 * n - (inizio + n)));
+    }
+    madvise(inizio, n, MADV_HUGEPAGE);
+    memoria_conta(memoria_arena, (int64_t)n, 1);
+    Blocco_arena *b = (Blocco_arena *)inizio;
+    b->dimensione = n - sizeof(Blocco_arena);
+    b->grande = 1;
+    return b;
+}
+
+/*
+ * Alloca dimensione byte dall'arena, allineati come max_align_t.
+ * Se il blocco corrente e' pieno passa al successivo (riusandolo)
+ * o ne aggiunge uno nuovo. Restituisce NULL se manca memoria.
+ */
+static void *arena_alloca(Arena *a, size_t dimensione)
+{
+    size_t allineamento = _Alignof(max_align_t);
+    dimensione = (dimensione + allineamento - 1) & ~(allineamento - 1);
+    if (!a->corrente && a->primo) {
+        a->corrente = a->primo;
+        a->corrente->usati = 0;
+    }
+    while (a->corrente && a->corrente->usati + dimensione > a->corrente->dimensione) {
+        Blocco_arena *prossimo = a->corrente->prossimo;
+        /* I blocchi dopo il corrente hanno dati vecchi: si azzerano entrandoci. */
+        while (prossimo && prossimo->dimensione < dimensione) {
+            prossimo = prossimo->prossimo;
+        }
+        if (!prossimo) {
+            break;
+        }
+        prossimo->usati = 0;
+        a->corrente = prossimo;
+    }
+    if (!a->corrente || a->corrente->usati + dimensione > a->corrente->dimensione) {
+        Blocco_arena *b = NULL;
+        if (a->riservati >= ARENA_BLOCCO_GRANDE && dimensione <= ARENA_BLOCCO_GRANDE - sizeof(Blocco_arena)) {
+            b = blocco_grande();
+        }
+        if (!b) {
+            size_t capienza = dimensione > ARENA_BLOCCO ? dimensione : ARENA_BLOCCO;
+            b = (Blocco_arena *)mem_alloca(memoria_arena, sizeof(Blocco_arena) + capienza);
+            if (!b) {
+                return NULL;
+            }
+            b->dimensione = capienza;
+            b->grande = 0;
+        }
+        a->riservati += b->dimensione;
+        b->usati = 0;
+        if (a->corrente) {
+            b->prossimo = a->corrente->prossimo;
+            a->corrente->prossimo = b;
+        } else {
+            b->prossimo = a->primo;
+            a->primo = b;
+        }
+        a->corrente = b;
+    }
+    void *p = (char *)a->corrente->dati + a->corrente->usati;
+    a->corrente->usati += dimensione;
+    return p;
+}
+
+/* Restituisce il punto attuale dell'arena. */
+static Segno_arena arena_segna(const Arena *a)
+{
+    Segno_arena segno;
+    segno.blocco = a->corrente;
+    segno.usati = a->corrente ? a->corrente->usati : 0;
+    return segno;
+}
+
+/*
+ * Libera in O(1) tutto cio' che e' stato allocato dopo il segno:
+ * i blocchi successivi verranno azzerati solo quando serviranno.
+ */
+static void arena_ripristina(Arena *a, Segno_arena segno)
+{
+    a->corrente = segno.blocco;
+    if (segno.blocco) {
+        segno.blocco->usati = segno.usati;
+    }
+}
+
+/* Azzera l'arena in O(1) mantenendo i blocchi per il riuso. */
+static void arena_azzera(Arena *a)
+{
+    a->corrente = NULL;
+}
+
+/* Restituisce al sistema tutti i blocchi dell'arena. */
+static void arena_libera(Arena *a)
+{
+    Blocco_arena *b = a->primo;
+    while (b) {
+        Blocco_arena *prossimo = b->prossimo;
+        if (b->grande) {
+            munmap(b, ARENA_BLOCCO_GRANDE);
+            memoria_conta(memoria_arena, -(int64_t)ARENA_BLOCCO_GRANDE, -1);
+        } else {
+            mem_libera(b);
+        }
+        b = prossimo;
+    }
+    a->primo = NULL;
+    a->corrente = NULL;
+    a->riservati = 0;
+}
+
+/*
+ * Zone cancellate durante la partita: tornano qui e vengono
+ * riusate da crea_zona prima di chiedere memoria all'arena.
+ */
+static _Thread_local Zona *zone_libere = NULL;
+
+static void ricicla_zona(Zona *z)
+{
+    if (z) {
+        memoria_conta_partita(memoria_zone, -(int64_t)sizeof(Zona), -1);
+        z->avanti = zone_libere;
+        zone_libere = z;
+    }
+}
+
+/* Inizializza una zona scollegata dalla sua forma compatta. */
+static void zona_da_compatta(Zona *z, Zona_compatta zc)
+{
+    z->tipo = zc_tipo(zc);
+    for (int m = 0; m < NUM_MONDI; m++) {
+        z->nemico[m] = zc_nemico(zc, m);
+        z->oggetto[m] = nessun_oggetto;
+    }
+    z->oggetto[mondo_reale] = zc_oggetto(zc);
+    z->avanti = NULL;
+    z->indietro = NULL;
+    z->giocatori = NULL;
+    z->indice = 0;
+}
+
+/* Alloca una zona e la inizializza dalla sua forma compatta. */
+static Zona *crea_zona(Zona_compatta zc)
+{
+    Zona *z = zone_libere;
+    if (z) {
+        zone_libere = z->avanti;
+    } else {
+        z = (Zona *)arena_alloca(&arena_partita, sizeof(Zona));
+    }
+    if (z) {
+        memoria_conta_partita(memoria_zone, (int64_t)sizeof(Zona), 1);
+        zona_da_compatta(z, zc);
+    }
+    return z;
+}
+
+/* Nemici di tutti i mondi di una zona, due bit per mondo (come in nemici_mondo). */
+static Nemici_zona nemici_zona(const Zona *z)
+{
+    Nemici_zona nemici = 0;
+    for (int m = 0; m < NUM_MONDI; m++) {
+        nemici |= (Nemici_zona)((Nemici_zona)z->nemico[m] << (2 * m));
+    }
+    return nemici;
+}
+
+/* Imposta i nemici di tutti i mondi di una zona da due bit per mondo. */
+static void applica_nemici(Zona *z, Nemici_zona nemici)
+{
+    for (int m = 0; m < NUM_MONDI; m++) {
+        z->nemico[m] = (Tipo_nemico)((nemici >> (2 * m)) & 3);
+    }
+}
+
+/* Campi dei nemici di una zona compatta, due bit per mondo (come in nemici_mondo). */
+#define ZC_MASCHERA_NEMICI ((((Zona_compatta)1 << (2 * NUM_MONDI)) - 1) << ZC_BIT_NEMICO(0))
+
+static Nemici_zona nemici_compatta(Zona_compatta z)
+{
+    return (Nemici_zona)((z & ZC_MASCHERA_NEMICI) >> ZC_BIT_NEMICO(0));
+}
+
+/* Zona compatta con i nemici presi da due bit per mondo (come in nemici_mondo). */
+static Zona_compatta con_nemici(Zona_compatta z, Nemici_zona nemici)
+{
+    return (Zona_compatta)((z & ~ZC_MASCHERA_NEMICI) | ((Zona_compatta)nemici << ZC_BIT_NEMICO(0)));
+}
+
+/* Forma compatta di una zona. */
+static Zona_compatta zona_compatta(const Zona *z)
+{
+    return zc_componi(z->tipo, z->nemico, z->oggetto[mondo_reale]);
+}
+
+/* Valore di partenza dell'hash che sceglie la posizione del demotorzone. */
+#define SALE_DEMOTORZONE 0x5eed5eed5eed5eedULL
+
+/*
+ * Cerca una chiave nella tabella; le chiavi sono salvate come indice+1
+ * cosi' lo zero indica una cella vuota. Restituisce la cella o -1.
+ */
+static long tabella_cella(const Tabella_zone *t, size_t chiave)
+{
+    if (t->capacita == 0) {
+        return -1;
+    }
+    size_t maschera = t->capacita - 1;
+    size_t i = (size_t)mescola64(chiave) & maschera;
+    while (t->chiavi[i] != 0) {
+        if (t->chiavi[i] == (uint64_t)chiave + 1) {
+            return (long)i;
+        }
+        i = (i + 1) & maschera;
+    }
+    return -1;
+}
+
+static int tabella_cerca(const Tabella_zone *t, size_t chiave, uint64_t *valore)
+{
+    long cella = tabella_cella(t, chiave);
+    if (cella < 0) {
+        return 0;
+    }
+    *valore = t->valori[cella];
+    return 1;
+}
+
+/*
+ * Inserisce o aggiorna una chiave, raddoppiando la tabella
+ * quando il riempimento supera i tre quarti; la memoria va al sottosistema s.
+ * Restituisce 0 se manca memoria.
+ */
+static int tabella_inserisci(Tabella_zone *t, Sottosistema_memoria s, size_t chiave, uint64_t valore)
+{
+    long cella = tabella_cella(t, chiave);
+    if (cella >= 0) {
+        t->valori[cella] = valore;
+        return 1;
+    }
+    if ((t->occupati + 1) * 4 > t->capacita * 3) {
+        size_t nuova = t->capacita ? t->capacita * 2 : 16;
+        uint64_t *chiavi = (uint64_t *)mem_calloca(s, nuova, sizeof(uint64_t));
+        uint64_t *valori = (uint64_t *)mem_alloca(s, nuova * sizeof(uint64_t));
+        if (!chiavi || !valori) {
+            mem_libera(chiavi);
+            mem_libera(valori);
+            return 0;
+        }
+        for (size_t i = 0; i < t->capacita; i++) {
+            if (t->chiavi[i] != 0) {
+                size_t j = (size_t)mescola64(t->chiavi[i] - 1) & (nuova - 1);
+                while (chiavi[j] != 0) {
+                    j = (j + 1) & (nuova - 1);
+                }
+                chiavi[j] = t->chiavi[i];
+                valori[j] = t->valori[i];
+            }
+        }
+        mem_libera(t->chiavi);
+        mem_libera(t->valori);
+        t->chiavi = chiavi;
+        t->valori = valori;
+        t->capacita = nuova;
+    }
+    size_t maschera = t->capacita - 1;
+    size_t i = (size_t)mescola64(chiave) & maschera;
+    while (t->chiavi[i] != 0) {
+        i = (i + 1) & maschera;
+    }
+    t->chiavi[i] = (uint64_t)chiave + 1;
+    t->valori[i] = valore;
+    t->occupati++;
+    return 1;
+}
+
+/*
+ * Rimuove una chiave compattando a ritroso la sequenza di probing,
+ * cosi' non servono marcatori di cella cancellata.
+ */
+static void tabella_rimuovi(Tabella_zone *t, size_t chiave)
+{
+    long cella = tabella_cella(t, chiave);
+    if (cella < 0) {
+        return;
+    }
+    size_t maschera = t->capacita - 1;
+    size_t vuota = (size_t)cella;
+    size_t i = vuota;
+    for (;;) {
+        i = (i + 1) & maschera;
+        if (t->chiavi[i] == 0) {
+            break;
+        }
+        size_t casa = (size_t)mescola64(t->chiavi[i] - 1) & maschera;
+        /* La chiave in i puo' tornare nella cella vuota solo se la sua casa non sta tra le due. */
+        if (((i - casa) & maschera) >= ((i - vuota) & maschera)) {
+            t->chiavi[vuota] = t->chiavi[i];
+            t->valori[vuota] = t->valori[i];
+            vuota = i;
+        }
+    }
+    t->chiavi[vuota] = 0;
+    t->occupati--;
+}
+
+static void tabella_libera(Tabella_zone *t)
+{
+    mem_libera(t->chiavi);
+    mem_libera(t->valori);
+    t->chiavi = NULL;
+    t->valori = NULL;
+    t->capacita = 0;
+    t->occupati = 0;
+}
+
+/*
+ * Prepara una mappa virtuale: nessuna zona viene creata, si calcola
+ * solo dove si trova l'unico demotorzone. lunghezza 0 indica una mappa
+ * illimitata, con il demotorzone entro le prime LUNGHEZZA_MAPPA zone.
+ */
+void mappa_virtuale_crea(Mappa_virtuale *m, uint64_t seme, size_t lunghezza)
+{
+    memset(m, 0, sizeof(*m));
+    m->seme = seme;
+    m->lunghezza = lunghezza ? lunghezza : SIZE_MAX;
+    m->raggio_demotorzone = lunghezza ? lunghezza : LUNGHEZZA_MAPPA;
+    m->indice_demotorzone = (size_t)(mescola64(seme ^ SALE_DEMOTORZONE) % m->raggio_demotorzone);
+}
+
+/* Libera l'overlay delle zone modificate e il riferimento al modello. */
+void mappa_virtuale_libera(Mappa_virtuale *m)
+{
+    tabella_libera(&m->modificate);
+    modello_rilascia(m->modello);
+    m->modello = NULL;
+}
+
+/*
+ * Crea un modello condiviso prendendo possesso della mappa compatta,
+ * che viene svuotata, e vi cerca una volta sola il demotorzone,
+ * cosi' collegarvi una partita non scorre la mappa.
+ * Il chiamante riceve il primo riferimento.
+ * Restituisce NULL se manca memoria; la mappa resta al chiamante.
+ */
+Modello_mappa *modello_crea(Mappa_compatta *m)
+{
+    Modello_mappa *modello = (Modello_mappa *)mem_alloca(memoria_mappe, sizeof(Modello_mappa));
+    if (!modello) {
+        return NULL;
+    }
+    modello->mappa = *m;
+    modello->indice_demotorzone = SIZE_MAX;
+    for (size_t i = 0; i < m->lunghezza; i++) {
+        if (zc_nemico(m->zone[i], MONDO_DEMOTORZONE) == demotorzone) {
+            if (modello->indice_demotorzone != SIZE_MAX) {
+                modello->indice_demotorzone = SIZE_MAX;
+                break;
+            }
+            modello->indice_demotorzone = i;
+        }
+    }
+    atomic_init(&modello->riferimenti, 1);
+    m->zone = NULL;
+    m->lunghezza = 0;
+    return modello;
+}
+
+/* Aggiunge un riferimento al modello e lo restituisce. */
+Modello_mappa *modello_acquisisci(Modello_mappa *modello)
+{
+    atomic_fetch_add_explicit(&modello->riferimenti, 1, memory_order_relaxed);
+    return modello;
+}
+
+/* Rilascia un riferimento: l'ultimo libera la mappa del modello. */
+void modello_rilascia(Modello_mappa *modello)
+{
+    if (!modello) {
+        return;
+    }
+    if (atomic_fetch_sub_explicit(&modello->riferimenti, 1, memory_order_acq_rel) == 1) {
+        libera_mappa_compatta(&modello->mappa);
+        mem_libera(modello);
+    }
+}
+
+/*
+ * Prepara una mappa virtuale che legge le zone dal modello condiviso:
+ * la partita possiede solo l'overlay delle zone che modifica.
+ * Restituisce 0 se il modello non ha esattamente un demotorzone.
+ */
+int mappa_virtuale_da_modello(Mappa_virtuale *m, Modello_mappa *modello)
+{
+    if (modello->indice_demotorzone == SIZE_MAX) {
+        return 0;
+    }
+    memset(m, 0, sizeof(*m));
+    m->modello = modello_acquisisci(modello);
+    m->lunghezza = modello->mappa.lunghezza;
+    m->raggio_demotorzone = modello->mappa.lunghezza;
+    m->indice_demotorzone = modello->indice_demotorzone;
+    return 1;
+}
+
+/*
+ * Cache dei modelli generati da seme e lunghezza, condivisa da tutte le
+ * sessioni: ogni voce tiene un riferimento a un modello in sola lettura.
+ * Le voci formano una lista dalla piu' alla meno usata di recente e
+ * l'indice le trova per hash di seme e lunghezza; oltre la capacita'
+ * si espelle l'ultima, ma le partite che la usano ne tengono vivo il modello.
+ */
+#define CACHE_MAPPE_CAPACITA 16
+
+typedef struct Voce_cache {
+    uint64_t seme;
+    size_t lunghezza;
+    Modello_mappa *modello;
+    struct Voce_cache *prec;
+    struct Voce_cache *succ;
+} Voce_cache;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    Tabella_zone indice;
+    Voce_cache *prima;
+    Voce_cache *ultima;
+    Statistiche_cache_mappe statistiche;
+} Cache_mappe;
+
+static Cache_mappe cache_mappe = {PTHREAD_MUTEX_INITIALIZER, {NULL, NULL, 0, 0}, NULL, NULL,
+                                  {0, 0, 0, 0, CACHE_MAPPE_CAPACITA}};
+
+/* Chiave dell'indice: l'ultimo bit resta libero perche' la tabella salva chiave + 1. */
+static size_t chiave_cache(uint64_t seme, size_t lunghezza)
+{
+    return (size_t)(mescola64(seme ^ mescola64((uint64_t)lunghezza)) >> 1);
+}
+
+static Voce_cache *cache_cerca(uint64_t seme, size_t lunghezza)
+{
+    uint64_t valore;
+    if (!tabella_cerca(&cache_mappe.indice, chiave_cache(seme, lunghezza), &valore)) {
+        return NULL;
+    }
+    Voce_cache *v = (Voce_cache *)(uintptr_t)valore;
+    return v->seme == seme && v->lunghezza == lunghezza ? v : NULL;
+}
+
+static void cache_scollega(Voce_cache *v)
+{
+    if (v->prec) {
+        v->prec->succ = v->succ;
+    } else {
+        cache_mappe.prima = v->succ;
+    }
+    if (v->succ) {
+        v->succ->prec = v->prec;
+    } else {
+        cache_mappe.ultima = v->prec;
+    }
+}
+
+static void cache_in_testa(Voce_cache *v)
+{
+    v->prec = NULL;
+    v->succ = cache_mappe.prima;
+    if (cache_mappe.prima) {
+        cache_mappe.prima->prec = v;
+    } else {
+        cache_mappe.ultima = v;
+    }
+    cache_mappe.prima = v;
+}
+
+/* Toglie la voce meno usata di recente e ne rilascia il modello. */
+static void cache_togli_ultima(void)
+{
+    Voce_cache *v = cache_mappe.ultima;
+    cache_scollega(v);
+    tabella_rimuovi(&cache_mappe.indice, chiave_cache(v->seme, v->lunghezza));
+    modello_rilascia(v->modello);
+    mem_libera(v);
+    cache_mappe.statistiche.voci--;
+}
+
+/*
+ * Genera il modello leggendo le zone con mappa_virtuale_zona da una mappa
+ * virtuale dello stesso seme, cosi' la mappa in cache coincide con quella
+ * generata dal seme o trovata dalla ricerca di semi. Non usa il generatore
+ * della partita del thread.
+ */
+static Modello_mappa *genera_modello(uint64_t seme, size_t lunghezza)
+{
+    Mappa_compatta m;
+    m.zone = (Zona_compatta *)mem_alloca(memoria_mappe, lunghezza * sizeof(Zona_compatta));
+    if (!m.zone) {
+        return NULL;
+    }
+    m.lunghezza = lunghezza;
+    Mappa_virtuale v;
+    mappa_virtuale_crea(&v, seme, lunghezza);
+    for (size_t i = 0; i < lunghezza; i++) {
+        m.zone[i] = mappa_virtuale_zona(&v, i);
+    }
+    Modello_mappa *modello = modello_crea(&m);
+    if (!modello) {
+        libera_mappa_compatta(&m);
+    }
+    return modello;
+}
+
+/*
+ * Restituisce un riferimento al modello di seme e lunghezza dati,
+ * generandolo e mettendolo in cache se non c'e'. Il riferimento va
+ * rilasciato con modello_rilascia. La generazione avviene fuori dal
+ * mutex; se nel frattempo un'altra sessione ha inserito lo stesso
+ * modello si usa il suo. Restituisce NULL se lunghezza e' 0 o manca memoria.
+ */
+Modello_mappa *cache_mappe_ottieni(uint64_t seme, size_t lunghezza)
+{
+    if (lunghezza == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&cache_mappe.mutex);
+    Voce_cache *v = cache_cerca(seme, lunghezza);
+    if (v) {
+        cache_mappe.statistiche.successi++;
+        cache_scollega(v);
+        cache_in_testa(v);
+        Modello_mappa *modello = modello_acquisisci(v->modello);
+        pthread_mutex_unlock(&cache_mappe.mutex);
+        return modello;
+    }
+    cache_mappe.statistiche.mancati++;
+    pthread_mutex_unlock(&cache_mappe.mutex);
+
+    Modello_mappa *modello = genera_modello(seme, lunghezza);
+    if (!modello) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_mappe.mutex);
+    v = cache_cerca(seme, lunghezza);
+    if (v) {
+        Modello_mappa *doppione = modello;
+        modello = modello_acquisisci(v->modello);
+        cache_scollega(v);
+        cache_in_testa(v);
+        pthread_mutex_unlock(&cache_mappe.mutex);
+        modello_rilascia(doppione);
+        return modello;
+    }
+    size_t chiave = chiave_cache(seme, lunghezza);
+    uint64_t occupata;
+    /* Con capacita' 0 o una collisione di chiave il modello non entra in cache. */
+    if (cache_mappe.statistiche.capacita > 0 && !tabella_cerca(&cache_mappe.indice, chiave, &occupata)) {
+        v = (Voce_cache *)mem_alloca(memoria_mappe, sizeof(Voce_cache));
+        if (v && tabella_inserisci(&cache_mappe.indice, memoria_mappe, chiave, (uint64_t)(uintptr_t)v)) {
+            v->seme = seme;
+            v->lunghezza = lunghezza;
+            v->modello = modello_acquisisci(modello);
+            cache_in_testa(v);
+            cache_mappe.statistiche.voci++;
+            while (cache_mappe.statistiche.voci > cache_mappe.statistiche.capacita) {
+                cache_togli_ultima();
+                cache_mappe.statistiche.espulsi++;
+            }
+        } else {
+            mem_libera(v);
+        }
+    }
+    pthread_mutex_unlock(&cache_mappe.mutex);
+    return modello;
+}
+
+/* Cambia il numero massimo di modelli in cache, espellendo i meno usati. */
+void cache_mappe_imposta_capacita(size_t capacita)
+{
+    pthread_mutex_lock(&cache_mappe.mutex);
+    cache_mappe.statistiche.capacita = capacita;
+    while (cache_mappe.statistiche.voci > capacita) {
+        cache_togli_ultima();
+        cache_mappe.statistiche.espulsi++;
+    }
+    pthread_mutex_unlock(&cache_mappe.mutex);
+}
+
+void cache_mappe_statistiche(Statistiche_cache_mappe *s)
+{
+    pthread_mutex_lock(&cache_mappe.mutex);
+    *s = cache_mappe.statistiche;
+    pthread_mutex_unlock(&cache_mappe.mutex);
+}
+
+/* Svuota la cache; i contatori restano. */
+void cache_mappe_svuota(void)
+{
+    pthread_mutex_lock(&cache_mappe.mutex);
+    while (cache_mappe.ultima) {
+        cache_togli_ultima();
+    }
+    tabella_libera(&cache_mappe.indice);
+    pthread_mutex_unlock(&cache_mappe.mutex);
+}
+
+/*
+ * Restituisce la coppia di zone di indice dato: se e' stata modificata
+ * la si legge dall'overlay, altrimenti dal modello condiviso o, senza
+ * modello, dall'hash di seme e indice con le stesse probabilita' di genera_mappa.
+ */
+Zona_compatta mappa_virtuale_zona(const Mappa_virtuale *m, size_t indice)
+{
+    uint64_t salvata;
+    if (tabella_cerca(&m->modificate, indice, &salvata)) {
+        return (Zona_compatta)salvata;
+    }
+    if (m->modello) {
+        return m->modello->mappa.zone[indice];
+    }
+    uint64_t h = mescola64(m->seme + mescola64(indice));
+
+    Tipo_zona tipo = (Tipo_zona)(hash_16(h, 0) % (stazione_polizia + 1));
+
+    int r = (int)(hash_16(h, 2) % 100) + 1;
+    Tipo_oggetto oggetto = nessun_oggetto;
+    if (r > 40) {
+        oggetto = (Tipo_oggetto)(bicicletta + (int)(hash_16(h, 3) % (schitarrata_metallica - bicicletta + 1)));
+    }
+
+    /* Il nemico del Mondo Reale usa il secondo gruppo di 16 bit, gli altri mondi i gruppi dal quinto. */
+    Tipo_nemico nemici[NUM_MONDI];
+    for (int mondo = 0; mondo < NUM_MONDI; mondo++) {
+        r = (int)(hash_16(h, mondo == mondo_reale ? 1 : 3 + mondo) % 100) + 1;
+        nemici[mondo] = nemico_da_tiro(mondo, r);
+        if (nemici[mondo] == demotorzone) {
+            nemici[mondo] = democane;
+        }
+    }
+    if (indice == m->indice_demotorzone) {
+        nemici[MONDO_DEMOTORZONE] = demotorzone;
+    }
+    return zc_componi(tipo, nemici, oggetto);
+}
+
+/* Salva nell'overlay lo stato modificato di una zona. Restituisce 0 se manca memoria. */
+int mappa_virtuale_modifica(Mappa_virtuale *m, size_t indice, Zona_compatta z)
+{
+    return tabella_inserisci(&m->modificate, memoria_mappe, indice, z);
+}
+
+/*
+ * Restituisce la zona materializzata per l'indice dato,
+ * creandola se serve e collegandola alle vicine gia' presenti.
+ * In modalita' mappa virtuale esistono solo le zone occupate dai giocatori.
+ */
+static Zona *materializza_zona(size_t indice)
+{
+    uint64_t valore;
+    if (tabella_cerca(&zone_materializzate, indice, &valore)) {
+        return (Zona *)(uintptr_t)valore;
+    }
+    Zona_compatta zc = mappa_virtuale_zona(&mappa_virtuale, indice);
+    Zona *z = crea_zona(zc);
+    if (!z || !tabella_inserisci(&zone_materializzate, memoria_mappe, indice, (uint64_t)(uintptr_t)z)) {
+        ricicla_zona(z);
+        return NULL;
+    }
+    z->indice = indice;
+    if (nemici_mondo) {
+        applica_nemici(z, nemici_mondo[indice]);
+    }
+
+    if (indice > 0 && tabella_cerca(&zone_materializzate, indice - 1, &valore)) {
+        Zona *prec = (Zona *)(uintptr_t)valore;
+        prec->avanti = z;
+        z->indietro = prec;
+    }
+    if (tabella_cerca(&zone_materializzate, indice + 1, &valore)) {
+        Zona *succ = (Zona *)(uintptr_t)valore;
+        succ->indietro = z;
+        z->avanti = succ;
+    }
+    return z;
+}
+
+/*
+ * Libera una zona materializzata rimasta senza giocatori:
+ * il suo stato, se modificato, e' gia' nell'overlay.
+ */
+static void rilascia_zona(Zona *z)
+{
+    if (!mappa_virtuale_attiva || !z || z->giocatori) {
+        return;
+    }
+    if (z->indietro) {
+        z->indietro->avanti = NULL;
+    }
+    if (z->avanti) {
+        z->avanti->indietro = NULL;
+    }
+    tabella_rimuovi(&zone_materializzate, z->indice);
+    ricicla_zona(z);
+}
+
+/*
+ * Zona successiva/precedente: nella mappa virtuale
+ * viene materializzata al momento, altrimenti si segue la lista.
+ */
+static Zona *zona_successiva(Zona *z)
+{
+    if (!mappa_virtuale_attiva) {
+        return z->avanti;
+    }
+    if (z->indice + 1 >= mappa_virtuale.lunghezza) {
+        return NULL;
+    }
+    return materializza_zona(z->indice + 1);
+}
+
+static Zona *zona_precedente(Zona *z)
+{
+    if (!mappa_virtuale_attiva) {
+        return z->indietro;
+    }
+    if (z->indice == 0) {
+        return NULL;
+    }
+    return materializza_zona(z->indice - 1);
+}
+
+/* Indica se esiste una zona dopo quella data senza materializzarla. */
+static int ha_zona_successiva(Zona *z)
+{
+    if (!mappa_virtuale_attiva) {
+        return z->avanti != NULL;
+    }
+    return z->indice + 1 < mappa_virtuale.lunghezza;
+}
+
+/*
+ * Storia della partita: dopo ogni turno si registra come azione il nuovo
+ * stato del giocatore che ha giocato, se e' cambiato, e ogni modifica di
+ * zona nel momento in cui avviene. Ogni passo turni si salva
+ * un'istantanea completa; per ricostruire un turno si parte
+ * dall'istantanea precedente e si riapplicano poche azioni.
+ * Il passo cresce con il numero di giocatori, cosi' le istantanee non
+ * occupano piu' di uno stato di giocatore per turno.
+ */
+#define STORIA_PASSO_MIN 64
+
+typedef struct {
+    size_t turno;
+    int giocatore;
+    size_t zona;
+    Zona_compatta valore_zona;
+    Stato_giocatore stato;
+} Azione_storia;
+
+typedef struct {
+    Istantanea_partita stato;
+    size_t prima_azione;
+} Punto_storia;
+
+typedef struct {
+    int attiva;
+    size_t turni;
+    size_t passo;
+    int num_giocatori;
+    char (*nomi)[NOME_MAX];
+    Stato_giocatore *giocatori;
+    Tabella_zone zone;
+    Azione_storia *azioni;
+    size_t num_azioni;
+    size_t capacita_azioni;
+    Punto_storia *punti;
+    size_t num_punti;
+    size_t capacita_punti;
+} Storia;
+
+static _Thread_local Storia storia;
+
+static void stato_giocatore(const Giocatore *g, Stato_giocatore *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->vivo = g->indice_vivo >= 0;
+    s->mondo = g->mondo;
+    s->zona = g->pos ? (long)g->pos->indice : -1;
+    s->attacco_psichico = g->attacco_psichico;
+    s->difesa_psichica = g->difesa_psichica;
+    s->fortuna = g->fortuna;
+    memcpy(s->zaino, g->zaino, sizeof(s->zaino));
+}
+
+/* Libera gli array di un'istantanea. */
+void libera_istantanea(Istantanea_partita *ist)
+{
+    mem_libera(ist->giocatori);
+    mem_libera(ist->indici_zone);
+    mem_libera(ist->zone);
+    memset(ist, 0, sizeof(*ist));
+}
+
+/* Copia un'istantanea lasciando spazio per altre extra_zone zone modificate. */
+static int copia_istantanea(Istantanea_partita *dst, const Istantanea_partita *src, size_t extra_zone)
+{
+    size_t zone = src->num_zone + extra_zone;
+    *dst = *src;
+    dst->giocatori = (Stato_giocatore *)mem_alloca(memoria_storia, ((size_t)src->num_giocatori + 1) * sizeof(Stato_giocatore));
+    dst->indici_zone = (size_t *)mem_alloca(memoria_storia, (zone + 1) * sizeof(size_t));
+    dst->zone = (Zona_compatta *)mem_alloca(memoria_storia, (zone + 1) * sizeof(Zona_compatta));
+    if (!dst->giocatori || !dst->indici_zone || !dst->zone) {
+        libera_istantanea(dst);
+        return 0;
+    }
+    memcpy(dst->giocatori, src->giocatori, (size_t)src->num_giocatori * sizeof(Stato_giocatore));
+    if (src->num_zone > 0) {
+        memcpy(dst->indici_zone, src->indici_zone, src->num_zone * sizeof(size_t));
+        memcpy(dst->zone, src->zone, src->num_zone * sizeof(Zona_compatta));
+    }
+    return 1;
+}
+
+/* Interrompe la registrazione della storia liberandone la memoria. */
+static void libera_storia(void)
+{
+    for (size_t i = 0; i < storia.num_punti; i++) {
+        libera_istantanea(&storia.punti[i].stato);
+    }
+    mem_libera(storia.punti);
+    mem_libera(storia.azioni);
+    mem_libera(storia.giocatori);
+    mem_libera(storia.nomi);
+    tabella_libera(&storia.zone);
+    memset(&storia, 0, sizeof(storia));
+}
+
+static void storia_fallita(void)
+{
+    libera_storia();
+    stampa_lenta(15000000L, "Errore di allocazione: storia della partita non disponibile.\n");
+}
+
+/* Salva un'istantanea dello stato registrato alla fine del turno corrente. */
+static int storia_punto(void)
+{
+    if (storia.num_punti == storia.capacita_punti) {
+        size_t nuova = storia.capacita_punti ? storia.capacita_punti * 2 : 16;
+        Punto_storia *p = (Punto_storia *)mem_rialloca(memoria_storia, storia.punti, nuova * sizeof(Punto_storia));
+        if (!p) {
+            return 0;
+        }
+        storia.punti = p;
+        storia.capacita_punti = nuova;
+    }
+    Istantanea_partita vista = {storia.turni, storia.num_giocatori, storia.giocatori, 0, NULL, NULL};
+    Istantanea_partita *ist = &storia.punti[storia.num_punti].stato;
+    if (!copia_istantanea(ist, &vista, storia.zone.occupati)) {
+        return 0;
+    }
+    for (size_t i = 0; i < storia.zone.capacita; i++) {
+        if (storia.zone.chiavi[i] != 0) {
+            ist->indici_zone[ist->num_zone] = (size_t)(storia.zone.chiavi[i] - 1);
+            ist->zone[ist->num_zone] = (Zona_compatta)storia.zone.valori[i];
+            ist->num_zone++;
+        }
+    }
+    storia.punti[storia.num_punti].prima_azione = storia.num_azioni;
+    storia.num_punti++;
+    return 1;
+}
+
+static int storia_aggiungi(const Azione_storia *a)
+{
+    if (storia.num_azioni == storia.capacita_azioni) {
+        size_t nuova = storia.capacita_azioni ? storia.capacita_azioni * 2 : 256;
+        Azione_storia *p = (Azione_storia *)mem_rialloca(memoria_storia, storia.azioni, nuova * sizeof(Azione_storia));
+        if (!p) {
+            return 0;
+        }
+        storia.azioni = p;
+        storia.capacita_azioni = nuova;
+    }
+    storia.azioni[storia.num_azioni++] = *a;
+    return 1;
+}
+
+/* Apre una nuova storia dallo stato iniziale dei giocatori (turno 0). */
+static void storia_inizia(void)
+{
+    libera_storia();
+    storia.num_giocatori = num_giocatori;
+    storia.passo = (size_t)num_giocatori > STORIA_PASSO_MIN ? (size_t)num_giocatori : STORIA_PASSO_MIN;
+    storia.giocatori = (Stato_giocatore *)mem_alloca(memoria_storia, (size_t)num_giocatori * sizeof(Stato_giocatore));
+    storia.nomi = (char (*)[NOME_MAX])mem_alloca(memoria_storia, (size_t)num_giocatori * NOME_MAX);
+    if (!storia.giocatori || !storia.nomi) {
+        storia_fallita();
+        return;
+    }
+    for (int i = 0; i < num_giocatori; i++) {
+        stato_giocatore(&giocatori[i], &storia.giocatori[i]);
+        memcpy(storia.nomi[i], giocatori[i].nome, NOME_MAX);
+    }
+    storia.attiva = 1;
+    if (!storia_punto()) {
+        storia_fallita();
+    }
+}
+
+/* Registra il nuovo stato di una zona modificata nel turno in corso. */
+static void storia_zona_compatta(size_t indice, Zona_compatta valore)
+{
+    if (!storia.attiva) {
+        return;
+    }
+    Azione_storia a;
+    memset(&a, 0, sizeof(a));
+    a.turno = storia.turni + 1;
+    a.giocatore = -1;
+    a.zona = indice;
+    a.valore_zona = valore;
+    if (!tabella_inserisci(&storia.zone, memoria_storia, a.zona, a.valore_zona) || !storia_aggiungi(&a)) {
+        storia_fallita();
+    }
+}
+
+static void storia_zona(const Zona *z)
+{
+    storia_zona_compatta(z->indice, zona_compatta(z));
+}
+
+/*
+ * Chiude il turno del giocatore g: solo chi gioca cambia il proprio
+ * stato, quindi basta confrontare g con l'ultimo stato registrato.
+ */
+static void storia_fine_turno(const Giocatore *g)
+{
+    if (!storia.attiva) {
+        return;
+    }
+    int i = (int)(g - giocatori);
+    Azione_storia a;
+    memset(&a, 0, sizeof(a));
+    a.turno = storia.turni + 1;
+    a.giocatore = i;
+    stato_giocatore(g, &a.stato);
+    if (memcmp(&a.stato, &storia.giocatori[i], sizeof(Stato_giocatore)) != 0) {
+        storia.giocatori[i] = a.stato;
+        if (!storia_aggiungi(&a)) {
+            storia_fallita();
+            return;
+        }
+    }
+    storia.turni++;
+    if (storia.turni % storia.passo == 0 && !storia_punto()) {
+        storia_fallita();
+    }
+}
+
+/* Numero di turni registrati nella storia dell'ultima partita. */
+size_t storia_turni(void)
+{
+    return storia.turni;
+}
+
+/*
+ * Ricostruisce in ist lo stato alla fine del turno dato (0 = inizio
+ * partita): si copia l'ultima istantanea non successiva e si riapplicano
+ * le azioni fino a quel turno. ist va liberata con libera_istantanea.
+ * Restituisce 0 se il turno non e' registrato o manca memoria.
+ */
+int storia_ricostruisci(size_t turno, Istantanea_partita *ist)
+{
+    memset(ist, 0, sizeof(*ist));
+    if (storia.num_punti == 0 || turno > storia.turni) {
+        return 0;
+    }
+    size_t p = storia.num_punti - 1;
+    while (storia.punti[p].stato.turno > turno) {
+        p--;
+    }
+    size_t inizio = storia.punti[p].prima_azione;
+    size_t fine = inizio;
+    size_t zone_nuove = 0;
+    for (; fine < storia.num_azioni && storia.azioni[fine].turno <= turno; fine++) {
+        zone_nuove += storia.azioni[fine].giocatore < 0;
+    }
+    if (!copia_istantanea(ist, &storia.punti[p].stato, zone_nuove)) {
+        return 0;
+    }
+    /* Posizione di ogni zona nell'istantanea: l'aggiornamento del mondo ne cambia molte per turno. */
+    Tabella_zone posizioni = {NULL, NULL, 0, 0};
+    int ok = 1;
+    for (size_t z = 0; ok && z < ist->num_zone; z++) {
+        ok = tabella_inserisci(&posizioni, memoria_storia, ist->indici_zone[z], z);
+    }
+    for (size_t k = inizio; ok && k < fine; k++) {
+        const Azione_storia *a = &storia.azioni[k];
+        if (a->giocatore >= 0) {
+            ist->giocatori[a->giocatore] = a->stato;
+            continue;
+        }
+        uint64_t z;
+        if (!tabella_cerca(&posizioni, a->zona, &z)) {
+            z = ist->num_zone;
+            ist->indici_zone[z] = a->zona;
+            ist->num_zone++;
+            ok = tabella_inserisci(&posizioni, memoria_storia, a->zona, z);
+        }
+        ist->zone[z] = a->valore_zona;
+    }
+    tabella_libera(&posizioni);
+    if (!ok) {
+        libera_istantanea(ist);
+        return 0;
+    }
+    ist->turno = turno;
+    return 1;
+}
+
+/* Mostra lo stato dell'ultima partita a un turno scelto. */
+void rivedi_partita(void)
+{
+    if (storia.num_punti == 0) {
+        stampa_lenta(15000000L, "Nessuna partita da rivedere.\n");
+        return;
+    }
+    char prompt[64];
+    snprintf(prompt, sizeof(prompt), "Turno (0-%zu): ", storia.turni);
+    int turno = leggi_intero(prompt, 0, storia.turni > 2147483647 ? 2147483647 : (int)storia.turni);
+
+    Istantanea_partita ist;
+    if (!storia_ricostruisci((size_t)turno, &ist)) {
+        stampa_lenta(15000000L, "Errore di allocazione durante la ricostruzione.\n");
+        return;
+    }
+    stampa_lenta(15000000L, "\n--- Stato al turno %zu ---\n", ist.turno);
+    for (int i = 0; i < ist.num_giocatori; i++) {
+        const Stato_giocatore *s = &ist.giocatori[i];
+        if (!s->vivo) {
+            stampa_lenta(15000000L, "%s: morto\n", storia.nomi[i]);
+            continue;
+        }
+        stampa_lenta(15000000L, "%s: zona %ld (%s) | att %d dif %d fort %d\n", storia.nomi[i], s->zona,
+                     nome_mondo(s->mondo), s->attacco_psichico, s->difesa_psichica,
+                     s->fortuna);
+    }
+    for (size_t z = 0; z < ist.num_zone; z++) {
+        stampa_lenta(15000000L, "Zona %zu modificata:", ist.indici_zone[z]);
+        for (int m = 0; m < NUM_MONDI; m++) {
+            stampa_lenta(15000000L, " nemico %s %s,", sigla_mondo(m), nome_nemico(zc_nemico(ist.zone[z], m)));
+        }
+        stampa_lenta(15000000L, " oggetto %s\n", nome_oggetto(zc_oggetto(ist.zone[z])));
+    }
+    libera_istantanea(&ist);
+}
+
+/*
+ * Registra la zona modificata nella storia della partita,
+ * nei nemici del mondo se aggiornato e, con la mappa virtuale, nel suo overlay.
+ */
+static void registra_modifica_zona(Zona *z)
+{
+    storia_zona(z);
+    if (nemici_mondo) {
+        nemici_mondo[z->indice] = nemici_zona(z);
+    }
+    if (!mappa_virtuale_attiva) {
+        return;
+    }
+    if (!mappa_virtuale_modifica(&mappa_virtuale, z->indice, zona_compatta(z))) {
+        stampa_lenta(15000000L, "Errore di allocazione: modifica della zona non salvata.\n");
+    }
+}
+
+/*
+ * Ricicla le zone della mappa corrente, a liste o virtuale, senza riportare
+ * indietro l'arena: le zone create dopo, come quelle di un'importazione
+ * appena letta, restano valide. Una catena che appartiene a una versione
+ * salvata viene solo staccata.
+ */
+static void ricicla_mappa(void)
+{
+    if (mappa_salvata) {
+        prima_zona = NULL;
+        mappa_salvata = 0;
+    }
+    while (prima_zona) {
+        Zona *prossima = prima_zona->avanti;
+        ricicla_zona(prima_zona);
+        prima_zona = prossima;
+    }
+    if (mappa_virtuale_attiva) {
+        for (size_t i = 0; i < zone_materializzate.capacita; i++) {
+            if (zone_materializzate.chiavi[i] != 0) {
+                ricicla_zona((Zona *)(uintptr_t)zone_materializzate.valori[i]);
+            }
+        }
+        tabella_libera(&zone_materializzate);
+        mappa_virtuale_libera(&mappa_virtuale);
+        mappa_virtuale_attiva = 0;
+    }
+}
+
+/*
+ * Libera la memoria di tutte le mappe
+ * e ripristina i puntatori globali.
+ * Le zone stanno nell'arena dopo i giocatori: basta tornare al segno
+ * preso alla fine della loro creazione e togliere dai contatori
+ * quelle che crea_zona e ricicla_zona danno ancora in uso.
+ * Se delle versioni salvate tengono vive altre catene, l'arena non si
+ * tocca e le zone della mappa corrente vengono riciclate.
+ */
+
+static void libera_mappa(void)
+{
+    if (catene_salvate > 0) {
+        ricicla_mappa();
+        return;
+    }
+    int64_t byte = memoria_partita[memoria_zone].vivi;
+    memoria_conta_partita(memoria_zone, -byte, -(byte / (int64_t)sizeof(Zona)));
+    if (mappa_virtuale_attiva) {
+        tabella_libera(&zone_materializzate);
+        mappa_virtuale_libera(&mappa_virtuale);
+        mappa_virtuale_attiva = 0;
+    }
+    arena_ripristina(&arena_partita, segno_mappa);
+    zone_libere = NULL;
+    prima_zona = NULL;
+}
+
+/*
+ * Azzera lo stato dei giocatori; la loro memoria appartiene
+ * all'arena e viene recuperata con essa.
+ */
+static void libera_giocatori(void)
+{
+    if (giocatori && num_giocatori > 0) {
+        memoria_conta_partita(memoria_giocatori, -(int64_t)num_giocatori * (int64_t)(sizeof(Giocatore) + sizeof(int)), -1);
+    }
+    giocatori = NULL;
+    vivi = NULL;
+    num_giocatori = 0;
+    num_vivi = 0;
+    undici_virgola_cinque_usato = 0;
+}
+
+/*
+ * Chiude la sessione corrente: mappa, giocatori e dati di appoggio
+ * stanno tutti nell'arena, che viene azzerata con una sola operazione.
+ */
+static void azzera_sessione(void)
+{
+    libera_mappa();
+    libera_giocatori();
+    arena_azzera(&arena_partita);
+    segno_mappa = arena_segna(&arena_partita);
+    mappa_chiusa = 0;
+}
+
+/*
+ * Toglie il giocatore dall'indice inverso della zona in cui si trova.
+ */
+static void scollega_da_zona(Giocatore *g)
+{
+    if (g->precedente_in_zona) {
+        g->precedente_in_zona->prossimo_in_zona = g->prossimo_in_zona;
+    } else if (g->pos && g->pos->giocatori == g) {
+        g->pos->giocatori = g->prossimo_in_zona;
+    }
+    if (g->prossimo_in_zona) {
+        g->prossimo_in_zona->precedente_in_zona = g->precedente_in_zona;
+    }
+    g->prossimo_in_zona = NULL;
+    g->precedente_in_zona = NULL;
+}
+
+/*
+ * Sposta il giocatore nella zona indicata, restando nel suo mondo,
+ * e aggiorna l'indice inverso.
+ */
+static void sposta_giocatore(Giocatore *g, Zona *z)
+{
+    Zona *vecchia = g->pos;
+    scollega_da_zona(g);
+    g->pos = z;
+    if (z) {
+        g->prossimo_in_zona = z->giocatori;
+        if (z->giocatori) {
+            z->giocatori->precedente_in_zona = g;
+        }
+        z->giocatori = g;
+    }
+    if (vecchia != z) {
+        traccia(evento_movimento, g, g->mondo, z ? (int32_t)z->indice : -1, 0);
+        rilascia_zona(vecchia);
+    }
+}
+
+/*
+ * Rimuove un giocatore morto dall'elenco dei vivi in O(1),
+ * spostando l'ultimo vivo nel posto lasciato libero.
+ */
+static void rimuovi_vivo(Giocatore *g)
+{
+    int k = g->indice_vivo;
+    if (k < 0) {
+        return;
+    }
+    int ultimo = vivi[num_vivi - 1];
+    vivi[k] = ultimo;
+    giocatori[ultimo].indice_vivo = k;
+    num_vivi--;
+    g->indice_vivo = -1;
+    conta_calore(g, calore_morte);
+    traccia(evento_morte, g, g->mondo, g->pos ? (int32_t)g->pos->indice : -1, 0);
+    scollega_da_zona(g);
+    Zona *zona = g->pos;
+    g->pos = NULL;
+    rilascia_zona(zona);
+}
+
+/*
+ * Conta quante zone esistono nella mappa a liste.
+ */
+static int conta_zone(void)
+{
+    int count = 0;
+    Zona *cur = prima_zona;
+    while (cur) {
+        count++;
+        cur = cur->avanti;
+    }
+    return count;
+}
+
+/*
+ * Conta quante zone dell'ultimo mondo hanno il demotorzone.
+ */
+static int conta_demotorzone(void)
+{
+    int count = 0;
+    Zona *cur = prima_zona;
+    while (cur) {
+        if (cur->nemico[MONDO_DEMOTORZONE] == demotorzone) {
+            count++;
+        }
+        cur = cur->avanti;
+    }
+    return count;
+}
+
+/*
+ * Estrae casualmente un tipo di zona.
+ */
+static Tipo_zona random_tipo_zona(void)
+{
+    return (Tipo_zona)randint(0, stazione_polizia);
+}
+
+/*
+ * Estrae casualmente un nemico per il mondo dato: puo' essere
+ * il demotorzone, che il chiamante tiene unico.
+ */
+static Tipo_nemico random_nemico(int mondo)
+{
+    return nemico_da_tiro(mondo, randint(1, 100));
+}
+
+/*
+ * Estrae casualmente un oggetto per il Mondo Reale.
+ */
+static Tipo_oggetto random_oggetto(void)
+{
+    int r = randint(1, 100);
+    if (r <= 40) {
+        return nessun_oggetto;
+    }
+    return (Tipo_oggetto)randint(bicicletta, schitarrata_metallica);
+}
+
+/*
+ * Conta i demotorzone dell'ultimo mondo nella mappa compatta.
+ * demotorzone vale 3, quindi basta che entrambi i bit del campo siano a 1:
+ * si esaminano tutte le zone di una parola a 64 bit senza salti.
+ */
+size_t conta_demotorzone_compatta(const Mappa_compatta *m)
+{
+    const size_t per_parola = sizeof(uint64_t) / sizeof(Zona_compatta);
+    uint64_t maschera = 0;
+    for (size_t k = 0; k < per_parola; k++) {
+        maschera |= (uint64_t)1 << (ZC_BIT_NEMICO(MONDO_DEMOTORZONE) + 8 * sizeof(Zona_compatta) * k);
+    }
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + per_parola <= m->lunghezza; i += per_parola) {
+        uint64_t w;
+        memcpy(&w, &m->zone[i], sizeof(w));
+        count += conta_bit(w & (w >> 1) & maschera);
+    }
+    for (; i < m->lunghezza; i++) {
+        count += zc_nemico(m->zone[i], MONDO_DEMOTORZONE) == demotorzone;
+    }
+    return count;
+}
+
+/* Libera l'array di una mappa compatta. */
+void libera_mappa_compatta(Mappa_compatta *m)
+{
+    mem_libera(m->zone);
+    m->zone = NULL;
+    m->lunghezza = 0;
+}
+
+/*
+ * Genera una mappa compatta di lunghezza zone con le stesse regole
+ * (e la stessa sequenza di estrazioni) di genera_mappa:
+ * un solo demotorzone, nell'ultimo mondo; gli altri diventano democane.
+ * Restituisce 0 se l'allocazione fallisce.
+ */
+int genera_mappa_compatta(Mappa_compatta *m, size_t lunghezza)
+{
+    m->zone = (Zona_compatta *)mem_alloca(memoria_mappe, lunghezza * sizeof(Zona_compatta));
+    m->lunghezza = 0;
+    if (!m->zone) {
+        return 0;
+    }
+    m->lunghezza = lunghezza;
+
+    int trovato = 0;
+    for (size_t i = 0; i < lunghezza; i++) {
+        Tipo_nemico nemici[NUM_MONDI];
+        Tipo_zona tipo = random_tipo_zona();
+        nemici[mondo_reale] = random_nemico(mondo_reale);
+        Tipo_oggetto oggetto = random_oggetto();
+        for (int mondo = 0; mondo < NUM_MONDI; mondo++) {
+            if (mondo != mondo_reale) {
+                nemici[mondo] = random_nemico(mondo);
+            }
+            if (nemici[mondo] == demotorzone) {
+                if (trovato || mondo != MONDO_DEMOTORZONE) {
+                    nemici[mondo] = democane;
+                } else {
+                    trovato = 1;
+                }
+            }
+        }
+        m->zone[i] = zc_componi(tipo, nemici, oggetto);
+    }
+    if (!trovato && lunghezza > 0) {
+        size_t pos = (size_t)randint(1, (int)lunghezza) - 1;
+        m->zone[pos] = zc_con_nemico(m->zone[pos], MONDO_DEMOTORZONE, demotorzone);
+    }
+    return 1;
+}
+
+/*
+ * Comprime la mappa corrente (liste collegate) in una mappa compatta.
+ * Restituisce 0 se l'allocazione fallisce.
+ */
+int comprimi_mappa(Mappa_compatta *m)
+{
+    size_t len = (size_t)conta_zone();
+    m->zone = (Zona_compatta *)mem_alloca(memoria_mappe, (len ? len : 1) * sizeof(Zona_compatta));
+    m->lunghezza = 0;
+    if (!m->zone) {
+        return 0;
+    }
+    Zona *cur = prima_zona;
+    for (size_t i = 0; i < len && cur; i++) {
+        m->zone[i] = zona_compatta(cur);
+        cur = cur->avanti;
+    }
+    m->lunghezza = len;
+    return 1;
+}
+
+/*
+ * Sostituisce la mappa corrente con quella compatta, costruendo
+ * la lista collegata in un solo passaggio (si tiene la coda).
+ * Restituisce 0 se l'allocazione fallisce; in tal caso la mappa resta vuota.
+ */
+int espandi_mappa(const Mappa_compatta *m)
+{
+    libera_mappa();
+    Zona *coda = NULL;
+    for (size_t i = 0; i < m->lunghezza; i++) {
+        Zona *z = crea_zona(m->zone[i]);
+        if (!z) {
+            libera_mappa();
+            return 0;
+        }
+        z->indietro = coda;
+        if (coda) {
+            coda->avanti = z;
+        } else {
+            prima_zona = z;
+        }
+        coda = z;
+    }
+    return 1;
+}
+
+/*
+ * Crea da zero la mappa di gioco con 15 zone per mondo,
+ * assegnando tipo, nemico e oggetto in modo casuale e
+ * garantendo la presenza di un solo demotorzone, nell'ultimo mondo.
+ * La mappa viene generata in forma compatta e poi espansa nelle liste.
+ * Restituisce 1 se la mappa corrente e' stata sostituita: anche quando
+ * l'espansione fallisce, perche' a quel punto la mappa e' gia' stata svuotata.
+ */
+
+static int genera_mappa(void)
+{
+    Mappa_compatta m;
+    if (!genera_mappa_compatta(&m, LUNGHEZZA_MAPPA)) {
+        libera_mappa_compatta(&m);
+        stampa_lenta(15000000L, "Errore di allocazione durante la generazione della mappa.\n");
+        return 0;
+    }
+    int espansa = espandi_mappa(&m);
+    libera_mappa_compatta(&m);
+    if (!espansa) {
+        stampa_lenta(15000000L, "Errore di allocazione durante la generazione della mappa.\n");
+        return 1;
+    }
+    stampa_lenta(15000000L, "Mappa generata con %d zone per ciascun mondo.\n", LUNGHEZZA_MAPPA);
+    return 1;
+}
+
+/*
+ * Imposta una mappa virtuale ricavata da un seme: nessuna zona viene
+ * creata subito, quindi il costo non dipende dalla lunghezza scelta.
+ * Sostituisce sempre la mappa corrente e restituisce 1.
+ */
+static int genera_mappa_da_seme(void)
+{
+    int seme = leggi_intero("Seme: ", 0, 2147483647);
+    int lunghezza;
+    do {
+        lunghezza = leggi_intero("Lunghezza mappa (0 = infinita, altrimenti almeno 15): ", 0, 2147483647);
+    } while (lunghezza > 0 && lunghezza < LUNGHEZZA_MAPPA);
+
+    libera_mappa();
+    mappa_virtuale_crea(&mappa_virtuale, (uint64_t)seme, (size_t)lunghezza);
+    mappa_virtuale_attiva = 1;
+    if (lunghezza == 0) {
+        stampa_lenta(15000000L, "Mappa infinita generata dal seme %d.\n", seme);
+    } else {
+        stampa_lenta(15000000L, "Mappa di %d zone generata dal seme %d.\n", lunghezza, seme);
+    }
+    return 1;
+}
+
+/*
+ * Passa la partita corrente sul modello condiviso: le zone restano nel
+ * modello e la partita ne materializza solo quelle occupate.
+ */
+static int collega_modello(Modello_mappa *modello)
+{
+    Mappa_virtuale m;
+    if (!mappa_virtuale_da_modello(&m, modello)) {
+        stampa_lenta(15000000L, "Il modello condiviso deve avere esattamente un demotorzone.\n");
+        return 0;
+    }
+    libera_mappa();
+    mappa_virtuale = m;
+    mappa_virtuale_attiva = 1;
+    return 1;
+}
+
+/*
+ * Trasforma la mappa corrente in un modello condiviso in sola lettura,
+ * che le partite successive possono riusare senza copiarlo.
+ * Restituisce 1 se la partita e' passata sul modello.
+ */
+static int condividi_mappa(void)
+{
+    if (mappa_virtuale_attiva) {
+        stampa_lenta(15000000L, "Si puo' condividere solo una mappa costruita a liste.\n");
+        return 0;
+    }
+    if (conta_zone() < LUNGHEZZA_MAPPA || conta_demotorzone() != 1) {
+        stampa_lenta(15000000L, "Servono almeno 15 zone e un solo demotorzone per condividere la mappa.\n");
+        return 0;
+    }
+    Mappa_compatta m;
+    if (!comprimi_mappa(&m)) {
+        stampa_lenta(15000000L, "Errore di allocazione durante la condivisione della mappa.\n");
+        return 0;
+    }
+    Modello_mappa *modello = modello_crea(&m);
+    if (!modello) {
+        libera_mappa_compatta(&m);
+        stampa_lenta(15000000L, "Errore di allocazione durante la condivisione della mappa.\n");
+        return 0;
+    }
+    modello_rilascia(modello_condiviso);
+    modello_condiviso = modello;
+    if (!collega_modello(modello)) {
+        return 0;
+    }
+    stampa_lenta(15000000L, "Mappa di %zu zone condivisa.\n", modello->mappa.lunghezza);
+    return 1;
+}
+
+/* Collega la partita corrente al modello condiviso esistente. Restituisce 1 se riesce. */
+static int usa_mappa_condivisa(void)
+{
+    if (!modello_condiviso) {
+        stampa_lenta(15000000L, "Nessuna mappa condivisa disponibile.\n");
+        return 0;
+    }
+    if (!collega_modello(modello_condiviso)) {
+        return 0;
+    }
+    stampa_lenta(15000000L, "Partita collegata alla mappa condivisa (%zu zone).\n",
+                 modello_condiviso->mappa.lunghezza);
+    return 1;
+}
+
+/*
+ * Collega la partita al modello generato da seme e lunghezza preso dalla
+ * cache: le sessioni che scelgono la stessa mappa ne condividono una copia.
+ * Lo stesso seme da' la stessa mappa della generazione da seme.
+ * Restituisce 1 se la partita e' passata sul modello.
+ */
+static int usa_mappa_in_cache(void)
+{
+    int seme = leggi_intero("Seme: ", 0, 2147483647);
+    int lunghezza = leggi_intero("Lunghezza mappa (almeno 15): ", LUNGHEZZA_MAPPA, 2147483647);
+    Modello_mappa *modello = cache_mappe_ottieni((uint64_t)seme, (size_t)lunghezza);
+    if (!modello) {
+        stampa_lenta(15000000L, "Errore di allocazione durante la generazione della mappa.\n");
+        return 0;
+    }
+    int collegata = collega_modello(modello);
+    if (collegata) {
+        Statistiche_cache_mappe s;
+        cache_mappe_statistiche(&s);
+        stampa_lenta(15000000L, "Mappa di %d zone dal seme %d (cache: %zu/%zu mappe, %llu trovate, %llu generate, %llu espulse).\n",
+                     lunghezza, seme, s.voci, s.capacita, (unsigned long long)s.successi,
+                     (unsigned long long)s.mancati, (unsigned long long)s.espulsi);
+    }
+    modello_rilascia(modello);
+    return collegata;
+}
+
+/*
+ * Ricerca di semi: ogni thread esamina un intervallo contiguo di semi e
+ * calcola il punteggio di ciascuna mappa leggendone le zone con
+ * mappa_virtuale_zona, senza costruire liste ne' allocare. Ogni thread
+ * tiene i primi max_trovati semi accettati del suo intervallo, cosi'
+ * l'unione in ordine di thread da' i primi semi accettati in assoluto.
+ */
+#define RICERCA_THREAD_MAX 64
+#define CALIBRAZIONE_SCONTRI 1024
+#define RICERCA_RISULTATI 10
+#define FACCE_DADO 20
+
+/* Probabilita' di vittoria per valore del d20 (da 0) e tipo di nemico. */
+typedef struct {
+    double vittoria[FACCE_DADO][demotorzone + 1];
+} Calibrazione_scontri;
+
+typedef struct {
+    const Criteri_mappa *criteri;
+    const Calibrazione_scontri *calibrazione;
+    uint64_t primo_seme;
+    size_t semi;
+    Punteggio_mappa *trovati;
+    size_t max_trovati;
+    size_t accettati;
+} Lavoro_ricerca;
+
+/*
+ * Probabilita' di vincere uno scontro contro ciascun tipo di nemico per
+ * ogni risultato del d20 che fissa i valori iniziali, stimata con scontri
+ * in lotto. Il dado pesa su tutti gli scontri della partita, quindi le
+ * probabilita' vanno combinate per dado e non mediate prima.
+ */
+static void calibra_vittorie(Calibrazione_scontri *cal)
+{
+    Scontro scontri[CALIBRAZIONE_SCONTRI];
+    Esito_scontro esiti[CALIBRAZIONE_SCONTRI];
+    for (int d = 0; d < FACCE_DADO; d++) {
+        cal->vittoria[d][nessun_nemico] = 1.0;
+        for (int n = billi; n <= demotorzone; n++) {
+            for (int k = 0; k < CALIBRAZIONE_SCONTRI; k++) {
+                scontri[k] = (Scontro){d + 1, d + 1, d + 1, (Tipo_nemico)n};
+            }
+            simula_scontri(scontri, CALIBRAZIONE_SCONTRI, (uint64_t)(d * (demotorzone + 1) + n), esiti);
+            int vinti = 0;
+            for (int k = 0; k < CALIBRAZIONE_SCONTRI; k++) {
+                vinti += esiti[k].vinto;
+            }
+            cal->vittoria[d][n] = (double)vinti / CALIBRAZIONE_SCONTRI;
+        }
+    }
+}
+
+static double potenza(double base, size_t esponente)
+{
+    double r = 1.0;
+    while (esponente > 0) {
+        if (esponente & 1) {
+            r *= base;
+        }
+        base *= base;
+        esponente >>= 1;
+    }
+    return r;
+}
+
+/*
+ * Punteggio della mappa di un seme. La stima di vittoria segue il percorso
+ * di un bot: i nemici della prima zona nei mondi che attraversa, che
+ * affronta per passare al successivo, e poi quelli dell'ultimo mondo fino
+ * al demotorzone; e' la media sui venti valori del dado di vincerli tutti.
+ */
+static void punteggio_mappa(uint64_t seme, size_t lunghezza, const Calibrazione_scontri *cal, Punteggio_mappa *p)
+{
+    /* L'overlay di una mappa appena creata e' vuoto: nessuna allocazione. */
+    Mappa_virtuale m;
+    mappa_virtuale_crea(&m, seme, lunghezza);
+    size_t nemici[NUM_MONDI] = {0};
+    size_t oggetti = 0;
+    size_t percorso[demotorzone + 1] = {0, 0, 0, 0};
+    for (size_t i = 0; i < lunghezza; i++) {
+        Zona_compatta z = mappa_virtuale_zona(&m, i);
+        for (int w = 0; w < NUM_MONDI; w++) {
+            nemici[w] += zc_nemico(z, w) != nessun_nemico;
+        }
+        oggetti += zc_oggetto(z) != nessun_oggetto;
+        if (i == 0) {
+            for (int w = 0; w < MONDO_DEMOTORZONE; w++) {
+                percorso[zc_nemico(z, w)]++;
+            }
+        }
+        if (i <= m.indice_demotorzone) {
+            percorso[zc_nemico(z, MONDO_DEMOTORZONE)]++;
+        }
+    }
+    double vittoria = 0.0;
+    for (int d = 0; d < FACCE_DADO; d++) {
+        double v = 1.0;
+        for (int n = billi; n <= demotorzone; n++) {
+            v *= potenza(cal->vittoria[d][n], percorso[n]);
+        }
+        vittoria += v / FACCE_DADO;
+    }
+    p->seme = seme;
+    p->indice_demotorzone = m.indice_demotorzone;
+    for (int w = 0; w < NUM_MONDI; w++) {
+        p->densita_nemici[w] = (int)(nemici[w] * 1000 / lunghezza);
+    }
+    p->densita_oggetti = (int)(oggetti * 1000 / lunghezza);
+    p->vittoria_stimata = (int)(vittoria * 1000.0 + 0.5);
+}
+
+static int punteggio_accettato(const Criteri_mappa *c, const Punteggio_mappa *p)
+{
+    if (p->indice_demotorzone < c->demotorzone_min || p->indice_demotorzone > c->demotorzone_max) {
+        return 0;
+    }
+    for (int w = 0; w < NUM_MONDI; w++) {
+        if (p->densita_nemici[w] < c->densita_nemici_min[w] || p->densita_nemici[w] > c->densita_nemici_max[w]) {
+            return 0;
+        }
+    }
+    return p->densita_oggetti >= c->densita_oggetti_min && p->vittoria_stimata >= c->vittoria_min &&
+           p->vittoria_stimata <= c->vittoria_max;
+}
+
+static void *cerca_semi_thread(void *arg)
+{
+    Lavoro_ricerca *l = (Lavoro_ricerca *)arg;
+    for (size_t i = 0; i < l->semi; i++) {
+        Punteggio_mappa p;
+        punteggio_mappa(l->primo_seme + i, l->criteri->lunghezza, l->calibrazione, &p);
+        if (punteggio_accettato(l->criteri, &p)) {
+            if (l->accettati < l->max_trovati) {
+                l->trovati[l->accettati] = p;
+            }
+            l->accettati++;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Esamina i semi dei criteri su piu' thread e scrive in trovati i primi
+ * max_trovati accettati, in ordine di seme; in accettati il loro totale.
+ * Un intervallo il cui thread non parte viene esaminato dal chiamante.
+ * Restituisce 0 se i criteri non sono validi o manca memoria.
+ */
+int cerca_semi(const Criteri_mappa *c, Punteggio_mappa *trovati, size_t max_trovati, size_t *accettati)
+{
+    *accettati = 0;
+    if (c->lunghezza < LUNGHEZZA_MAPPA || c->esecutori < 1 || c->esecutori > RICERCA_THREAD_MAX) {
+        return 0;
+    }
+    size_t esecutori = (size_t)c->esecutori;
+    Punteggio_mappa *parziali = NULL;
+    if (max_trovati > 0) {
+        parziali = (Punteggio_mappa *)mem_alloca(memoria_simulazione, esecutori * max_trovati * sizeof(Punteggio_mappa));
+        if (!parziali) {
+            return 0;
+        }
+    }
+    Calibrazione_scontri calibrazione;
+    calibra_vittorie(&calibrazione);
+
+    Lavoro_ricerca lavori[RICERCA_THREAD_MAX];
+    pthread_t id[RICERCA_THREAD_MAX];
+    size_t inizio = 0;
+    for (size_t t = 0; t < esecutori; t++) {
+        size_t semi = c->semi / esecutori + (t < c->semi % esecutori);
+        lavori[t] = (Lavoro_ricerca){c, &calibrazione, c->primo_seme + inizio, semi,
+                                     parziali ? parziali + t * max_trovati : NULL, max_trovati, 0};
+        inizio += semi;
+        if (pthread_create(&id[t], NULL, cerca_semi_thread, &lavori[t]) != 0) {
+            id[t] = pthread_self();
+            cerca_semi_thread(&lavori[t]);
+        }
+    }
+    size_t scritti = 0;
+    for (size_t t = 0; t < esecutori; t++) {
+        if (!pthread_equal(id[t], pthread_self())) {
+            pthread_join(id[t], NULL);
+        }
+        for (size_t k = 0; k < lavori[t].accettati && k < max_trovati && scritti < max_trovati; k++) {
+            trovati[scritti++] = lavori[t].trovati[k];
+        }
+        *accettati += lavori[t].accettati;
+    }
+    mem_libera(parziali);
+    return 1;
+}
+
+/*
+ * Chiede i criteri di una ricerca di semi e stampa le prime mappe che li
+ * soddisfano; il seme scelto si usa poi con genera_mappa_da_seme.
+ */
+static void cerca_semi_interattiva(void)
+{
+    Criteri_mappa c;
+    memset(&c, 0, sizeof(c));
+    c.semi = (size_t)leggi_intero("Semi da esaminare: ", 1, 2147483647);
+    c.primo_seme = (uint64_t)leggi_intero("Primo seme: ", 0, 2147483647);
+    c.lunghezza = (size_t)leggi_intero("Lunghezza mappa (almeno 15): ", LUNGHEZZA_MAPPA, 2147483647);
+    c.esecutori = leggi_intero("Thread (1-64): ", 1, RICERCA_THREAD_MAX);
+    int lunghezza = (int)c.lunghezza;
+    int primo = leggi_intero("Demotorzone dalla zona (da 1): ", 1, lunghezza);
+    c.demotorzone_min = (size_t)primo - 1;
+    c.demotorzone_max = (size_t)leggi_intero("Demotorzone fino alla zona: ", primo, lunghezza) - 1;
+    for (int w = 0; w < NUM_MONDI; w++) {
+        char domanda[128];
+        snprintf(domanda, sizeof(domanda), "Zone con nemico nel %.*s, minimo (millesimi, 0-1000): ",
+                 NOME_MONDO_MAX, nome_mondo(w));
+        c.densita_nemici_min[w] = leggi_intero(domanda, 0, 1000);
+        snprintf(domanda, sizeof(domanda), "Zone con nemico nel %.*s, massimo (millesimi): ", NOME_MONDO_MAX,
+                 nome_mondo(w));
+        c.densita_nemici_max[w] = leggi_intero(domanda, c.densita_nemici_min[w], 1000);
+    }
+    c.densita_oggetti_min = leggi_intero("Zone con oggetto, minimo (millesimi, 0-1000): ", 0, 1000);
+    c.vittoria_min = leggi_intero("Vittoria stimata, minimo (millesimi, 0-1000): ", 0, 1000);
+    c.vittoria_max = leggi_intero("Vittoria stimata, massimo (millesimi): ", c.vittoria_min, 1000);
+
+    Punteggio_mappa trovati[RICERCA_RISULTATI];
+    size_t accettati;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (!cerca_semi(&c, trovati, RICERCA_RISULTATI, &accettati)) {
+        stampa_lenta(15000000L, "Impossibile avviare la ricerca.\n");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (double)(t1.tv_sec - t0.tv_sec) * 1000.0 + (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+    stampa_lenta(15000000L, "Semi esaminati: %zu in %.0f ms | Mappe accettate: %zu\n", c.semi, ms, accettati);
+    if (accettati == 0) {
+        return;
+    }
+    stampa_lenta(15000000L, "\n      Seme | Demotorzone |");
+    for (int w = 0; w < NUM_MONDI; w++) {
+        stampa_lenta(15000000L, " Nemici %-3s|", sigla_mondo(w));
+    }
+    stampa_lenta(15000000L, " Oggetti | Vittoria\n");
+    for (size_t i = 0; i < accettati && i < RICERCA_RISULTATI; i++) {
+        const Punteggio_mappa *p = &trovati[i];
+        stampa_lenta(15000000L, "%10llu | %11zu |", (unsigned long long)p->seme, p->indice_demotorzone + 1);
+        for (int w = 0; w < NUM_MONDI; w++) {
+            stampa_lenta(15000000L, " %8.1f%% |", p->densita_nemici[w] / 10.0);
+        }
+        stampa_lenta(15000000L, " %6.1f%% | %7.1f%%\n", p->densita_oggetti / 10.0, p->vittoria_stimata / 10.0);
+    }
+}
+
+/*
+ * Chiede all'utente il nemico di una zona nel mondo dato, tra quelli
+ * ammessi; il demotorzone solo se disponibile.
+ */
+static Tipo_nemico scegli_nemico(int mondo, int demotorzone_disponibile)
+{
+    stampa_lenta(15000000L, "Nemici %s:", nome_mondo(mondo));
+    for (int n = nessun_nemico; n <= demotorzone; n++) {
+        if (nemico_ammesso(mondo, (Tipo_nemico)n) && (n != demotorzone || demotorzone_disponibile)) {
+            stampa_lenta(15000000L, " %d) %s", n, nome_nemico((Tipo_nemico)n));
+        }
+    }
+    stampa_lenta(15000000L, "\n");
+    char domanda[32];
+    snprintf(domanda, sizeof(domanda), "Scelta nemico %s: ", sigla_mondo(mondo));
+    int scelta;
+    do {
+        scelta = leggi_intero(domanda, 0, demotorzone);
+    } while (!nemico_ammesso(mondo, (Tipo_nemico)scelta) || (scelta == demotorzone && !demotorzone_disponibile));
+    return (Tipo_nemico)scelta;
+}
+
+/*
+ * Chiede all'utente l'oggetto da associare a una zona.
+ */
+static int scegli_oggetto(void)
+{
+    stampa_lenta(15000000L, "Oggetti: 0) nessun_oggetto 1) bicicletta 2) maglietta_fuocoinferno 3) bussola 4) schitarrata_metallica\n");
+    return leggi_intero("Scelta oggetto: ", 0, 4);
+}
+
+/*
+ * Inserisce la zona z in posizione pos (da 1): i mondi condividono
+ * la zona, quindi restano allineati senza altro lavoro.
+ * Restituisce 0 se manca memoria.
+ */
+static int inserisci_in_posizione(size_t pos, Zona_compatta zc)
+{
+    Zona *z = crea_zona(zc);
+    if (!z) {
+        return 0;
+    }
+
+    if (pos == 1) {
+        z->avanti = prima_zona;
+        if (prima_zona) {
+            prima_zona->indietro = z;
+        }
+        prima_zona = z;
+    } else {
+        Zona *cur = prima_zona;
+        for (size_t i = 1; i < pos - 1 && cur; i++) {
+            cur = cur->avanti;
+        }
+        z->avanti = cur->avanti;
+        if (cur->avanti) {
+            cur->avanti->indietro = z;
+        }
+        cur->avanti = z;
+        z->indietro = cur;
+    }
+    return 1;
+}
+
+/*
+ * Rimuove la zona in posizione pos (da 1), aggiornando i
+ * puntatori della lista e le posizioni dei giocatori; in *z resta la
+ * zona rimossa. Restituisce 0 se la posizione non esiste.
+ */
+static int cancella_in_posizione(size_t pos, Zona_compatta *z)
+{
+    Zona *cur = prima_zona;
+    for (size_t i = 1; i < pos && cur; i++) {
+        cur = cur->avanti;
+    }
+    if (!cur) {
+        return 0;
+    }
+    *z = zona_compatta(cur);
+
+    if (cur->indietro) {
+        cur->indietro->avanti = cur->avanti;
+    } else {
+        prima_zona = cur->avanti;
+    }
+    if (cur->avanti) {
+        cur->avanti->indietro = cur->indietro;
+    }
+
+    /* Solo i giocatori presenti nella zona cancellata vanno riposizionati. */
+    while (cur->giocatori) {
+        sposta_giocatore(cur->giocatori, prima_zona);
+    }
+
+    ricicla_zona(cur);
+    return 1;
+}
+
+/* Modifica del lotto con la sua posizione originale, per un ordinamento stabile. */
+typedef struct {
+    const Modifica_mappa *modifica;
+    size_t ordine;
+} Modifica_ordinata;
+
+static int confronta_modifiche(const void *a, const void *b)
+{
+    const Modifica_ordinata *x = (const Modifica_ordinata *)a;
+    const Modifica_ordinata *y = (const Modifica_ordinata *)b;
+    if (x->modifica->posizione != y->modifica->posizione) {
+        return x->modifica->posizione < y->modifica->posizione ? -1 : 1;
+    }
+    return x->ordine < y->ordine ? -1 : (x->ordine > y->ordine);
+}
+
+/*
+ * Applica un lotto di inserimenti e cancellazioni in un'unica transazione.
+ * Le posizioni si riferiscono alla mappa prima del lotto: un inserimento in p
+ * mette la zona prima della zona originale p (len+1 = in coda), una cancellazione
+ * in p toglie la zona originale p. Le modifiche vengono ordinate per posizione,
+ * validate tutte (compreso il vincolo del demotorzone unico) e poi applicate
+ * in un solo passaggio che ricollega le due liste; i giocatori delle zone
+ * cancellate vengono spostati una volta sola alla fine.
+ * Se il lotto non e' valido la mappa non cambia. Se inverse non e' NULL
+ * vi si scrivono le n modifiche che riportano la mappa com'era, con le
+ * posizioni della mappa dopo il lotto. Restituisce 1 se applicato.
+ */
+static int applica_lotto(const Modifica_mappa *modifiche, size_t n, Modifica_mappa *inverse)
+{
+    if (mappa_virtuale_attiva) {
+        stampa_lenta(15000000L, "Non disponibile con una mappa generata da seme.\n");
+        return 0;
+    }
+    size_t len = (size_t)conta_zone();
+    Modifica_ordinata *ordinate = (Modifica_ordinata *)mem_alloca(memoria_mappe, (n ? n : 1) * sizeof(Modifica_ordinata));
+    if (!ordinate) {
+        stampa_lenta(15000000L, "Errore di allocazione durante le modifiche.\n");
+        return 0;
+    }
+    size_t inserimenti = 0;
+    int demotorzone_inseriti = 0;
+    const char *errore = NULL;
+    for (size_t i = 0; i < n && !errore; i++) {
+        const Modifica_mappa *m = &modifiche[i];
+        ordinate[i].modifica = m;
+        ordinate[i].ordine = i;
+        if (m->tipo == modifica_inserisci) {
+            inserimenti++;
+            if (m->posizione < 1 || m->posizione > len + 1) {
+                errore = "posizione di inserimento fuori range";
+            } else if (!zona_ammessa(m->zona)) {
+                errore = "zona da inserire non valida";
+            }
+            demotorzone_inseriti += zc_nemico(m->zona, MONDO_DEMOTORZONE) == demotorzone;
+        } else if (m->posizione < 1 || m->posizione > len) {
+            errore = "posizione da cancellare fuori range";
+        }
+    }
+    if (!errore) {
+        qsort(ordinate, n, sizeof(Modifica_ordinata), confronta_modifiche);
+    }
+
+    /* Validazione: una passata sulla mappa per contare i demotorzone che restano. */
+    int demotorzone_finali = demotorzone_inseriti;
+    Zona *cur = prima_zona;
+    size_t k = 0;
+    for (size_t pos = 1; cur && !errore; pos++, cur = cur->avanti) {
+        int cancellata = 0;
+        for (; k < n && ordinate[k].modifica->posizione == pos; k++) {
+            if (ordinate[k].modifica->tipo == modifica_cancella) {
+                if (cancellata) {
+                    errore = "zona cancellata due volte";
+                }
+                cancellata = 1;
+            }
+        }
+        if (!cancellata && cur->nemico[MONDO_DEMOTORZONE] == demotorzone) {
+            demotorzone_finali++;
+        }
+    }
+    if (!errore && demotorzone_finali > 1) {
+        errore = "resterebbe piu' di un demotorzone";
+    }
+
+    /* Le nuove zone si allocano prima di toccare la mappa, cosi' un errore non la lascia a meta'. */
+    Zona **nuove = NULL;
+    if (!errore && inserimenti > 0) {
+        nuove = (Zona **)mem_alloca(memoria_mappe, inserimenti * sizeof(Zona *));
+        size_t create = 0;
+        for (size_t i = 0; nuove && i < n; i++) {
+            const Modifica_mappa *m = ordinate[i].modifica;
+            if (m->tipo != modifica_inserisci) {
+                continue;
+            }
+            Zona *z = crea_zona(m->zona);
+            if (!z) {
+                break;
+            }
+            nuove[create++] = z;
+        }
+        if (!nuove || create < inserimenti) {
+            for (size_t i = 0; nuove && i < create; i++) {
+                ricicla_zona(nuove[i]);
+            }
+            errore = "memoria esaurita";
+        }
+    }
+    if (errore) {
+        mem_libera(nuove);
+        mem_libera(ordinate);
+        stampa_lenta(15000000L, "Modifiche annullate: %s.\n", errore);
+        return 0;
+    }
+
+    /*
+     * Passata di fusione: si scorrono insieme le zone originali e le modifiche
+     * ordinate, riagganciando in coda le zone che restano e quelle nuove.
+     * Le zone cancellate restano in una catena a parte fino alla fine.
+     * nuova_pos e' la posizione nella mappa risultante della prossima zona
+     * agganciata: una zona inserita si cancella li', una cancellata si reinserisce li'.
+     */
+    Zona *coda = NULL;
+    Zona *cancellate = NULL;
+    cur = prima_zona;
+    size_t prossima_nuova = 0;
+    size_t nuova_pos = 1;
+    size_t num_inverse = 0;
+    k = 0;
+    prima_zona = NULL;
+    for (size_t pos = 1; pos <= len + 1; pos++) {
+        int cancellata = 0;
+        for (; k < n && ordinate[k].modifica->posizione == pos; k++) {
+            if (ordinate[k].modifica->tipo == modifica_inserisci) {
+                if (inverse) {
+                    inverse[num_inverse++] = (Modifica_mappa){modifica_cancella, nuova_pos, 0};
+                }
+                nuova_pos++;
+                Zona *z = nuove[prossima_nuova++];
+                z->indietro = coda;
+                if (coda) {
+                    coda->avanti = z;
+                } else {
+                    prima_zona = z;
+                }
+                coda = z;
+            } else {
+                cancellata = 1;
+            }
+        }
+        if (!cur) {
+            break;
+        }
+        Zona *prossima = cur->avanti;
+        if (cancellata) {
+            if (inverse) {
+                inverse[num_inverse++] = (Modifica_mappa){modifica_inserisci, nuova_pos, zona_compatta(cur)};
+            }
+            cur->avanti = cancellate;
+            cancellate = cur;
+        } else {
+            nuova_pos++;
+            cur->indietro = coda;
+            if (coda) {
+                coda->avanti = cur;
+            } else {
+                prima_zona = cur;
+            }
+            coda = cur;
+        }
+        cur = prossima;
+    }
+    if (coda) {
+        coda->avanti = NULL;
+    }
+
+    /* Solo i giocatori delle zone cancellate vengono riposizionati, all'inizio della nuova mappa. */
+    size_t num_cancellate = 0;
+    while (cancellate) {
+        Zona *prossima = cancellate->avanti;
+        while (cancellate->giocatori) {
+            sposta_giocatore(cancellate->giocatori, prima_zona);
+        }
+        ricicla_zona(cancellate);
+        cancellate = prossima;
+        num_cancellate++;
+    }
+    mem_libera(nuove);
+    mem_libera(ordinate);
+    stampa_lenta(15000000L, "Modifiche applicate: %zu inserimenti, %zu cancellazioni.\n", inserimenti, num_cancellate);
+    return 1;
+}
+
+/* Applica un lotto senza tenerne l'inverso. */
+int applica_modifiche(const Modifica_mappa *modifiche, size_t n)
+{
+    return applica_lotto(modifiche, n, NULL);
+}
+
+/*
+ * Annulla/ripeti nel menu della mappa: ogni modifica salva l'operazione
+ * inversa. Inserimenti e cancellazioni costano una posizione e una zona
+ * compatta, un lotto il lotto inverso; le operazioni che sostituiscono
+ * tutta la mappa (generazione, importazione, mappe da seme o condivise)
+ * tengono viva la catena di zone precedente, o solo seme e modello se
+ * era virtuale, e la rimettono al suo posto senza copiarla.
+ * Eseguire un'operazione restituisce la sua inversa, che passa
+ * nell'altra pila. Le pile valgono solo finche' si resta nel menu.
+ */
+#define ANNULLA_MAX 256
+
+typedef struct {
+    int virtuale;
+    Zona *prima;
+    uint64_t seme;
+    size_t lunghezza;
+    Modello_mappa *modello;
+} Versione_mappa;
+
+typedef enum {
+    operazione_inserisci,
+    operazione_cancella,
+    operazione_sostituisci,
+    operazione_lotto
+} Tipo_operazione;
+
+typedef struct {
+    Tipo_operazione tipo;
+    size_t posizione;
+    Zona_compatta zona;
+    Versione_mappa versione;
+    Modifica_mappa *lotto;
+    size_t num_modifiche;
+} Operazione_mappa;
+
+typedef struct {
+    Operazione_mappa operazioni[ANNULLA_MAX];
+    int n;
+} Pila_operazioni;
+
+static Pila_operazioni da_annullare;
+static Pila_operazioni da_ripetere;
+
+/*
+ * Salva in v la mappa corrente senza copiarla: la catena di zone passa
+ * alla versione e resta corrente finche' un'altra mappa non la sostituisce.
+ */
+static void cattura_versione(Versione_mappa *v)
+{
+    memset(v, 0, sizeof(*v));
+    if (mappa_virtuale_attiva) {
+        v->virtuale = 1;
+        v->seme = mappa_virtuale.seme;
+        v->lunghezza = mappa_virtuale.lunghezza == SIZE_MAX ? 0 : mappa_virtuale.lunghezza;
+        v->modello = mappa_virtuale.modello ? modello_acquisisci(mappa_virtuale.modello) : NULL;
+        return;
+    }
+    v->prima = prima_zona;
+    catene_salvate++;
+    mappa_salvata = 1;
+}
+
+/*
+ * Rilascia la versione. Se la sua catena e' ancora la mappa corrente
+ * (l'operazione non l'ha sostituita) torna solo alla mappa, altrimenti
+ * le zone vengono riciclate.
+ */
+static void libera_versione(Versione_mappa *v)
+{
+    if (!v->virtuale) {
+        if (mappa_salvata && v->prima == prima_zona) {
+            mappa_salvata = 0;
+        } else {
+            while (v->prima) {
+                Zona *prossima = v->prima->avanti;
+                ricicla_zona(v->prima);
+                v->prima = prossima;
+            }
+        }
+        v->prima = NULL;
+        catene_salvate--;
+    }
+    modello_rilascia(v->modello);
+    v->modello = NULL;
+}
+
+/* Rende corrente la versione v, che cede la sua catena. Restituisce 0 se manca memoria. */
+static int ripristina_versione(Versione_mappa *v)
+{
+    if (!v->virtuale) {
+        libera_mappa();
+        prima_zona = v->prima;
+        mappa_salvata = 1;
+        return 1;
+    }
+    if (v->modello) {
+        return collega_modello(v->modello);
+    }
+    libera_mappa();
+    mappa_virtuale_crea(&mappa_virtuale, v->seme, v->lunghezza);
+    mappa_virtuale_attiva = 1;
+    return 1;
+}
+
+static void libera_operazione(Operazione_mappa *op)
+{
+    if (op->tipo == operazione_sostituisci) {
+        libera_versione(&op->versione);
+    } else if (op->tipo == operazione_lotto) {
+        mem_libera(op->lotto);
+        op->lotto = NULL;
+    }
+}
+
+/* Mette un'operazione in cima alla pila, scartando la piu' vecchia se piena. */
+static void pila_metti(Pila_operazioni *p, const Operazione_mappa *op)
+{
+    if (p->n == ANNULLA_MAX) {
+        libera_operazione(&p->operazioni[0]);
+        memmove(&p->operazioni[0], &p->operazioni[1], (ANNULLA_MAX - 1) * sizeof(Operazione_mappa));
+        p->n--;
+    }
+    p->operazioni[p->n++] = *op;
+}
+
+static void pila_svuota(Pila_operazioni *p)
+{
+    while (p->n > 0) {
+        libera_operazione(&p->operazioni[--p->n]);
+    }
+}
+
+/* Svuota le pile di annulla/ripeti (nuova sessione). */
+static void azzera_annulla(void)
+{
+    pila_svuota(&da_annullare);
+    pila_svuota(&da_ripetere);
+}
+
+/* Registra l'inversa di una nuova modifica: la pila di ripeti non vale piu'. */
+static void registra_operazione(const Operazione_mappa *inversa)
+{
+    pila_svuota(&da_ripetere);
+    pila_metti(&da_annullare, inversa);
+}
+
+/* Salva la mappa corrente prima di un'operazione che la sostituisce tutta. */
+static void prepara_sostituzione(Operazione_mappa *op)
+{
+    op->tipo = operazione_sostituisci;
+    cattura_versione(&op->versione);
+}
+
+/* Esegue op e ne scrive l'inversa in inversa. Restituisce 0 se fallisce. */
+static int esegui_operazione(Operazione_mappa *op, Operazione_mappa *inversa)
+{
+    memset(inversa, 0, sizeof(*inversa));
+    inversa->posizione = op->posizione;
+    switch (op->tipo) {
+    case operazione_inserisci:
+        inversa->tipo = operazione_cancella;
+        return inserisci_in_posizione(op->posizione, op->zona);
+    case operazione_cancella:
+        inversa->tipo = operazione_inserisci;
+        return cancella_in_posizione(op->posizione, &inversa->zona);
+    case operazione_sostituisci:
+        prepara_sostituzione(inversa);
+        if (!ripristina_versione(&op->versione)) {
+            libera_versione(&inversa->versione);
+            return 0;
+        }
+        libera_versione(&op->versione);
+        return 1;
+    case operazione_lotto:
+        inversa->tipo = operazione_lotto;
+        inversa->lotto = (Modifica_mappa *)mem_alloca(memoria_mappe, op->num_modifiche * sizeof(Modifica_mappa));
+        inversa->num_modifiche = op->num_modifiche;
+        if (!inversa->lotto || !applica_lotto(op->lotto, op->num_modifiche, inversa->lotto)) {
+            libera_operazione(inversa);
+            return 0;
+        }
+        libera_operazione(op);
+        return 1;
+    }
+    return 0;
+}
+
+/* Sposta un'operazione da una pila all'altra eseguendola. */
+static void scambia_operazione(Pila_operazioni *da, Pila_operazioni *a, const char *nome)
+{
+    if (da->n == 0) {
+        stampa_lenta(15000000L, "Niente da %s.\n", nome);
+        return;
+    }
+    Operazione_mappa inversa;
+    if (!esegui_operazione(&da->operazioni[da->n - 1], &inversa)) {
+        stampa_lenta(15000000L, "Impossibile %s: memoria insufficiente.\n", nome);
+        return;
+    }
+    da->n--;
+    pila_metti(a, &inversa);
+    stampa_lenta(15000000L, "Operazione %s.\n", a == &da_ripetere ? "annullata" : "ripetuta");
+}
+
+/*
+ * Inserisce una nuova coppia di zone in posizione scelta.
+ */
+
+static void inserisci_zona(void)
+{
+    if (mappa_virtuale_attiva) {
+        stampa_lenta(15000000L, "Non disponibile con una mappa generata da seme.\n");
+        return;
+    }
+    int len = conta_zone();
+    int pos = leggi_intero("Posizione di inserimento (1..len+1): ", 1, len + 1);
+    Tipo_zona tipo = random_tipo_zona();
+
+    int demotorzone_disponibile = conta_demotorzone() == 0;
+    Tipo_nemico nemici[NUM_MONDI];
+    for (int m = 0; m < NUM_MONDI; m++) {
+        nemici[m] = scegli_nemico(m, demotorzone_disponibile);
+    }
+    Tipo_oggetto oggetto = (Tipo_oggetto)scegli_oggetto();
+
+    if (!inserisci_in_posizione((size_t)pos, zc_componi(tipo, nemici, oggetto))) {
+        stampa_lenta(15000000L, "Errore di allocazione durante l'inserimento.\n");
+        return;
+    }
+    registra_operazione(&(Operazione_mappa){operazione_cancella, (size_t)pos, 0, {0}, NULL, 0});
+    stampa_lenta(15000000L, "Zona inserita in posizione %d.\n", pos);
+}
+
+/*
+ * Rimuove una coppia di zone dalla posizione indicata.
+ */
+
+static void cancella_zona(void)
+{
+    if (mappa_virtuale_attiva) {
+        stampa_lenta(15000000L, "Non disponibile con una mappa generata da seme.\n");
+        return;
+    }
+    int len = conta_zone();
+    if (len == 0) {
+        stampa_lenta(15000000L, "Non ci sono zone da cancellare.\n");
+        return;
+    }
+    int pos = leggi_intero("Posizione da cancellare (1..len): ", 1, len);
+
+    Zona_compatta z;
+    if (!cancella_in_posizione((size_t)pos, &z)) {
+        stampa_lenta(15000000L, "Posizione non valida.\n");
+        return;
+    }
+    registra_operazione(&(Operazione_mappa){operazione_inserisci, (size_t)pos, z, {0}, NULL, 0});
+    stampa_lenta(15000000L, "Zona cancellata.\n");
+}
+
+/*
+ * Raccoglie dall'utente un lotto di modifiche e lo applica
+ * in un'unica transazione con applica_lotto(), registrando il lotto
+ * inverso per annullarlo.
+ */
+static void modifiche_multiple(void)
+{
+    int n = leggi_intero("Numero di modifiche (1-1000): ", 1, 1000);
+    Modifica_mappa *modifiche = (Modifica_mappa *)mem_alloca(memoria_mappe, (size_t)n * sizeof(Modifica_mappa));
+    Modifica_mappa *inverse = (Modifica_mappa *)mem_alloca(memoria_mappe, (size_t)n * sizeof(Modifica_mappa));
+    if (!modifiche || !inverse) {
+        mem_libera(modifiche);
+        mem_libera(inverse);
+        stampa_lenta(15000000L, "Errore di allocazione durante le modifiche.\n");
+        return;
+    }
+    int len = conta_zone();
+    for (int i = 0; i < n; i++) {
+        stampa_lenta(15000000L, "Modifica %d: 1) inserisci 2) cancella\n", i + 1);
+        if (leggi_intero("Scelta: ", 1, len > 0 ? 2 : 1) == 1) {
+            modifiche[i].tipo = modifica_inserisci;
+            modifiche[i].posizione = (size_t)leggi_intero("Posizione di inserimento (1..len+1): ", 1, len + 1);
+            Tipo_nemico nemici[NUM_MONDI];
+            for (int m = 0; m < NUM_MONDI; m++) {
+                nemici[m] = scegli_nemico(m, 1);
+            }
+            Tipo_oggetto oggetto = (Tipo_oggetto)scegli_oggetto();
+            modifiche[i].zona = zc_componi(random_tipo_zona(), nemici, oggetto);
+        } else {
+            modifiche[i].tipo = modifica_cancella;
+            modifiche[i].posizione = (size_t)leggi_intero("Posizione da cancellare (1..len): ", 1, len);
+            modifiche[i].zona = 0;
+        }
+    }
+    if (applica_lotto(modifiche, (size_t)n, inverse)) {
+        Operazione_mappa op = {operazione_lotto, 0, 0, {0}, inverse, (size_t)n};
+        registra_operazione(&op);
+    } else {
+        mem_libera(inverse);
+    }
+    mem_libera(modifiche);
+}
+
+/*
+ * Stampa i campi di una zona in un mondo; l'oggetto
+ * solo nel Mondo Reale, l'unico che ne ha.
+ */
+static void stampa_zona(const Zona *z, int mondo, size_t idx)
+{
+    if (!z) {
+        return;
+    }
+    if (mondo == mondo_reale) {
+        stampa_lenta(15000000L, "[%zu] tipo=%s nemico=%s oggetto=%s\n", idx, nome_tipo_zona(z->tipo),
+                     nome_nemico(z->nemico[mondo]), nome_oggetto(z->oggetto[mondo]));
+    } else {
+        stampa_lenta(15000000L, "[%zu] tipo=%s nemico=%s\n", idx, nome_tipo_zona(z->tipo),
+                     nome_nemico(z->nemico[mondo]));
+    }
+}
+
+/*
+ * Stampa tutte le zone della mappa in uno dei mondi.
+ */
+static void stampa_mappa(void)
+{
+    stampa_lenta(15000000L, "Stampa mappa:");
+    for (int m = 0; m < NUM_MONDI; m++) {
+        stampa_lenta(15000000L, " %d) %s", m, nome_mondo(m));
+    }
+    int mondo = leggi_intero(": ", 0, NUM_MONDI - 1);
+    if (mappa_virtuale_attiva) {
+        /* Della mappa virtuale si stampano le zone dove puo' trovarsi il demotorzone. */
+        for (size_t i = 0; i < mappa_virtuale.raggio_demotorzone; i++) {
+            Zona z;
+            zona_da_compatta(&z, mappa_virtuale_zona(&mappa_virtuale, i));
+            stampa_zona(&z, mondo, i + 1);
+        }
+        return;
+    }
+    size_t idx = 1;
+    for (Zona *cur = prima_zona; cur; cur = cur->avanti) {
+        stampa_zona(cur, mondo, idx++);
+    }
+}
+
+/*
+ * Stampa una zona specifica in tutti i mondi.
+ */
+static void stampa_zona_scelta(void)
+{
+    Zona virtuale;
+    Zona *z;
+    int pos;
+    if (mappa_virtuale_attiva) {
+        size_t max = mappa_virtuale.lunghezza < 2147483647 ? mappa_virtuale.lunghezza : 2147483647;
+        pos = leggi_intero("Posizione zona: ", 1, (int)max);
+        zona_da_compatta(&virtuale, mappa_virtuale_zona(&mappa_virtuale, (size_t)pos - 1));
+        z = &virtuale;
+    } else {
+        int len = conta_zone();
+        if (len == 0) {
+            stampa_lenta(15000000L, "Mappa vuota.\n");
+            return;
+        }
+        pos = leggi_intero("Posizione zona (1..len): ", 1, len);
+        z = prima_zona;
+        for (int i = 1; i < pos && z; i++) {
+            z = z->avanti;
+        }
+    }
+    for (int m = 0; m < NUM_MONDI; m++) {
+        stampa_lenta(15000000L, "%s: ", nome_mondo(m));
+        stampa_zona(z, m, (size_t)pos);
+    }
+}
+
+/*
+ * Formato binario delle mappe: intestazione di 8 byte, numero di zone
+ * su 8 byte little-endian, poi una Zona_compatta per zona (little-endian,
+ * 2 byte con due mondi). L'ultimo byte dell'intestazione e' il numero dei
+ * mondi oltre il Mondo Reale, che fissa la larghezza dei record: "CSMAPPA1"
+ * con il solo Soprasotto. Il formato testuale ha una zona per riga: tipo,
+ * nemico di ciascun mondo e oggetto, con i nomi usati nelle stampe;
+ * righe vuote e righe che iniziano con # sono ignorate.
+ */
+#define MAPPA_MAGIC "CSMAPPA"
+#define MAPPA_MAGIC_LEN 8
+#define MAPPA_MONDI ('0' + NUM_MONDI - 1)
+#define MAPPA_CAMPI (NUM_MONDI + 2)
+
+/*
+ * Cerca la parola [inizio, fine) tra i nomi restituiti da nome per i valori 0..max;
+ * accetta anche il valore numerico. Restituisce -1 se non la riconosce.
+ */
+static int valore_da_nome(const char *inizio, const char *fine, const char *(*nome)(int), int max)
+{
+    size_t len = (size_t)(fine - inizio);
+    if (len > 0 && len <= 2 && inizio[0] >= '0' && inizio[0] <= '9') {
+        int v = 0;
+        for (const char *p = inizio; p < fine; ++p) {
+            if (*p < '0' || *p > '9') {
+                return -1;
+            }
+            v = v * 10 + (*p - '0');
+        }
+        return v <= max ? v : -1;
+    }
+    for (int v = 0; v <= max; v++) {
+        const char *n = nome(v);
+        if (strlen(n) == len && memcmp(n, inizio, len) == 0) {
+            return v;
+        }
+    }
+    return -1;
+}
+
+static const char *nome_tipo_zona_int(int v)
+{
+    return nome_tipo_zona((Tipo_zona)v);
+}
+
+static const char *nome_nemico_int(int v)
+{
+    return nome_nemico((Tipo_nemico)v);
+}
+
+static const char *nome_oggetto_int(int v)
+{
+    return nome_oggetto((Tipo_oggetto)v);
+}
+
+/*
+ * Stato dell'importazione: la lista si costruisce in coda, a parte
+ * rispetto alla mappa corrente, man mano che i record arrivano,
+ * controllando subito i vincoli.
+ */
+typedef struct {
+    Zona *prima;
+    Zona *coda;
+    size_t zone;
+    size_t demotorzone;
+    char messaggio[96];
+} Importazione;
+
+/*
+ * Valida e aggiunge una zona in coda alla mappa.
+ * Ogni mondo ammette solo i suoi nemici e il demotorzone, che sta
+ * nell'ultimo mondo, deve essere unico. Restituisce un messaggio d'errore o NULL.
+ */
+static const char *importa_zona(Importazione *imp, Zona_compatta z)
+{
+    if (zc_tipo(z) > stazione_polizia || zc_oggetto(z) > schitarrata_metallica) {
+        return "tipo o oggetto non valido";
+    }
+    for (int m = 0; m < NUM_MONDI; m++) {
+        if (!nemico_ammesso(m, zc_nemico(z, m))) {
+            snprintf(imp->messaggio, sizeof(imp->messaggio), "%s non puo' stare nel %s",
+                     nome_nemico(zc_nemico(z, m)), nome_mondo(m));
+            return imp->messaggio;
+        }
+    }
+    if (zc_nemico(z, MONDO_DEMOTORZONE) == demotorzone && ++imp->demotorzone > 1) {
+        return "piu' di un demotorzone";
+    }
+    Zona *nuova = crea_zona(z);
+    if (!nuova) {
+        return "memoria esaurita";
+    }
+    nuova->indietro = imp->coda;
+    if (imp->coda) {
+        imp->coda->avanti = nuova;
+    } else {
+        imp->prima = nuova;
+    }
+    imp->coda = nuova;
+    imp->zone++;
+    return NULL;
+}
+
+/* Analizza il formato binario. Restituisce un messaggio d'errore o NULL. */
+static const char *importa_binario(Importazione *imp, const unsigned char *dati, size_t dimensione, size_t *record)
+{
+    if (dimensione < MAPPA_MAGIC_LEN + 8) {
+        return "intestazione troncata";
+    }
+    if (dati[MAPPA_MAGIC_LEN - 1] != MAPPA_MONDI) {
+        return "la mappa e' per un numero di mondi diverso";
+    }
+    uint64_t attese = 0;
+    for (int i = 7; i >= 0; i--) {
+        attese = (attese << 8) | dati[MAPPA_MAGIC_LEN + i];
+    }
+    const unsigned char *p = dati + MAPPA_MAGIC_LEN + 8;
+    if (attese > (dimensione - MAPPA_MAGIC_LEN - 8) / sizeof(Zona_compatta)) {
+        return "file troncato";
+    }
+    for (*record = 1; *record <= attese; (*record)++, p += sizeof(Zona_compatta)) {
+        Zona_compatta z = 0;
+        for (size_t b = 0; b < sizeof(Zona_compatta); b++) {
+            z |= (Zona_compatta)((Zona_compatta)p[b] << (8 * b));
+        }
+        const char *errore = importa_zona(imp, z);
+        if (errore) {
+            return errore;
+        }
+    }
+    return NULL;
+}
+
+/* Analizza il formato testuale riga per riga. Restituisce un messaggio d'errore o NULL. */
+static const char *importa_testo(Importazione *imp, const char *dati, size_t dimensione, size_t *riga)
+{
+    const char *p = dati;
+    const char *fine_file = dati + dimensione;
+    for (*riga = 1; p < fine_file; (*riga)++) {
+        const char *fine_riga = memchr(p, '\n', (size_t)(fine_file - p));
+        if (!fine_riga) {
+            fine_riga = fine_file;
+        }
+        const char *inizio[MAPPA_CAMPI];
+        const char *fine[MAPPA_CAMPI];
+        int campi = 0;
+        const char *q = p;
+        while (q < fine_riga && *q != '#') {
+            while (q < fine_riga && (*q == ' ' || *q == '\t' || *q == '\r')) {
+                q++;
+            }
+            if (q >= fine_riga || *q == '#') {
+                break;
+            }
+            if (campi == MAPPA_CAMPI) {
+                return "troppi campi";
+            }
+            inizio[campi] = q;
+            while (q < fine_riga && *q != ' ' && *q != '\t' && *q != '\r') {
+                q++;
+            }
+            fine[campi++] = q;
+        }
+        p = fine_riga + 1;
+        if (campi == 0) {
+            continue;
+        }
+        if (campi != MAPPA_CAMPI) {
+            return "servono tipo, un nemico per mondo e oggetto";
+        }
+        int tipo = valore_da_nome(inizio[0], fine[0], nome_tipo_zona_int, stazione_polizia);
+        int oggetto = valore_da_nome(inizio[MAPPA_CAMPI - 1], fine[MAPPA_CAMPI - 1], nome_oggetto_int, schitarrata_metallica);
+        if (tipo < 0 || oggetto < 0) {
+            return "nome non riconosciuto";
+        }
+        Tipo_nemico nemici[NUM_MONDI];
+        for (int m = 0; m < NUM_MONDI; m++) {
+            int nemico = valore_da_nome(inizio[1 + m], fine[1 + m], nome_nemico_int, demotorzone);
+            if (nemico < 0) {
+                return "nome non riconosciuto";
+            }
+            nemici[m] = (Tipo_nemico)nemico;
+        }
+        const char *errore = importa_zona(imp, zc_componi((Tipo_zona)tipo, nemici, (Tipo_oggetto)oggetto));
+        if (errore) {
+            return errore;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Sostituisce la mappa corrente con quella del file (testuale o binario,
+ * riconosciuto dall'intestazione). Il file viene mappato in memoria e letto
+ * in un solo passaggio in una lista a parte, verificando i vincoli di
+ * chiudi_mappa. Restituisce 1 se la mappa e' valida; altrimenti la mappa
+ * corrente resta com'era.
+ */
+int importa_mappa(const char *percorso)
+{
+    int fd = open(percorso, O_RDONLY);
+    if (fd < 0) {
+        stampa_lenta(15000000L, "Impossibile aprire %s.\n", percorso);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        stampa_lenta(15000000L, "Il file %s e' vuoto.\n", percorso);
+        return 0;
+    }
+    size_t dimensione = (size_t)st.st_size;
+    void *dati = mmap(NULL, dimensione, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (dati == MAP_FAILED) {
+        stampa_lenta(15000000L, "Impossibile mappare %s in memoria.\n", percorso);
+        return 0;
+    }
+    posix_madvise(dati, dimensione, POSIX_MADV_SEQUENTIAL);
+
+    Importazione imp;
+    memset(&imp, 0, sizeof(imp));
+    size_t posizione = 0;
+    int binario = dimensione >= MAPPA_MAGIC_LEN && memcmp(dati, MAPPA_MAGIC, MAPPA_MAGIC_LEN - 1) == 0;
+    const char *errore = binario ? importa_binario(&imp, (const unsigned char *)dati, dimensione, &posizione)
+                                 : importa_testo(&imp, (const char *)dati, dimensione, &posizione);
+    munmap(dati, dimensione);
+
+    if (!errore && imp.zone < LUNGHEZZA_MAPPA) {
+        errore = "servono almeno 15 zone";
+        posizione = 0;
+    } else if (!errore && imp.demotorzone != 1) {
+        errore = "deve esserci esattamente un demotorzone";
+        posizione = 0;
+    }
+    if (errore) {
+        while (imp.prima) {
+            Zona *prossima = imp.prima->avanti;
+            ricicla_zona(imp.prima);
+            imp.prima = prossima;
+        }
+        if (posizione > 0) {
+            stampa_lenta(15000000L, "Mappa non valida (%s %zu): %s.\n", binario ? "record" : "riga", posizione, errore);
+        } else {
+            stampa_lenta(15000000L, "Mappa non valida: %s.\n", errore);
+        }
+        return 0;
+    }
+    ricicla_mappa();
+    prima_zona = imp.prima;
+    stampa_lenta(15000000L, "Importate %zu zone da %s.\n", imp.zone, percorso);
+    return 1;
+}
+
+/*
+ * Scrive la mappa corrente nel file, una zona alla volta
+ * attraverso il buffer di stdio. Una mappa virtuale si puo'
+ * esportare solo se ha lunghezza finita. Restituisce 1 se riesce.
+ */
+int esporta_mappa(const char *percorso, int binario)
+{
+    size_t zone = mappa_virtuale_attiva ? mappa_virtuale.lunghezza : (size_t)conta_zone();
+    if (mappa_virtuale_attiva && zone == SIZE_MAX) {
+        stampa_lenta(15000000L, "Una mappa infinita non si puo' esportare.\n");
+        return 0;
+    }
+    FILE *f = fopen(percorso, binario ? "wb" : "w");
+    if (!f) {
+        stampa_lenta(15000000L, "Impossibile creare %s.\n", percorso);
+        return 0;
+    }
+    if (binario) {
+        unsigned char intestazione[MAPPA_MAGIC_LEN + 8];
+        memcpy(intestazione, MAPPA_MAGIC, MAPPA_MAGIC_LEN - 1);
+        intestazione[MAPPA_MAGIC_LEN - 1] = MAPPA_MONDI;
+        for (int i = 0; i < 8; i++) {
+            intestazione[MAPPA_MAGIC_LEN + i] = (unsigned char)((uint64_t)zone >> (8 * i));
+        }
+        fwrite(intestazione, 1, sizeof(intestazione), f);
+    } else {
+        fprintf(f, "# tipo");
+        for (int m = 0; m < NUM_MONDI; m++) {
+            fprintf(f, " nemico_%s", sigla_mondo(m));
+        }
+        fprintf(f, " oggetto\n");
+    }
+
+    Zona *cur = prima_zona;
+    for (size_t i = 0; i < zone; i++) {
+        Zona_compatta z;
+        if (mappa_virtuale_attiva) {
+            z = mappa_virtuale_zona(&mappa_virtuale, i);
+        } else {
+            z = zona_compatta(cur);
+            cur = cur->avanti;
+        }
+        if (binario) {
+            unsigned char record[sizeof(Zona_compatta)];
+            for (size_t b = 0; b < sizeof(record); b++) {
+                record[b] = (unsigned char)(z >> (8 * b));
+            }
+            fwrite(record, 1, sizeof(record), f);
+        } else {
+            fprintf(f, "%s", nome_tipo_zona(zc_tipo(z)));
+            for (int m = 0; m < NUM_MONDI; m++) {
+                fprintf(f, " %s", nome_nemico(zc_nemico(z, m)));
+            }
+            fprintf(f, " %s\n", nome_oggetto(zc_oggetto(z)));
+        }
+    }
+    /* Un errore di fwrite o fprintf resta nel flusso: il file parziale si rimuove. */
+    int errore = ferror(f);
+    errore = fclose(f) != 0 || errore;
+    if (errore) {
+        struct stat st;
+        if (stat(percorso, &st) == 0 && S_ISREG(st.st_mode)) {
+            remove(percorso);
+        }
+        stampa_lenta(15000000L, "Errore di scrittura su %s.\n", percorso);
+        return 0;
+    }
+    stampa_lenta(15000000L, "Esportate %zu zone in %s.\n", zone, percorso);
+    return 1;
+}
+
+/* Chiede un percorso di file all'utente. */
+static void leggi_percorso(const char *prompt, char *dest, size_t max_len)
+{
+    do {
+        stampa_lenta(15000000L, "%s", prompt);
+        if (!leggi_riga(dest, max_len)) {
+            dest[0] = '\0';
+            return;
+        }
+    } while (dest[0] == '\0');
+}
+
+/*
+ * Chiude la fase di creazione della mappa verificando i vincoli:
+ * almeno 15 zone e un solo demotorzone, nell'ultimo mondo.
+ */
+
+static void chiudi_mappa(void)
+{
+    /* La mappa virtuale rispetta i vincoli per costruzione. */
+    if (mappa_virtuale_attiva) {
+        mappa_chiusa = 1;
+        stampa_lenta(15000000L, "Mappa chiusa correttamente.\n");
+        return;
+    }
+    int len = conta_zone();
+    int demotorzone_count = conta_demotorzone();
+    if (len < 15) {
+        stampa_lenta(15000000L, "Servono almeno 15 zone per chiudere la mappa.\n");
+        return;
+    }
+    if (demotorzone_count != 1) {
+        stampa_lenta(15000000L, "Deve esserci esattamente un demotorzone nel %s.\n", nome_mondo(MONDO_DEMOTORZONE));
+        return;
+    }
+    mappa_chiusa = 1;
+    stampa_lenta(15000000L, "Mappa chiusa correttamente.\n");
+}
+
+/*
+ * Menu interattivo per costruire la mappa; resta attivo
+ * finché non si chiama con successo chiudi_mappa().
+ */
+
+static void menu_imposta_mappa(void)
+{
+    int scelta;
+    char percorso[256];
+    do {
+        stampa_lenta(15000000L, "\n--- Menu Impostazione Mappa ---\n");
+        stampa_lenta(15000000L, "1) genera_mappa\n");
+        stampa_lenta(15000000L, "2) inserisci_zona\n");
+        stampa_lenta(15000000L, "3) cancella_zona\n");
+        stampa_lenta(15000000L, "4) stampa_mappa\n");
+        stampa_lenta(15000000L, "5) stampa_zona\n");
+        stampa_lenta(15000000L, "6) chiudi_mappa\n");
+        stampa_lenta(15000000L, "7) genera_mappa_da_seme\n");
+        stampa_lenta(15000000L, "8) importa_mappa\n");
+        stampa_lenta(15000000L, "9) esporta_mappa\n");
+        stampa_lenta(15000000L, "10) modifiche_multiple\n");
+        stampa_lenta(15000000L, "11) condividi_mappa\n");
+        stampa_lenta(15000000L, "12) usa_mappa_condivisa\n");
+        stampa_lenta(15000000L, "13) annulla\n");
+        stampa_lenta(15000000L, "14) ripeti\n");
+        stampa_lenta(15000000L, "15) usa_mappa_in_cache\n");
+        stampa_lenta(15000000L, "16) cerca_semi\n");
+        scelta = leggi_intero("Scelta: ", 1, 16);
+
+        /*
+         * Le scelte che sostituiscono tutta la mappa salvano prima la versione
+         * corrente, che diventa un passo da annullare solo se la mappa cambia.
+         */
+        Operazione_mappa inversa;
+        int sostituita = 0;
+        int sostituisce = scelta == 1 || scelta == 7 || scelta == 8 || scelta == 11 || scelta == 12 || scelta == 15;
+        if (sostituisce) {
+            prepara_sostituzione(&inversa);
+        }
+        switch (scelta) {
+        case 1:
+            sostituita = genera_mappa();
+            break;
+        case 2:
+            inserisci_zona();
+            break;
+        case 3:
+            cancella_zona();
+            break;
+        case 4:
+            stampa_mappa();
+            break;
+        case 5:
+            stampa_zona_scelta();
+            break;
+        case 6:
+            chiudi_mappa();
+            break;
+        case 7:
+            sostituita = genera_mappa_da_seme();
+            break;
+        case 8:
+            leggi_percorso("File da importare: ", percorso, sizeof(percorso));
+            sostituita = importa_mappa(percorso);
+            break;
+        case 9:
+            leggi_percorso("File di destinazione: ", percorso, sizeof(percorso));
+            esporta_mappa(percorso, leggi_intero("Formato: 0) testo 1) binario: ", 0, 1));
+            break;
+        case 10:
+            modifiche_multiple();
+            break;
+        case 11:
+            sostituita = condividi_mappa();
+            break;
+        case 12:
+            sostituita = usa_mappa_condivisa();
+            break;
+        case 13:
+            scambia_operazione(&da_annullare, &da_ripetere, "annullare");
+            break;
+        case 14:
+            scambia_operazione(&da_ripetere, &da_annullare, "ripetere");
+            break;
+        case 15:
+            sostituita = usa_mappa_in_cache();
+            break;
+        case 16:
+            cerca_semi_interattiva();
+            break;
+        default:
+            break;
+        }
+        if (sostituisce && sostituita) {
+            registra_operazione(&inversa);
+        } else if (sostituisce) {
+            libera_operazione(&inversa);
+        }
+    } while (!mappa_chiusa);
+    azzera_annulla();
+}
+
+/*
+ * Imposta le statistiche iniziali del giocatore (d20),
+ * applica eventuali modifiche e prepara lo zaino vuoto.
+ */
+
+static void inizializza_giocatore(Giocatore *g)
+{
+    int dado = randint(1, 20);
+    g->attacco_psichico = dado;
+    g->difesa_psichica = dado;
+    g->fortuna = dado;
+
+    stampa_lenta(15000000L, "Valori iniziali (d20=%d): attacco=%d difesa=%d fortuna=%d\n",
+           dado, g->attacco_psichico, g->difesa_psichica, g->fortuna);
+
+    /* I bot tengono i valori del dado e non diventano UndiciVirgolaCinque. */
+    int scelta = 3;
+    if (!g->bot) {
+        stampa_lenta(15000000L, "Scegli modifica: 1) +3 attacco, -3 difesa 2) +3 difesa, -3 attacco 3) nessuna\n");
+        scelta = leggi_intero("Scelta: ", 1, 3);
+    }
+    if (scelta == 1) {
+        g->attacco_psichico += 3;
+        g->difesa_psichica -= 3;
+    } else if (scelta == 2) {
+        g->difesa_psichica += 3;
+        g->attacco_psichico -= 3;
+    }
+
+    if (!undici_virgola_cinque_usato && !g->bot) {
+        int scelta_speciale = leggi_intero("Vuoi diventare UndiciVirgolaCinque? 1) si 2) no: ", 1, 2);
+        if (scelta_speciale == 1) {
+            g->attacco_psichico += 4;
+            g->difesa_psichica += 4;
+            g->fortuna -= 7;
+            /* Il nome si compone a parte: sorgente e destinazione non possono coincidere. */
+            static const char prefisso[] = "UndiciVirgolaCinque_";
+            char nome[NOME_MAX];
+            snprintf(nome, sizeof(nome), "%s%.*s", prefisso, (int)(NOME_MAX - sizeof(prefisso)), g->nome);
+            memcpy(g->nome, nome, NOME_MAX);
+            undici_virgola_cinque_usato = 1;
+        }
+    }
+
+    if (g->attacco_psichico < 1) {
+        g->attacco_psichico = 1;
+    }
+    if (g->difesa_psichica < 1) {
+        g->difesa_psichica = 1;
+    }
+    if (g->fortuna < 1) {
+        g->fortuna = 1;
+    }
+    if (g->attacco_psichico > 20) {
+        g->attacco_psichico = 20;
+    }
+    if (g->difesa_psichica > 20) {
+        g->difesa_psichica = 20;
+    }
+    if (g->fortuna > 20) {
+        g->fortuna = 20;
+    }
+
+    for (int i = 0; i < ZAINO_MAX; i++) {
+        g->zaino[i] = nessun_oggetto;
+    }
+    g->direzione = 1;
+}
+
+/*
+ * Crea totale giocatori nell'arena, gli ultimi num_bot sono bot.
+ * Restituisce 0 se l'allocazione fallisce.
+ */
+static int crea_giocatori(int totale, int num_bot)
+{
+    giocatori = (Giocatore *)arena_alloca(&arena_partita, (size_t)totale * sizeof(Giocatore));
+    vivi = (int *)arena_alloca(&arena_partita, (size_t)totale * sizeof(int));
+    if (!giocatori || !vivi) {
+        stampa_lenta(15000000L, "Errore di allocazione giocatore.\n");
+        libera_giocatori();
+        return 0;
+    }
+    memoria_conta_partita(memoria_giocatori, (int64_t)totale * (int64_t)(sizeof(Giocatore) + sizeof(int)), 1);
+    memset(giocatori, 0, (size_t)totale * sizeof(Giocatore));
+    num_giocatori = totale;
+    for (int i = 0; i < num_giocatori; i++) {
+        Giocatore *g = &giocatori[i];
+        g->bot = i >= totale - num_bot;
+        if (g->bot) {
+            snprintf(g->nome, NOME_MAX, "Bot_%d", i + 1);
+        } else {
+            leggi_stringa("Nome giocatore: ", g->nome, NOME_MAX);
+        }
+        inizializza_giocatore(g);
+        g->indice_vivo = i;
+        vivi[i] = i;
+    }
+    num_vivi = num_giocatori;
+    return 1;
+}
+
+/*
+ * Fase di setup del gioco: crea i giocatori, azzera stato precedente
+ * e avvia il menu di creazione mappa.
+ */
+
+/*
+ * Chiede se attivare l'aggiornamento del mondo a fine round
+ * e con quali probabilita'.
+ */
+static void chiedi_regole_mondo(void)
+{
+    memset(&regole_mondo, 0, sizeof(regole_mondo));
+    regole_mondo.attive = leggi_intero("Nemici che ricompaiono e si spostano a fine round? (0 no, 1 si): ", 0, 1);
+    if (!regole_mondo.attive) {
+        return;
+    }
+    for (int m = 0; m < NUM_MONDI; m++) {
+        char domanda[128];
+        snprintf(domanda, sizeof(domanda), "Comparsa nel %.*s (millesimi, 0-1000): ", NOME_MONDO_MAX, nome_mondo(m));
+        regole_mondo.comparsa[m] = leggi_intero(domanda, 0, 1000);
+    }
+    regole_mondo.movimento = leggi_intero("Spostamento (millesimi, 0-1000): ", 0, 1000);
+}
+
+/* Libera i nemici del mondo: la mappa torna l'unico riferimento. */
+static void mondo_libera(void)
+{
+    mem_libera(nemici_mondo);
+    mem_libera(nemici_precedenti);
+    mem_libera(colonne_mondo);
+    nemici_mondo = NULL;
+    nemici_precedenti = NULL;
+    colonne_mondo = NULL;
+    lunghezza_mondo = 0;
+}
+
+/*
+ * Copia i nemici di tutte le zone in nemici_mondo a inizio partita.
+ * Va chiamata dopo imposta_posizioni_iniziali, che numera le zone.
+ * Se le regole sono spente, la mappa e' infinita o manca memoria
+ * il mondo resta fermo.
+ */
+static void mondo_inizia(void)
+{
+    mondo_libera();
+    if (!regole_mondo.attive) {
+        return;
+    }
+    if (mappa_virtuale_attiva && mappa_virtuale.lunghezza == SIZE_MAX) {
+        stampa_lenta(15000000L, "Su una mappa infinita i nemici non ricompaiono e non si spostano.\n");
+        return;
+    }
+    size_t n = mappa_virtuale_attiva ? mappa_virtuale.lunghezza : (size_t)conta_zone();
+    nemici_mondo = (Nemici_zona *)mem_alloca(memoria_mondo, n * sizeof(Nemici_zona));
+    if (!mappa_virtuale_attiva) {
+        colonne_mondo = (Zona **)mem_alloca(memoria_mondo, n * sizeof(Zona *));
+    }
+    if (storia.attiva) {
+        nemici_precedenti = (Nemici_zona *)mem_alloca(memoria_mondo, n * sizeof(Nemici_zona));
+    }
+    if (!nemici_mondo || (!mappa_virtuale_attiva && !colonne_mondo) || (storia.attiva && !nemici_precedenti)) {
+        mondo_libera();
+        stampa_lenta(15000000L, "Errore di allocazione: i nemici restano fermi.\n");
+        return;
+    }
+    lunghezza_mondo = n;
+    if (mappa_virtuale_attiva) {
+        for (size_t i = 0; i < n; i++) {
+            nemici_mondo[i] = nemici_compatta(mappa_virtuale_zona(&mappa_virtuale, i));
+        }
+        return;
+    }
+    size_t i = 0;
+    for (Zona *z = prima_zona; z; z = z->avanti) {
+        colonne_mondo[i] = z;
+        nemici_mondo[i++] = nemici_zona(z);
+    }
+}
+
+/* Riporta i nemici aggiornati in una zona esistente. */
+static void mondo_applica(Zona *z)
+{
+    applica_nemici(z, nemici_mondo[z->indice]);
+}
+
+/*
+ * Registra nella storia ogni zona i cui nemici sono cambiati
+ * nell'ultimo aggiornamento, anche quelle mai materializzate.
+ */
+static void mondo_registra_storia(void)
+{
+    for (size_t i = 0; i < lunghezza_mondo; i++) {
+        if (nemici_precedenti[i] == nemici_mondo[i]) {
+            continue;
+        }
+        Zona_compatta z = colonne_mondo ? zona_compatta(colonne_mondo[i]) : mappa_virtuale_zona(&mappa_virtuale, i);
+        storia_zona_compatta(i, con_nemici(z, nemici_mondo[i]));
+    }
+}
+
+/* Riduce 16 bit casuali a un valore in [0, 1000) senza divisioni. */
+static uint32_t millesimi(uint64_t h)
+{
+    return (uint32_t)(((h & 0xFFFF) * 1000) >> 16);
+}
+
+/*
+ * Aggiorna i nemici di tutte le zone a fine round, con due passate senza
+ * salti su nemici_mondo: nelle zone vuote di ogni mondo compare uno dei
+ * suoi nemici di comparsa, poi le coppie di zone adiacenti, pari o dispari
+ * a round alterni, si scambiano i nemici mondo per mondo. Ogni zona ha un
+ * hash per passata: il mondo m usa il gruppo m di 16 bit, la scelta del
+ * nemico che compare un bit del gruppo dopo l'ultimo mondo.
+ * Il demotorzone non compare e non si sposta, quindi resta l'unico.
+ * Le zone esistenti (tutte con le liste, le materializzate con la mappa
+ * virtuale) vengono poi allineate; le altre leggono nemici_mondo quando
+ * vengono materializzate. Tutte le zone cambiate vanno nella storia.
+ */
+static void mondo_aggiorna(int round)
+{
+    Nemici_zona *nemici = nemici_mondo;
+    size_t n = lunghezza_mondo;
+    uint64_t base = stato_rng;
+    uint32_t soglia_movimento = (uint32_t)regole_mondo.movimento;
+    int con_storia = storia.attiva && nemici_precedenti;
+    if (con_storia) {
+        memcpy(nemici_precedenti, nemici, n * sizeof(Nemici_zona));
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t h = mescola64(base + i);
+        uint32_t scelta = hash_16(h, NUM_MONDI);
+        Nemici_zona zona = nemici[i];
+        for (int m = 0; m < NUM_MONDI; m++) {
+            const Descrizione_mondo *d = descrizione_mondo(m);
+            uint32_t nemico = (uint32_t)(zona >> (2 * m)) & 3u;
+            uint32_t nasce = (uint32_t)(nemico == nessun_nemico) &
+                             (uint32_t)(millesimi(hash_16(h, m)) < (uint32_t)regole_mondo.comparsa[m]);
+            nemico = (uint32_t)d->comparsa[(scelta >> m) & 1] & (0u - nasce);
+            zona |= (Nemici_zona)((Nemici_zona)nemico << (2 * m));
+        }
+        nemici[i] = zona;
+    }
+    for (size_t i = (size_t)(round & 1); i + 1 < n; i += 2) {
+        uint64_t h = mescola64(base + n + i);
+        Nemici_zona a = nemici[i];
+        Nemici_zona b = nemici[i + 1];
+        Nemici_zona muovi = 0;
+        for (int m = 0; m < NUM_MONDI; m++) {
+            uint32_t si = (uint32_t)(millesimi(hash_16(h, m)) < soglia_movimento) &
+                          (uint32_t)(((a >> (2 * m)) & 3u) != demotorzone) &
+                          (uint32_t)(((b >> (2 * m)) & 3u) != demotorzone);
+            muovi |= (Nemici_zona)((Nemici_zona)(3u & (0u - si)) << (2 * m));
+        }
+        Nemici_zona x = (Nemici_zona)((a ^ b) & muovi);
+        nemici[i] = (Nemici_zona)(a ^ x);
+        nemici[i + 1] = (Nemici_zona)(b ^ x);
+    }
+    stato_rng = base + 2 * n;
+    if (con_storia) {
+        mondo_registra_storia();
+    }
+
+    if (colonne_mondo) {
+        for (size_t i = 0; i < n; i++) {
+            mondo_applica(colonne_mondo[i]);
+        }
+        return;
+    }
+    for (size_t i = 0; i < zone_materializzate.capacita; i++) {
+        if (zone_materializzate.chiavi[i] != 0) {
+            mondo_applica((Zona *)(uintptr_t)zone_materializzate.valori[i]);
+        }
+    }
+}
+
+void imposta_gioco(void)
+{
+    init_rng();
+
+    azzera_annulla();
+    azzera_sessione();
+
+    char prompt[64];
+    snprintf(prompt, sizeof(prompt), "Numero giocatori (1-%d): ", MAX_GIOCATORI);
+    int totale = leggi_intero(prompt, 1, MAX_GIOCATORI);
+    snprintf(prompt, sizeof(prompt), "Di cui bot (0-%d): ", totale);
+    int num_bot = leggi_intero(prompt, 0, totale);
+
+    if (!crea_giocatori(totale, num_bot)) {
+        return;
+    }
+    segno_mappa = arena_segna(&arena_partita);
+
+    /* Fino a qui sono stati creati i giocatori; ora si costruisce la mappa. */
+    menu_imposta_mappa();
+    chiedi_regole_mondo();
+
+    stampa_lenta(15000000L, "Impostazione gioco completata.\n");
+}
+
+/*
+ * Verifica se non ci sono più giocatori vivi.
+ */
+static int tutti_morti(void)
+{
+    return num_vivi == 0;
+}
+
+/*
+ * Classifica persistente: ogni partita conclusa aggiunge un record di
+ * dimensione fissa in coda a FILE_CLASSIFICA. All'apertura il file viene
+ * letto una volta per costruire l'indice in memoria dei totali per
+ * giocatore; le partite recenti si rileggono dal file per posizione.
+ */
+#define FILE_CLASSIFICA "classifica.dat"
+#define CLASSIFICA_MAGIC "CSCLASS1"
+#define CLASSIFICA_INTESTAZIONE 8
+
+static FILE *file_classifica = NULL;
+static int classifica_caricata = 0;
+static size_t partite_giocate = 0;
+static Totale_giocatore *totali = NULL;
+static size_t num_totali = 0;
+static size_t capacita_totali = 0;
+static Tabella_zone indice_totali;
+/* Indici in totali dei migliori, in ordine decrescente: si aggiornano a ogni vittoria. */
+static size_t migliori[CLASSIFICA_MIGLIORI];
+static size_t num_migliori = 0;
+
+/* Hash FNV-1a del nome, rimescolato per la tabella. */
+static uint64_t hash_nome(const char *nome)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)nome; *p; ++p) {
+        h = (h ^ *p) * 1099511628211ULL;
+    }
+    return mescola64(h);
+}
+
+/*
+ * Cerca il totale di un giocatore. Due nomi con lo stesso hash
+ * occupano chiavi consecutive, quindi si prosegue finche' il nome
+ * coincide o la chiave e' libera (in *chiave resta la prima libera).
+ * L'ultimo bit dell'hash resta libero, cosi' la chiave non arriva mai
+ * al valore che la tabella, salvando chiave + 1, scambierebbe per vuoto.
+ */
+static Totale_giocatore *cerca_totale(const char *nome, size_t *chiave)
+{
+    uint64_t valore;
+    size_t k = (size_t)(hash_nome(nome) >> 1);
+    while (tabella_cerca(&indice_totali, k, &valore)) {
+        if (strcmp(totali[valore].nome, nome) == 0) {
+            return &totali[valore];
+        }
+        k++;
+    }
+    if (chiave) {
+        *chiave = k;
+    }
+    return NULL;
+}
+
+/* Vero se a precede b in classifica: piu' vittorie o, a parita', vittoria piu' recente. */
+static int totale_precede(const Totale_giocatore *a, const Totale_giocatore *b)
+{
+    return a->vittorie > b->vittorie ||
+           (a->vittorie == b->vittorie && a->ultima_vittoria > b->ultima_vittoria);
+}
+
+/*
+ * Rimette in ordine i migliori dopo una vittoria del totale di indice i.
+ * Una vittoria fa solo salire un giocatore, quindi basta farlo risalire
+ * dalla sua posizione (o dall'ultima, se ne era fuori).
+ */
+static void aggiorna_migliori(size_t i)
+{
+    size_t pos = 0;
+    while (pos < num_migliori && migliori[pos] != i) {
+        pos++;
+    }
+    if (pos == CLASSIFICA_MIGLIORI) {
+        /* Da fuori entra solo prendendo il posto dell'ultimo. */
+        if (!totale_precede(&totali[i], &totali[migliori[pos - 1]])) {
+            return;
+        }
+        pos--;
+    } else if (pos == num_migliori) {
+        num_migliori++;
+    }
+    while (pos > 0 && totale_precede(&totali[i], &totali[migliori[pos - 1]])) {
+        migliori[pos] = migliori[pos - 1];
+        pos--;
+    }
+    migliori[pos] = i;
+}
+
+/* Aggiorna l'indice in memoria con un record. */
+static void indicizza_record(const Record_classifica *r)
+{
+    partite_giocate++;
+    if (!r->vittoria) {
+        return;
+    }
+    size_t chiave = 0;
+    Totale_giocatore *t = cerca_totale(r->vincitore, &chiave);
+    if (!t) {
+        if (num_totali == capacita_totali) {
+            size_t nuova = capacita_totali ? capacita_totali * 2 : 64;
+            Totale_giocatore *p = (Totale_giocatore *)mem_rialloca(memoria_classifica, totali, nuova * sizeof(Totale_giocatore));
+            if (!p) {
+                return;
+            }
+            totali = p;
+            capacita_totali = nuova;
+        }
+        if (!tabella_inserisci(&indice_totali, memoria_classifica, chiave, num_totali)) {
+            return;
+        }
+        t = &totali[num_totali++];
+        memset(t, 0, sizeof(*t));
+        memcpy(t->nome, r->vincitore, NOME_MAX);
+    }
+    t->vittorie++;
+    t->round_totali += (size_t)r->round;
+    t->ultima_vittoria = r->istante;
+    aggiorna_migliori((size_t)(t - totali));
+}
+
+/*
+ * Apre il file della classifica, creandolo se manca, e ne indicizza
+ * i record. Un record scritto a meta' in coda viene scartato.
+ * Se il file non e' utilizzabile la classifica resta solo in memoria.
+ */
+static void carica_classifica(void)
+{
+    if (classifica_caricata) {
+        return;
+    }
+    classifica_caricata = 1;
+
+    int fd = open(FILE_CLASSIFICA, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return;
+    }
+    size_t dimensione = (size_t)st.st_size;
+    if (dimensione < CLASSIFICA_INTESTAZIONE) {
+        if (ftruncate(fd, 0) != 0 || write(fd, CLASSIFICA_MAGIC, CLASSIFICA_INTESTAZIONE) != CLASSIFICA_INTESTAZIONE) {
+            close(fd);
+            return;
+        }
+        dimensione = CLASSIFICA_INTESTAZIONE;
+    }
+
+    size_t record = (dimensione - CLASSIFICA_INTESTAZIONE) / sizeof(Record_classifica);
+    const unsigned char *dati = (const unsigned char *)mmap(NULL, dimensione, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (dati == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    if (memcmp(dati, CLASSIFICA_MAGIC, CLASSIFICA_INTESTAZIONE) != 0) {
+        munmap((void *)dati, dimensione);
+        close(fd);
+        stampa_lenta(15000000L, "%s non e' un file di classifica: risultati non salvati.\n", FILE_CLASSIFICA);
+        return;
+    }
+    for (size_t i = 0; i < record; i++) {
+        Record_classifica r;
+        memcpy(&r, dati + CLASSIFICA_INTESTAZIONE + i * sizeof(Record_classifica), sizeof(r));
+        r.vincitore[NOME_MAX - 1] = '\0';
+        indicizza_record(&r);
+    }
+    munmap((void *)dati, dimensione);
+
+    size_t fine = CLASSIFICA_INTESTAZIONE + record * sizeof(Record_classifica);
+    if (fine != dimensione && ftruncate(fd, (off_t)fine) != 0) {
+        close(fd);
+        return;
+    }
+    file_classifica = fdopen(fd, "ab");
+    if (!file_classifica) {
+        close(fd);
+    }
+}
+
+/* Scrive su disco i record ancora nel buffer. */
+static void scarica_classifica(void)
+{
+    if (file_classifica) {
+        fflush(file_classifica);
+    }
+}
+
+/* Chiude il file della classifica e libera l'indice. */
+static void chiudi_classifica(void)
+{
+    if (file_classifica) {
+        fclose(file_classifica);
+        file_classifica = NULL;
+    }
+    mem_libera(totali);
+    totali = NULL;
+    num_totali = 0;
+    capacita_totali = 0;
+    num_migliori = 0;
+    tabella_libera(&indice_totali);
+    partite_giocate = 0;
+    classifica_caricata = 0;
+}
+
+/*
+ * Registra l'esito di una partita nella classifica: il record va in coda
+ * al file (con il buffer di stdio, una sola scrittura ogni molti record)
+ * e l'indice in memoria viene aggiornato.
+ */
+static void registra_vincitore(const Esito_partita *e)
+{
+    carica_classifica();
+    Record_classifica r;
+    memset(&r, 0, sizeof(r));
+    r.seme = e->seme;
+    r.istante = ora_corrente();
+    r.round = e->round;
+    r.vittoria = e->vittoria;
+    r.attacco_psichico = e->attacco_psichico;
+    r.difesa_psichica = e->difesa_psichica;
+    r.fortuna = e->fortuna;
+    snprintf(r.vincitore, NOME_MAX, "%s", e->vittoria ? e->vincitore : "Nessuno");
+    if (file_classifica && fwrite(&r, sizeof(r), 1, file_classifica) != 1) {
+        stampa_lenta(15000000L, "Errore di scrittura della classifica.\n");
+    }
+    indicizza_record(&r);
+}
+
+/* Numero di partite registrate nella classifica. */
+size_t classifica_partite(void)
+{
+    carica_classifica();
+    return partite_giocate;
+}
+
+/*
+ * Copia in risultato i k giocatori con piu' vittorie (al massimo
+ * CLASSIFICA_MIGLIORI), in ordine decrescente (a parita', chi ha vinto
+ * per ultimo). Restituisce quanti ne ha copiati.
+ */
+size_t classifica_migliori(Totale_giocatore *risultato, size_t k)
+{
+    carica_classifica();
+    size_t n = k < num_migliori ? k : num_migliori;
+    for (size_t i = 0; i < n; i++) {
+        risultato[i] = totali[migliori[i]];
+    }
+    return n;
+}
+
+/* Copia in totale i dati del giocatore. Restituisce 0 se non ha mai vinto. */
+int classifica_totale(const char *nome, Totale_giocatore *totale)
+{
+    carica_classifica();
+    Totale_giocatore *t = cerca_totale(nome, NULL);
+    if (!t) {
+        return 0;
+    }
+    *totale = *t;
+    return 1;
+}
+
+/*
+ * Copia in recenti le ultime n partite, dalla piu' recente.
+ * I record hanno dimensione fissa: si leggono direttamente per posizione.
+ */
+size_t classifica_recenti(Record_classifica *recenti, size_t n)
+{
+    carica_classifica();
+    if (!file_classifica) {
+        return 0;
+    }
+    scarica_classifica();
+    if (n > partite_giocate) {
+        n = partite_giocate;
+    }
+    int fd = fileno(file_classifica);
+    for (size_t i = 0; i < n; i++) {
+        off_t pos = (off_t)(CLASSIFICA_INTESTAZIONE + (partite_giocate - 1 - i) * sizeof(Record_classifica));
+        if (pread(fd, &recenti[i], sizeof(Record_classifica), pos) != (ssize_t)sizeof(Record_classifica)) {
+            return i;
+        }
+        recenti[i].vincitore[NOME_MAX - 1] = '\0';
+    }
+    return n;
+}
+
+/*
+ * Stampa le informazioni complete di un giocatore.
+ */
+static void stampa_giocatore(Giocatore *g)
+{
+    if (!g) {
+        return;
+    }
+    stampa_lenta(15000000L, "Giocatore: %s\n", g->nome);
+    stampa_lenta(15000000L, "Mondo: %s\n", nome_mondo(g->mondo));
+    stampa_lenta(15000000L, "Attacco: %d Difesa: %d Fortuna: %d\n", g->attacco_psichico, g->difesa_psichica, g->fortuna);
+    stampa_lenta(15000000L, "Zaino: ");
+    for (int i = 0; i < ZAINO_MAX; i++) {
+        stampa_lenta(15000000L, "%s", nome_oggetto(g->zaino[i]));
+        if (i < ZAINO_MAX - 1) {
+            stampa_lenta(15000000L, ", ");
+        }
+    }
+    stampa_lenta(15000000L, "\n");
+}
+
+/*
+ * Stampa la zona in cui si trova il giocatore.
+ */
+static void stampa_zona_corrente(Giocatore *g)
+{
+    stampa_lenta(15000000L, "Zona %s: ", nome_mondo(g->mondo));
+    stampa_zona(g->pos, g->mondo, 0);
+}
+
+/*
+ * Copia in z la zona a distanza offset dalla posizione del giocatore,
+ * senza materializzarla. Restituisce 0 se la zona non esiste.
+ */
+static int zona_vicina(Giocatore *g, int offset, Zona *z)
+{
+    Zona *cur = g->pos;
+    if (mappa_virtuale_attiva) {
+        if (offset < 0 && (size_t)-offset > cur->indice) {
+            return 0;
+        }
+        size_t indice = cur->indice + (size_t)(long)offset;
+        if (indice >= mappa_virtuale.lunghezza) {
+            return 0;
+        }
+        zona_da_compatta(z, mappa_virtuale_zona(&mappa_virtuale, indice));
+        if (nemici_mondo) {
+            applica_nemici(z, nemici_mondo[indice]);
+        }
+        return 1;
+    }
+    for (int i = 0; cur && i < offset; i++) {
+        cur = cur->avanti;
+    }
+    for (int i = 0; cur && i > offset; i--) {
+        cur = cur->indietro;
+    }
+    if (!cur) {
+        return 0;
+    }
+    *z = *cur;
+    return 1;
+}
+
+/*
+ * Compone nel retro la vista della partita: le zone dei due mondi
+ * attorno al giocatore, il suo pannello e il menu delle azioni,
+ * poi aggiorna il terminale con le sole differenze.
+ */
+static void disegna_schermo(Giocatore *g)
+{
+    static const char simboli_nemico[] = " BDZ";
+    for (int r = 0; r < SCHERMO_RIGA_MESSAGGI - 1; r++) {
+        schermo_pulisci_riga(r);
+    }
+    schermo_scrivi(0, 0, "Cosestrane - turno di %s", g->nome);
+    schermo_scrivi(1, 0, "Giocatori vivi: %d", num_vivi);
+
+    int primo_mondo = g->mondo > 0 ? g->mondo - 1 : 0;
+    if (primo_mondo > NUM_MONDI - SCHERMO_MONDI) {
+        primo_mondo = NUM_MONDI - SCHERMO_MONDI;
+    }
+    for (int mondo = primo_mondo; mondo < primo_mondo + SCHERMO_MONDI; mondo++) {
+        int riga = 2 + mondo - primo_mondo;
+        schermo_scrivi(riga, 0, "%c %s", g->mondo == mondo ? '>' : ' ', nome_mondo(mondo));
+        for (int offset = -3; offset <= 3; offset++) {
+            Zona z;
+            if (!zona_vicina(g, offset, &z)) {
+                continue;
+            }
+            int corrente = offset == 0 && g->mondo == mondo;
+            int oggetto = z.oggetto[mondo] != nessun_oggetto;
+            schermo_scrivi(riga, 15 + (offset + 3) * 9, "%c%-3.3s %c%c%c", corrente ? '[' : ' ',
+                           nome_tipo_zona(z.tipo), simboli_nemico[z.nemico[mondo]], oggetto ? '*' : ' ',
+                           corrente ? ']' : ' ');
+        }
+    }
+    schermo_scrivi(5, 15, "B=billi D=democane Z=demotorzone *=oggetto");
+    memset(schermo_retro[6], '-', SCHERMO_COLONNE);
+
+    schermo_scrivi(7, 0, "Giocatore: %s", g->nome);
+    schermo_scrivi(8, 0, "Mondo: %s", nome_mondo(g->mondo));
+    schermo_scrivi(9, 0, "Attacco: %d Difesa: %d Fortuna: %d", g->attacco_psichico, g->difesa_psichica, g->fortuna);
+    schermo_scrivi(10, 0, "Zaino:");
+    for (int i = 0; i < ZAINO_MAX; i++) {
+        schermo_scrivi(11 + i, 2, "%d) %s", i + 1, nome_oggetto(g->zaino[i]));
+    }
+
+    static const char *azioni[] = {"avanza", "indietreggia", "cambia_mondo", "combatti", "stampa_giocatore",
+                                   "stampa_zona", "raccogli_oggetto", "utilizza_oggetto", "passa"};
+    for (int i = 0; i < 9; i++) {
+        schermo_scrivi(7 + i, 40, "%d) %s", i + 1, azioni[i]);
+    }
+    memset(schermo_retro[SCHERMO_RIGA_MESSAGGI - 1], '-', SCHERMO_COLONNE);
+    schermo_aggiorna();
+}
+
+/*
+ * Raccoglie un oggetto dalla zona, se possibile.
+ */
+static int raccogli_oggetto(Giocatore *g)
+{
+    if (g->mondo != mondo_reale) {
+        stampa_lenta(15000000L, "Nel %s non ci sono oggetti.\n", nome_mondo(g->mondo));
+        return 0;
+    }
+    Zona *z = g->pos;
+    if (z->nemico[g->mondo] != nessun_nemico) {
+        stampa_lenta(15000000L, "Prima devi sconfiggere il nemico.\n");
+        return 0;
+    }
+    Tipo_oggetto *oggetto = &z->oggetto[g->mondo];
+    if (*oggetto == nessun_oggetto) {
+        stampa_lenta(15000000L, "Nessun oggetto da raccogliere.\n");
+        return 0;
+    }
+    for (int i = 0; i < ZAINO_MAX; i++) {
+        if (g->zaino[i] == nessun_oggetto) {
+            g->zaino[i] = *oggetto;
+            stampa_lenta(15000000L, "Oggetto raccolto: %s\n", nome_oggetto(*oggetto));
+            *oggetto = nessun_oggetto;
+            registra_modifica_zona(z);
+            conta_calore(g, calore_raccolta);
+            return 1;
+        }
+    }
+    stampa_lenta(15000000L, "Zaino pieno.\n");
+    return 0;
+}
+
+/*
+ * Applica l'effetto di un oggetto a giocatore/nemico.
+ */
+static int usa_oggetto_effetto(Giocatore *g, Tipo_oggetto oggetto, int *hp_nemico)
+{
+    switch (oggetto) {
+    case bicicletta:
+        g->fortuna += 2;
+        if (g->fortuna > 20) {
+            g->fortuna = 20;
+        }
+        stampa_lenta(15000000L, "Fortuna aumentata a %d.\n", g->fortuna);
+        break;
+    case maglietta_fuocoinferno:
+        g->attacco_psichico += 3;
+        if (g->attacco_psichico > 20) {
+            g->attacco_psichico = 20;
+        }
+        stampa_lenta(15000000L, "Attacco aumentato a %d.\n", g->attacco_psichico);
+        break;
+    case bussola:
+        g->difesa_psichica += 2;
+        if (g->difesa_psichica > 20) {
+            g->difesa_psichica = 20;
+        }
+        stampa_lenta(15000000L, "Difesa aumentata a %d.\n", g->difesa_psichica);
+        break;
+    case schitarrata_metallica:
+        if (hp_nemico) {
+            *hp_nemico -= 5;
+            stampa_lenta(15000000L, "Schitarrata metallica! Danni al nemico (-5).\n");
+        } else {
+            g->attacco_psichico += 1;
+            g->difesa_psichica += 1;
+            if (g->attacco_psichico > 20) {
+                g->attacco_psichico = 20;
+            }
+            if (g->difesa_psichica > 20) {
+                g->difesa_psichica = 20;
+            }
+            stampa_lenta(15000000L, "Attacco e difesa aumentati.\n");
+        }
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Permette al giocatore di scegliere un oggetto dallo zaino
+ * e applicarne l'effetto, consumandolo.
+ */
 
-    for (int i = num_giocatori; i < MAX_GIOCATORI; i++) {
-        giocatori[i] = NULL;
+static int utilizza_oggetto(Giocatore *g, int *hp_nemico)
+{
+    int indice = -1;
+    for (int i = 0; i < ZAINO_MAX; i++) {
+        if (g->zaino[i] != nessun_oggetto) {
+            indice = i;
+            break;
+        }
+    }
+    if (indice == -1) {
+        stampa_lenta(15000000L, "Zaino vuoto.\n");
+        return 0;
     }
 
-    /* Fino a qui sono stati creati i giocatori; ora si costruisce la mappa. */
-    menu_imposta_mappa();
+    stampa_lenta(15000000L, "Scegli oggetto:\n");
+    for (int i = 0; i < ZAINO_MAX; i++) {
+        stampa_lenta(15000000L, "%d) %s\n", i + 1, nome_oggetto(g->zaino[i]));
+    }
+    int scelta = leggi_intero("Scelta: ", 1, ZAINO_MAX);
+    Tipo_oggetto oggetto = g->zaino[scelta - 1];
+    if (oggetto == nessun_oggetto) {
+        stampa_lenta(15000000L, "Nessun oggetto nello slot.\n");
+        return 0;
+    }
+    if (usa_oggetto_effetto(g, oggetto, hp_nemico)) {
+        traccia(evento_uso_oggetto, g, oggetto, hp_nemico ? *hp_nemico : 0, 0);
+        g->zaino[scelta - 1] = nessun_oggetto;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Gestisce un combattimento a turni contro il nemico della stanza.
+ * Usa attacco/difesa/fortuna del giocatore e aggiorna lo stato del nemico.
+ */
+
+static int combatti(Giocatore *g, Tipo_nemico *nemico, int *vittoria_demotorzone)
+{
+    if (*nemico == nessun_nemico) {
+        stampa_lenta(15000000L, "Nessun nemico presente.\n");
+        return 1;
+    }
+
+    conta_calore(g, calore_combattimento);
+    NemicoStats stats = stats_nemico(*nemico);
+    int hp_nemico = stats.hp;
+    int hp_giocatore = 10 + g->difesa_psichica;
+
+    /* Inizia il ciclo principale del combattimento a turni. */
+    stampa_lenta(15000000L, "Combattimento contro %s!\n", nome_nemico(*nemico));
+    while (hp_nemico > 0 && hp_giocatore > 0) {
+        stampa_lenta(15000000L, "HP giocatore: %d | HP nemico: %d\n", hp_giocatore, hp_nemico);
+        int scelta = 1;
+        if (!g->bot) {
+            stampa_lenta(15000000L, "1) Attacca 2) Usa oggetto\n");
+            scelta = leggi_intero("Scelta: ", 1, 2);
+        }
+        if (scelta == 2) {
+            utilizza_oggetto(g, &hp_nemico);
+        } else {
+            int tiro_g = randint(1, 20) + g->attacco_psichico;
+            int tiro_n = randint(1, 20) + stats.difesa;
+            if (tiro_g >= tiro_n) {
+                int danno = 2 + g->attacco_psichico / 4;
+                int fortuna = randint(1, 20);
+                if (fortuna <= g->fortuna) {
+                    danno += 2;
+                    stampa_lenta(15000000L, "Colpo fortunato! Danni aumentati.\n");
+                }
+                hp_nemico -= danno;
+                stampa_lenta(15000000L, "Colpito! Danni %d.\n", danno);
+            } else {
+                stampa_lenta(15000000L, "Attacco respinto.\n");
+            }
+        }
+
+        if (hp_nemico <= 0) {
+            break;
+        }
+
+        int tiro_n = randint(1, 20) + stats.attacco;
+        int tiro_g = randint(1, 20) + g->difesa_psichica;
+        if (tiro_n > tiro_g) {
+            int danno = 2 + stats.attacco / 5;
+            int fortuna = randint(1, 20);
+            if (fortuna <= g->fortuna) {
+                danno -= 2;
+                if (danno < 1) {
+                    danno = 1;
+                }
+                stampa_lenta(15000000L, "La fortuna ti protegge! Danni ridotti.\n");
+            }
+            hp_giocatore -= danno;
+            stampa_lenta(15000000L, "Il nemico colpisce! Danni %d.\n", danno);
+        } else {
+            stampa_lenta(15000000L, "Hai evitato l'attacco.\n");
+        }
+        traccia(evento_round_combattimento, g, *nemico, hp_giocatore, hp_nemico);
+    }
+
+    if (hp_giocatore <= 0) {
+        stampa_lenta(15000000L, "Il giocatore %s è morto.\n", g->nome);
+        rimuovi_vivo(g);
+        return 0;
+    }
+
+    stampa_lenta(15000000L, "Nemico sconfitto!\n");
+    if (*nemico == demotorzone) {
+        *vittoria_demotorzone = 1;
+    }
+    int scompare = randint(1, 100) <= 50;
+    if (scompare) {
+        *nemico = nessun_nemico;
+        registra_modifica_zona(g->pos);
+        stampa_lenta(15000000L, "Il nemico è scomparso dalla zona.\n");
+    }
+    return 1;
+}
+
+/*
+ * Simulazione in lotto dei combattimenti: gli scontri avanzano a gruppi
+ * di CORSIE_LOTTO corsie in una struttura di array, un round per passata
+ * e senza salti, cosi' il compilatore puo' vettorizzare il ciclo.
+ * Ogni corsia ha il suo generatore xorshift32; le regole sono quelle di
+ * combatti quando si sceglie sempre di attaccare.
+ */
+#define CORSIE_LOTTO 64
+#define CORSIA_VUOTA SIZE_MAX
+
+typedef struct {
+    uint32_t stato[CORSIE_LOTTO];
+    int hp_giocatore[CORSIE_LOTTO];
+    int hp_nemico[CORSIE_LOTTO];
+    int attacco_giocatore[CORSIE_LOTTO];
+    int difesa_giocatore[CORSIE_LOTTO];
+    int fortuna[CORSIE_LOTTO];
+    int attacco_nemico[CORSIE_LOTTO];
+    int difesa_nemico[CORSIE_LOTTO];
+    int danno_giocatore[CORSIE_LOTTO];
+    int danno_nemico[CORSIE_LOTTO];
+    int round[CORSIE_LOTTO];
+    size_t scontro[CORSIE_LOTTO];
+} Lotto_scontri;
+
+static uint32_t xorshift32(uint32_t x)
+{
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+/* Tiro di d20 dai 16 bit alti dello stato, senza divisioni. */
+static int tiro_d20(uint32_t x)
+{
+    return (int)(((x >> 16) * 20u) >> 16) + 1;
+}
+
+/* Mette nella corsia j lo scontro di indice i. */
+static void lotto_carica(Lotto_scontri *l, int j, const Scontro *s, size_t i)
+{
+    NemicoStats stats = stats_nemico(s->nemico);
+    l->hp_giocatore[j] = 10 + s->difesa_psichica;
+    l->hp_nemico[j] = stats.hp;
+    l->attacco_giocatore[j] = s->attacco_psichico;
+    l->difesa_giocatore[j] = s->difesa_psichica;
+    l->fortuna[j] = s->fortuna;
+    l->attacco_nemico[j] = stats.attacco;
+    l->difesa_nemico[j] = stats.difesa;
+    l->danno_giocatore[j] = 2 + s->attacco_psichico / 4;
+    l->danno_nemico[j] = 2 + stats.attacco / 5;
+    l->round[j] = 0;
+    l->scontro[j] = i;
+}
+
+/*
+ * Un round per ogni corsia: tutti i tiri vengono estratti sempre e gli
+ * esiti si applicano con maschere. Le corsie vuote o concluse girano
+ * a vuoto e vengono ignorate da chi le raccoglie.
+ */
+static void lotto_round(Lotto_scontri *l)
+{
+    for (int j = 0; j < CORSIE_LOTTO; j++) {
+        uint32_t s = l->stato[j];
+        s = xorshift32(s);
+        int tiro_g = tiro_d20(s) + l->attacco_giocatore[j];
+        s = xorshift32(s);
+        int tiro_n = tiro_d20(s) + l->difesa_nemico[j];
+        s = xorshift32(s);
+        int fortuna_attacco = tiro_d20(s) <= l->fortuna[j];
+        s = xorshift32(s);
+        int tiro_attacco_n = tiro_d20(s) + l->attacco_nemico[j];
+        s = xorshift32(s);
+        int tiro_difesa_g = tiro_d20(s) + l->difesa_giocatore[j];
+        s = xorshift32(s);
+        int fortuna_difesa = tiro_d20(s) <= l->fortuna[j];
+        l->stato[j] = s;
+
+        int danno = l->danno_giocatore[j] + (fortuna_attacco ? 2 : 0);
+        int hp_nemico = l->hp_nemico[j] - (tiro_g >= tiro_n ? danno : 0);
+
+        /* Il nemico risponde solo se e' sopravvissuto; il danno subito non scende sotto 1. */
+        int subito = l->danno_nemico[j] - (fortuna_difesa ? 2 : 0);
+        subito = subito < 1 ? 1 : subito;
+        int colpito = hp_nemico > 0 && tiro_attacco_n > tiro_difesa_g;
+
+        l->hp_nemico[j] = hp_nemico;
+        l->hp_giocatore[j] -= colpito ? subito : 0;
+        l->round[j] += 1;
+    }
+}
+
+/*
+ * Simula n combattimenti indipendenti e scrive in esiti[i] il risultato
+ * dello scontro i. Il seme rende la simulazione ripetibile.
+ * Le corsie che finiscono vengono subito riempite con gli scontri successivi.
+ */
+void simula_scontri(const Scontro *scontri, size_t n, uint64_t seme, Esito_scontro *esiti)
+{
+    Lotto_scontri l;
+    size_t prossimo = 0;
+    int attive = 0;
+    for (int j = 0; j < CORSIE_LOTTO; j++) {
+        l.stato[j] = (uint32_t)mescola64(seme + (uint64_t)j) | 1u;
+        if (prossimo < n) {
+            lotto_carica(&l, j, &scontri[prossimo], prossimo);
+            prossimo++;
+            attive++;
+        } else {
+            lotto_carica(&l, j, &(Scontro){0, 0, 0, nessun_nemico}, CORSIA_VUOTA);
+        }
+    }
+
+    while (attive > 0) {
+        lotto_round(&l);
+        for (int j = 0; j < CORSIE_LOTTO; j++) {
+            if (l.scontro[j] == CORSIA_VUOTA || (l.hp_nemico[j] > 0 && l.hp_giocatore[j] > 0)) {
+                continue;
+            }
+            Esito_scontro *e = &esiti[l.scontro[j]];
+            e->vinto = l.hp_giocatore[j] > 0;
+            e->round = l.round[j];
+            e->hp_giocatore = l.hp_giocatore[j];
+            if (prossimo < n) {
+                lotto_carica(&l, j, &scontri[prossimo], prossimo);
+                prossimo++;
+            } else {
+                l.scontro[j] = CORSIA_VUOTA;
+                attive--;
+            }
+        }
+    }
+}
+
+/*
+ * Sposta il giocatore alla zona successiva nella mappa corrente,
+ * se non ha già avanzato nel turno e dopo l'eventuale combattimento.
+ */
+
+static int avanza(Giocatore *g, int *vittoria_demotorzone, int *ha_avanzato)
+{
+    if (*ha_avanzato) {
+        stampa_lenta(15000000L, "Hai già avanzato in questo turno.\n");
+        return 0;
+    }
+    if (!combatti(g, &g->pos->nemico[g->mondo], vittoria_demotorzone)) {
+        return 0;
+    }
+    Zona *succ = zona_successiva(g->pos);
+    if (succ) {
+        sposta_giocatore(g, succ);
+        *ha_avanzato = 1;
+        stampa_lenta(15000000L, "Avanzato nel %s.\n", nome_mondo(g->mondo));
+        return 1;
+    }
+    stampa_lenta(15000000L, "Non puoi avanzare oltre.\n");
+    return 0;
+}
+
+/*
+ * Sposta il giocatore alla zona precedente nella mappa corrente,
+ * rispettando le stesse regole di avanzamento e combattimento.
+ */
+
+static int indietreggia(Giocatore *g, int *vittoria_demotorzone, int *ha_avanzato)
+{
+    if (*ha_avanzato) {
+        stampa_lenta(15000000L, "Hai già avanzato in questo turno.\n");
+        return 0;
+    }
+    if (!combatti(g, &g->pos->nemico[g->mondo], vittoria_demotorzone)) {
+        return 0;
+    }
+    Zona *prec = zona_precedente(g->pos);
+    if (prec) {
+        sposta_giocatore(g, prec);
+        *ha_avanzato = 1;
+        stampa_lenta(15000000L, "Indietreggiato nel %s.\n", nome_mondo(g->mondo));
+        return 1;
+    }
+    stampa_lenta(15000000L, "Non puoi indietreggiare oltre.\n");
+    return 0;
+}
+
+/*
+ * Consente il passaggio tra i mondi restando nella stessa zona:
+ * verso il mondo successivo richiede un tiro fortuna e non permette
+ * il cambio se si è già avanzato nel turno; dall'ultimo mondo
+ * si torna liberamente al Mondo Reale.
+ */
+
+static int cambia_mondo(Giocatore *g, int *vittoria_demotorzone, int *ha_avanzato)
+{
+    if (g->mondo + 1 < NUM_MONDI) {
+        if (*ha_avanzato) {
+            stampa_lenta(15000000L, "Hai già avanzato in questo turno.\n");
+            return 0;
+        }
+        if (!combatti(g, &g->pos->nemico[g->mondo], vittoria_demotorzone)) {
+            return 0;
+        }
+        int tiro = randint(1, 20);
+        if (tiro >= g->fortuna) {
+            stampa_lenta(15000000L, "Tentativo fallito (tiro %d, fortuna %d).\n", tiro, g->fortuna);
+            return 0;
+        }
+        conta_calore(g, calore_cambio_mondo);
+        g->mondo++;
+        *ha_avanzato = 1;
+        traccia(evento_cambio_mondo, g, g->mondo, (int32_t)g->pos->indice, 0);
+        stampa_lenta(15000000L, "Sei entrato nel %s.\n", nome_mondo(g->mondo));
+        return 1;
+    }
 
-    stampa_lenta(15000000L, "Impostazione gioco completata.\n");
+    conta_calore(g, calore_cambio_mondo);
+    g->mondo = mondo_reale;
+    traccia(evento_cambio_mondo, g, g->mondo, (int32_t)g->pos->indice, 0);
+    stampa_lenta(15000000L, "Sei tornato nel %s.\n", nome_mondo(g->mondo));
+    return 1;
 }
 
 /*
- * Verifica se non ci sono più giocatori vivi.
+ * Sceglie l'azione di un bot: raccoglie gli oggetti liberi, prova
+ * a passare al mondo successivo finche' non arriva all'ultimo e li'
+ * percorre la mappa avanti e indietro cercando il demotorzone.
+ * Dopo qualche tentativo a vuoto passa il turno.
  */
-static int tutti_morti(void)
+static int scelta_bot(Giocatore *g, int ha_avanzato, int tentativi)
 {
-    for (int i = 0; i < MAX_GIOCATORI; i++) {
-        if (giocatori[i]) {
-            return 0;
+    if (ha_avanzato || tentativi >= 3) {
+        return 9;
+    }
+    if (g->mondo != MONDO_DEMOTORZONE) {
+        Zona *z = g->pos;
+        if (z->nemico[g->mondo] == nessun_nemico && z->oggetto[g->mondo] != nessun_oggetto &&
+            g->zaino[ZAINO_MAX - 1] == nessun_oggetto) {
+            return 7;
         }
+        if (!ha_zona_successiva(z) || randint(1, 2) == 1) {
+            return 3;
+        }
+        return 1;
     }
-    return 1;
+    /* Nella mappa virtuale il bot torna indietro oltre la zona del demotorzone. */
+    int in_fondo = !ha_zona_successiva(g->pos) ||
+                   (mappa_virtuale_attiva && g->pos->indice + 1 >= mappa_virtuale.raggio_demotorzone);
+    int all_inizio = mappa_virtuale_attiva ? g->pos->indice == 0 : !g->pos->indietro;
+    if (g->direzione > 0 && in_fondo) {
+        g->direzione = -1;
+    } else if (g->direzione < 0 && all_inizio) {
+        g->direzione = 1;
+    }
+    return g->direzione > 0 ? 1 : 2;
 }
 
 /*
- * Salva il nome del vincitore nelle ultime tre partite.
+ * Gestisce il menu delle azioni del singolo giocatore
+ * per tutta la durata del suo turno.
  */
-static void registra_vincitore(const char *nome)
+
+static void turno_giocatore(Giocatore *g, int *vittoria_demotorzone)
 {
-    if (vincitori_count < 3) {
-        strncpy(vincitori[vincitori_count], nome, NOME_MAX);
-        vincitori[vincitori_count][NOME_MAX - 1] = '\0';
-        vincitori_count++;
-    } else {
-        for (int i = 0; i < 2; i++) {
-            strncpy(vincitori[i], vincitori[i + 1], NOME_MAX);
+    int ha_avanzato = 0;
+    int finito = 0;
+    int tentativi = 0;
+    traccia(evento_inizio_turno, g, g->mondo, (int32_t)g->pos->indice, 0);
+    while (!finito) {
+        if (schermo_attivo) {
+            disegna_schermo(g);
+        }
+        stampa_lenta(15000000L, "\n--- Turno di %s ---\n", g->nome);
+        if (g->bot) {
+            int scelta = scelta_bot(g, ha_avanzato, tentativi++);
+            switch (scelta) {
+            case 1:
+                avanza(g, vittoria_demotorzone, &ha_avanzato);
+                break;
+            case 2:
+                indietreggia(g, vittoria_demotorzone, &ha_avanzato);
+                break;
+            case 3:
+                cambia_mondo(g, vittoria_demotorzone, &ha_avanzato);
+                break;
+            case 7:
+                raccogli_oggetto(g);
+                break;
+            default:
+                finito = 1;
+                break;
+            }
+            if (*vittoria_demotorzone || g->indice_vivo < 0) {
+                finito = 1;
+            }
+            continue;
+        }
+        /* Con lo schermo intero il menu e' gia' disegnato nel pannello azioni. */
+        if (!schermo_attivo) {
+            stampa_lenta(15000000L, "1) avanza\n");
+            stampa_lenta(15000000L, "2) indietreggia\n");
+            stampa_lenta(15000000L, "3) cambia_mondo\n");
+            stampa_lenta(15000000L, "4) combatti\n");
+            stampa_lenta(15000000L, "5) stampa_giocatore\n");
+            stampa_lenta(15000000L, "6) stampa_zona\n");
+            stampa_lenta(15000000L, "7) raccogli_oggetto\n");
+            stampa_lenta(15000000L, "8) utilizza_oggetto\n");
+            stampa_lenta(15000000L, "9) passa\n");
+        }
+        int scelta = leggi_intero("Scelta: ", 1, 9);
+        switch (scelta) {
+        case 1:
+            avanza(g, vittoria_demotorzone, &ha_avanzato);
+            break;
+        case 2:
+            indietreggia(g, vittoria_demotorzone, &ha_avanzato);
+            break;
+        case 3:
+            cambia_mondo(g, vittoria_demotorzone, &ha_avanzato);
+            break;
+        case 4:
+            combatti(g, &g->pos->nemico[g->mondo], vittoria_demotorzone);
+            break;
+        case 5:
+            stampa_giocatore(g);
+            break;
+        case 6:
+            stampa_zona_corrente(g);
+            break;
+        case 7:
+            raccogli_oggetto(g);
+            break;
+        case 8:
+            utilizza_oggetto(g, NULL);
+            break;
+        case 9:
+            finito = 1;
+            break;
+        default:
+            break;
+        }
+        if (*vittoria_demotorzone) {
+            finito = 1;
+        }
+        if (g->indice_vivo < 0) {
+            finito = 1;
         }
-        strncpy(vincitori[2], nome, NOME_MAX);
-        vincitori[2][NOME_MAX - 1] = '\0';
     }
-    partite_giocate++;
+    traccia(evento_fine_turno, g, g->mondo, 0, 0);
 }
 
 /*
- * Stampa le informazioni complete di un giocatore.
+ * Posiziona i giocatori nella prima zona, nel Mondo Reale.
  */
-static void stampa_giocatore(Giocatore *g)
+static void imposta_posizioni_iniziali(void)
 {
-    if (!g) {
-        return;
-    }
-    stampa_lenta(15000000L, "Giocatore: %s\n", g->nome);
-    stampa_lenta(15000000L, "Mondo: %s\n", g->mondo == 0 ? "Mondo Reale" : "Soprasotto");
-    stampa_lenta(15000000L, "Attacco: %d Difesa: %d Fortuna: %d\n", g->attacco_psichico, g->difesa_psichica, g->fortuna);
-    stampa_lenta(15000000L, "Zaino: ");
-    for (int i = 0; i < ZAINO_MAX; i++) {
-        stampa_lenta(15000000L, "%s", nome_oggetto(g->zaino[i]));
-        if (i < ZAINO_MAX - 1) {
-            stampa_lenta(15000000L, ", ");
+    /* La mappa a liste e' chiusa: la posizione di ogni zona resta fissa per la storia. */
+    if (!mappa_virtuale_attiva) {
+        size_t indice = 0;
+        for (Zona *z = prima_zona; z; z = z->avanti) {
+            z->indice = indice++;
         }
     }
-    stampa_lenta(15000000L, "\n");
+    Zona *inizio = mappa_virtuale_attiva ? materializza_zona(0) : prima_zona;
+    for (int i = 0; i < num_vivi; i++) {
+        Giocatore *g = &giocatori[vivi[i]];
+        g->mondo = mondo_reale;
+        g->direzione = 1;
+        sposta_giocatore(g, inizio);
+    }
 }
 
 /*
- * Stampa la zona in cui si trova il giocatore.
+ * Salvataggi della partita in corso senza fermarla: salvataggio_avvia fa
+ * una fork e il figlio, che vede la partita congelata grazie alla copia
+ * su scrittura, la serializza in un file temporaneo, fa fsync e lo
+ * rinomina sul definitivo. Il thread di gioco paga solo la fork.
+ * Se il salvataggio precedente e' ancora in corso il nuovo viene saltato.
+ *
+ * Formato (interi little endian): SALVA_MAGIC, round, stato del generatore,
+ * numero di zone (UINT64_MAX per una mappa infinita) e di giocatori;
+ * per ogni giocatore nome, bot, vivo, mondo, direzione + 1, indice della
+ * zona, attacco, difesa, fortuna e zaino; poi le zone in forma compatta
+ * (sizeof(Zona_compatta) byte ciascuna) oppure, per la mappa infinita, seme e coppie indice-zona delle zone modificate.
  */
-static void stampa_zona_corrente(Giocatore *g)
+#define FILE_SALVATAGGIO "partita.sav"
+#define SALVA_MAGIC "CSSALVA1"
+#define SALVA_MAGIC_LEN 8
+
+static int salvataggi_attivi = 0;
+static pid_t salvataggio_figlio = 0;
+static int salvataggio_riuscito = 0;
+static size_t salvataggi_scritti = 0;
+static size_t salvataggi_saltati = 0;
+static _Thread_local int round_corrente = 0;
+
+/* Scrittura a blocchi su descrittore, senza stdio (lato figlio). */
+typedef struct {
+    int fd;
+    int errore;
+    size_t usati;
+    unsigned char dati[65536];
+} Scrittore;
+
+static void scrittore_svuota(Scrittore *w)
+{
+    size_t fatti = 0;
+    while (!w->errore && fatti < w->usati) {
+        ssize_t n = write(w->fd, w->dati + fatti, w->usati - fatti);
+        if (n <= 0) {
+            w->errore = 1;
+        } else {
+            fatti += (size_t)n;
+        }
+    }
+    w->usati = 0;
+}
+
+static void scrittore_byte(Scrittore *w, const void *p, size_t n)
+{
+    const unsigned char *b = (const unsigned char *)p;
+    while (n > 0) {
+        if (w->usati == sizeof(w->dati)) {
+            scrittore_svuota(w);
+        }
+        size_t pezzo = sizeof(w->dati) - w->usati < n ? sizeof(w->dati) - w->usati : n;
+        memcpy(w->dati + w->usati, b, pezzo);
+        w->usati += pezzo;
+        b += pezzo;
+        n -= pezzo;
+    }
+}
+
+static void scrittore_intero(Scrittore *w, uint64_t v, int byte)
+{
+    unsigned char b[8];
+    for (int i = 0; i < byte; i++) {
+        b[i] = (unsigned char)(v >> (8 * i));
+    }
+    scrittore_byte(w, b, (size_t)byte);
+}
+
+/* Zona compatta con i nemici aggiornati dal mondo a fine round, se attivi. */
+static Zona_compatta zona_salvata(Zona_compatta z, size_t indice)
+{
+    return nemici_mondo ? con_nemici(z, nemici_mondo[indice]) : z;
+}
+
+/* Serializza la partita del thread corrente in percorso (lato figlio). */
+static int scrivi_salvataggio(const char *percorso)
 {
-    if (g->mondo == 0) {
-        stampa_lenta(15000000L, "Zona Mondo Reale: ");
-        stampa_zona_mr(g->pos_mondoreale, 0);
+    static Scrittore w;
+    char temporaneo[512];
+    snprintf(temporaneo, sizeof(temporaneo), "%s.tmp", percorso);
+    w.fd = open(temporaneo, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w.fd < 0) {
+        return 0;
+    }
+    w.errore = 0;
+    w.usati = 0;
+
+    int infinita = mappa_virtuale_attiva && mappa_virtuale.lunghezza == SIZE_MAX;
+    size_t zone = mappa_virtuale_attiva ? mappa_virtuale.lunghezza : (size_t)conta_zone();
+    scrittore_byte(&w, SALVA_MAGIC, SALVA_MAGIC_LEN);
+    scrittore_intero(&w, (uint64_t)round_corrente, 8);
+    scrittore_intero(&w, stato_rng, 8);
+    scrittore_intero(&w, infinita ? UINT64_MAX : (uint64_t)zone, 8);
+    scrittore_intero(&w, (uint64_t)num_giocatori, 4);
+    for (int i = 0; i < num_giocatori; i++) {
+        const Giocatore *g = &giocatori[i];
+        int vivo = g->indice_vivo >= 0 && g->pos;
+        scrittore_byte(&w, g->nome, NOME_MAX);
+        scrittore_intero(&w, (uint64_t)g->bot, 1);
+        scrittore_intero(&w, (uint64_t)vivo, 1);
+        scrittore_intero(&w, (uint64_t)g->mondo, 1);
+        scrittore_intero(&w, (uint64_t)(g->direzione + 1), 1);
+        scrittore_intero(&w, vivo ? (uint64_t)g->pos->indice : UINT64_MAX, 8);
+        scrittore_intero(&w, (uint64_t)g->attacco_psichico, 1);
+        scrittore_intero(&w, (uint64_t)g->difesa_psichica, 1);
+        scrittore_intero(&w, (uint64_t)g->fortuna, 1);
+        for (int k = 0; k < ZAINO_MAX; k++) {
+            scrittore_intero(&w, (uint64_t)g->zaino[k], 1);
+        }
+    }
+
+    if (infinita) {
+        const Tabella_zone *t = &mappa_virtuale.modificate;
+        scrittore_intero(&w, mappa_virtuale.seme, 8);
+        scrittore_intero(&w, (uint64_t)t->occupati, 8);
+        for (size_t i = 0; i < t->capacita; i++) {
+            if (t->chiavi[i] != 0) {
+                scrittore_intero(&w, t->chiavi[i] - 1, 8);
+                scrittore_intero(&w, t->valori[i], (int)sizeof(Zona_compatta));
+            }
+        }
     } else {
-        stampa_lenta(15000000L, "Zona Soprasotto: ");
-        stampa_zona_ss(g->pos_soprasotto, 0);
+        Zona *cur = prima_zona;
+        for (size_t i = 0; i < zone; i++) {
+            Zona_compatta z;
+            if (mappa_virtuale_attiva) {
+                z = mappa_virtuale_zona(&mappa_virtuale, i);
+            } else {
+                z = zona_compatta(cur);
+                cur = cur->avanti;
+            }
+            scrittore_intero(&w, zona_salvata(z, i), (int)sizeof(Zona_compatta));
+        }
     }
+    scrittore_svuota(&w);
+    int ok = !w.errore && fsync(w.fd) == 0;
+    ok = close(w.fd) == 0 && ok;
+    return ok && rename(temporaneo, percorso) == 0;
 }
 
 /*
- * Raccoglie un oggetto dalla zona, se possibile.
+ * Raccoglie l'esito del salvataggio in corso, aspettandolo se attendi.
+ * Restituisce 0 se il figlio sta ancora scrivendo.
  */
-static int raccogli_oggetto(Giocatore *g)
+static int raccogli_salvataggio(int attendi)
 {
-    if (g->mondo != 0) {
-        stampa_lenta(15000000L, "Nel Soprasotto non ci sono oggetti.\n");
+    if (salvataggio_figlio <= 0) {
+        return 1;
+    }
+    int stato;
+    pid_t r = waitpid(salvataggio_figlio, &stato, attendi ? 0 : WNOHANG);
+    if (r == 0) {
         return 0;
     }
-    Zona_mondoreale *z = g->pos_mondoreale;
-    if (z->nemico != nessun_nemico) {
-        stampa_lenta(15000000L, "Prima devi sconfiggere il nemico.\n");
+    salvataggio_riuscito = r == salvataggio_figlio && WIFEXITED(stato) && WEXITSTATUS(stato) == 0;
+    salvataggi_scritti += (size_t)salvataggio_riuscito;
+    salvataggio_figlio = 0;
+    return 1;
+}
+
+/*
+ * Avvia in background il salvataggio della partita del thread corrente.
+ * Restituisce 1 se il salvataggio e' partito, 0 se quello precedente
+ * e' ancora in corso o la fork non riesce.
+ */
+int salvataggio_avvia(const char *percorso)
+{
+    if (!raccogli_salvataggio(0)) {
+        salvataggi_saltati++;
         return 0;
     }
-    if (z->oggetto == nessun_oggetto) {
-        stampa_lenta(15000000L, "Nessun oggetto da raccogliere.\n");
+    pid_t pid = fork();
+    if (pid < 0) {
         return 0;
     }
-    for (int i = 0; i < ZAINO_MAX; i++) {
-        if (g->zaino[i] == nessun_oggetto) {
-            g->zaino[i] = z->oggetto;
-            stampa_lenta(15000000L, "Oggetto raccolto: %s\n", nome_oggetto(z->oggetto));
-            z->oggetto = nessun_oggetto;
-            return 1;
-        }
+    if (pid == 0) {
+        _exit(scrivi_salvataggio(percorso) ? 0 : 1);
     }
-    stampa_lenta(15000000L, "Zaino pieno.\n");
-    return 0;
+    salvataggio_figlio = pid;
+    return 1;
 }
 
 /*
- * Applica l'effetto di un oggetto a giocatore/nemico.
+ * Aspetta il salvataggio in corso, se c'e'.
+ * Restituisce 1 se l'ultimo salvataggio e' stato scritto.
  */
-static int usa_oggetto_effetto(Giocatore *g, Tipo_oggetto oggetto, int *hp_nemico)
+int salvataggio_attendi(void)
 {
-    switch (oggetto) {
-    case bicicletta:
-        g->fortuna += 2;
-        if (g->fortuna > 20) {
-            g->fortuna = 20;
-        }
-        stampa_lenta(15000000L, "Fortuna aumentata a %d.\n", g->fortuna);
-        break;
-    case maglietta_fuocoinferno:
-        g->attacco_psichico += 3;
-        if (g->attacco_psichico > 20) {
-            g->attacco_psichico = 20;
-        }
-        stampa_lenta(15000000L, "Attacco aumentato a %d.\n", g->attacco_psichico);
-        break;
-    case bussola:
-        g->difesa_psichica += 2;
-        if (g->difesa_psichica > 20) {
-            g->difesa_psichica = 20;
-        }
-        stampa_lenta(15000000L, "Difesa aumentata a %d.\n", g->difesa_psichica);
-        break;
-    case schitarrata_metallica:
-        if (hp_nemico) {
-            *hp_nemico -= 5;
-            stampa_lenta(15000000L, "Schitarrata metallica! Danni al nemico (-5).\n");
-        } else {
-            g->attacco_psichico += 1;
-            g->difesa_psichica += 1;
-            if (g->attacco_psichico > 20) {
-                g->attacco_psichico = 20;
+    raccogli_salvataggio(1);
+    return salvataggio_riuscito;
+}
+
+/* Attiva o disattiva il salvataggio in background alla fine di ogni round. */
+void alterna_salvataggi(void)
+{
+    salvataggi_attivi = !salvataggi_attivi;
+    stampa_lenta(15000000L, "Salvataggio a ogni round in %s %s.\n", FILE_SALVATAGGIO,
+                 salvataggi_attivi ? "attivato" : "disattivato");
+}
+
+/*
+ * Alterna i turni finche' non c'e' vittoria, sono tutti morti o si
+ * raggiunge max_round (0 = nessun limite); con le regole del mondo
+ * attive, alla fine di ogni round si aggiornano i nemici. In esito si annotano round
+ * giocati, sopravvissuti e, se qualcuno ha sconfitto il demotorzone,
+ * nome e statistiche del vincitore.
+ */
+static void svolgi_partita(Esito_partita *esito, int max_round)
+{
+    int vittoria = 0;
+    int *round = &esito->round;
+    *round = 0;
+    storia_inizia();
+    mondo_inizia();
+
+    /*
+     * A questo punto partita avviata: si alternano i turni finché non c'è vittoria o tutti morti.
+     * L'ordine del round si mescola man mano (Fisher-Yates incrementale) direttamente
+     * nell'elenco dei vivi: chi muore viene rimpiazzato dall'ultimo vivo, che non ha
+     * ancora giocato, quindi si ripete lo stesso indice.
+     */
+    while (!vittoria && !tutti_morti() && (max_round == 0 || *round < max_round)) {
+        (*round)++;
+        int k = 0;
+        while (k < num_vivi) {
+            int j = randint(k, num_vivi - 1);
+            int tmp = vivi[k];
+            vivi[k] = vivi[j];
+            vivi[j] = tmp;
+            giocatori[vivi[k]].indice_vivo = k;
+            giocatori[vivi[j]].indice_vivo = j;
+
+            Giocatore *g = &giocatori[vivi[k]];
+            int vittoria_demotorzone = 0;
+            turno_giocatore(g, &vittoria_demotorzone);
+            storia_fine_turno(g);
+            if (vittoria_demotorzone) {
+                vittoria = 1;
+                conta_calore(g, calore_vittoria);
+                traccia(evento_vittoria, g, g->mondo, *round, 0);
+                snprintf(esito->vincitore, NOME_MAX, "%s", g->nome);
+                esito->attacco_psichico = g->attacco_psichico;
+                esito->difesa_psichica = g->difesa_psichica;
+                esito->fortuna = g->fortuna;
+                break;
             }
-            if (g->difesa_psichica > 20) {
-                g->difesa_psichica = 20;
+            if (g->indice_vivo >= 0) {
+                k++;
             }
-            stampa_lenta(15000000L, "Attacco e difesa aumentati.\n");
         }
-        break;
-    default:
-        return 0;
+        /* Dopo l'ultimo round il mondo non si aggiorna: nessun turno lo vedrebbe. */
+        int ultimo = vittoria || tutti_morti() || (max_round != 0 && *round >= max_round);
+        if (nemici_mondo && !ultimo) {
+            mondo_aggiorna(*round);
+        }
+        round_corrente = *round;
+        if (salvataggi_attivi && !silenzioso && !vittoria) {
+            salvataggio_avvia(FILE_SALVATAGGIO);
+        }
     }
-    return 1;
+    mondo_libera();
+    esito->vittoria = vittoria;
+    esito->interrotta = !vittoria && !tutti_morti();
+    esito->sopravvissuti = num_vivi;
 }
 
 /*
- * Permette al giocatore di scegliere un oggetto dallo zaino
- * e applicarne l'effetto, consumandolo.
+ * Avvia la partita, assegna le posizioni iniziali,
+ * alterna i turni in ordine casuale e determina la vittoria.
  */
 
-static int utilizza_oggetto(Giocatore *g, int *hp_nemico)
+void gioca(void)
 {
-    int indice = -1;
-    for (int i = 0; i < ZAINO_MAX; i++) {
-        if (g->zaino[i] != nessun_oggetto) {
-            indice = i;
-            break;
+    if (!mappa_chiusa || (!prima_zona && !mappa_virtuale_attiva) || num_giocatori == 0) {
+        stampa_lenta(15000000L, "Gioco non impostato correttamente.\n");
+        return;
+    }
+
+    imposta_posizioni_iniziali();
+    if (schermo_richiesto) {
+        schermo_apri();
+    }
+    Esito_partita esito;
+    memset(&esito, 0, sizeof(esito));
+    esito.seme = mappa_virtuale_attiva ? mappa_virtuale.seme : 0;
+    salvataggi_scritti = 0;
+    salvataggi_saltati = 0;
+    svolgi_partita(&esito, 0);
+
+    schermo_chiudi();
+    if (esito.vittoria) {
+        stampa_lenta(15000000L, "Il vincitore e' %s!\n", esito.vincitore);
+    } else {
+        stampa_lenta(15000000L, "Tutti i giocatori sono morti. Fine partita.\n");
+    }
+    if (salvataggi_attivi) {
+        salvataggio_attendi();
+        stampa_lenta(15000000L, "Salvataggi in %s: %zu scritti, %zu saltati perche' il precedente era in corso.\n",
+                     FILE_SALVATAGGIO, salvataggi_scritti, salvataggi_saltati);
+    }
+    registra_vincitore(&esito);
+}
+
+/*
+ * Gioca senza interazione una partita di soli bot. Il seme fissa i tiri
+ * e, senza modello, la mappa virtuale di LUNGHEZZA_MAPPA zone; con un
+ * modello condiviso la partita ne legge le zone e tiene solo le sue modifiche.
+ * I bot con poca fortuna possono non cambiare mai mondo: oltre
+ * ROUND_MAX_SIMULAZIONE round la partita viene interrotta. Il mondo
+ * segue le regole del thread chiamante. La sessione corrente viene
+ * azzerata. Restituisce 0 se manca memoria o il modello non e' valido.
+ */
+#define ROUND_MAX_SIMULAZIONE 1000
+
+int simula_partita(uint64_t seme, int num_bot, Modello_mappa *modello, Esito_partita *esito)
+{
+    int silenzioso_prima = silenzioso;
+    silenzioso = 1;
+    semina_rng(seme);
+
+    memset(esito, 0, sizeof(*esito));
+    esito->seme = seme;
+    azzera_sessione();
+    int ok = crea_giocatori(num_bot, num_bot);
+    if (ok) {
+        segno_mappa = arena_segna(&arena_partita);
+        if (modello) {
+            ok = mappa_virtuale_da_modello(&mappa_virtuale, modello);
+        } else {
+            mappa_virtuale_crea(&mappa_virtuale, seme, LUNGHEZZA_MAPPA);
         }
     }
-    if (indice == -1) {
-        stampa_lenta(15000000L, "Zaino vuoto.\n");
-        return 0;
+    if (ok) {
+        mappa_virtuale_attiva = 1;
+        mappa_chiusa = 1;
+        imposta_posizioni_iniziali();
+        svolgi_partita(esito, ROUND_MAX_SIMULAZIONE);
     }
+    azzera_sessione();
+    silenzioso = silenzioso_prima;
+    return ok;
+}
 
-    stampa_lenta(15000000L, "Scegli oggetto:\n");
-    for (int i = 0; i < ZAINO_MAX; i++) {
-        stampa_lenta(15000000L, "%d) %s\n", i + 1, nome_oggetto(g->zaino[i]));
+/*
+ * Simulazione su piu' processi: ogni processo figlio gioca un gruppo di
+ * semi con il proprio stato di gioco e scrive gli esiti in un anello in
+ * memoria condivisa, uno per processo, letto dal coordinatore.
+ * Se un processo cade, gli esiti gia' scritti restano nel suo anello.
+ */
+#define ANELLO_CAPACITA 256
+#define PROCESSI_MAX 64
+
+typedef struct {
+    atomic_size_t testa;
+    atomic_size_t coda;
+    Esito_partita esiti[ANELLO_CAPACITA];
+} Anello_esiti;
+
+/* Accoda un esito, aspettando se l'anello e' pieno (lato processo figlio). */
+static void anello_scrivi(Anello_esiti *a, const Esito_partita *e)
+{
+    size_t testa = atomic_load_explicit(&a->testa, memory_order_relaxed);
+    struct timespec ts = {0, 100000L};
+    while (testa - atomic_load_explicit(&a->coda, memory_order_acquire) >= ANELLO_CAPACITA) {
+        nanosleep(&ts, NULL);
     }
-    int scelta = leggi_intero("Scelta: ", 1, ZAINO_MAX);
-    Tipo_oggetto oggetto = g->zaino[scelta - 1];
-    if (oggetto == nessun_oggetto) {
-        stampa_lenta(15000000L, "Nessun oggetto nello slot.\n");
-        return 0;
+    a->esiti[testa % ANELLO_CAPACITA] = *e;
+    atomic_store_explicit(&a->testa, testa + 1, memory_order_release);
+}
+
+/* Somma un esito al riepilogo e lo registra nella classifica. */
+static void aggrega_esito(Riepilogo_simulazione *r, const Esito_partita *e)
+{
+    r->partite++;
+    r->vittorie += (size_t)e->vittoria;
+    r->interrotte += (size_t)e->interrotta;
+    r->round_totali += (size_t)e->round;
+    registra_vincitore(e);
+}
+
+/* Raccoglie gli esiti presenti nell'anello. Restituisce quanti ne ha letti. */
+static size_t anello_svuota(Anello_esiti *a, Riepilogo_simulazione *r)
+{
+    size_t coda = atomic_load_explicit(&a->coda, memory_order_relaxed);
+    size_t testa = atomic_load_explicit(&a->testa, memory_order_acquire);
+    for (size_t i = coda; i < testa; i++) {
+        aggrega_esito(r, &a->esiti[i % ANELLO_CAPACITA]);
     }
-    if (usa_oggetto_effetto(g, oggetto, hp_nemico)) {
-        g->zaino[scelta - 1] = nessun_oggetto;
-        return 1;
+    atomic_store_explicit(&a->coda, testa, memory_order_release);
+    return testa - coda;
+}
+
+/*
+ * Corpo di un processo figlio: gioca i semi primo_seme + shard + k * esecutori,
+ * contando gli eventi per zona in calore (in memoria condivisa) se presente.
+ */
+static void esegui_shard(Anello_esiti *a, Mappa_calore *calore, const Parametri_simulazione *p, int shard)
+{
+    silenzioso = 1;
+    calore_thread = calore;
+    regole_mondo = p->regole ? *p->regole : (Regole_mondo){0};
+    for (size_t i = (size_t)shard; i < p->partite; i += (size_t)p->esecutori) {
+        Esito_partita e;
+        if (!simula_partita(p->primo_seme + i, p->num_bot, p->modello, &e)) {
+            _exit(1);
+        }
+        anello_scrivi(a, &e);
     }
-    return 0;
+    _exit(0);
+}
+
+/* Partite assegnate all'esecutore w quando i semi sono distribuiti a turno. */
+static size_t partite_assegnate(const Parametri_simulazione *p, int w)
+{
+    size_t n = (size_t)p->esecutori;
+    return p->partite > (size_t)w ? (p->partite - (size_t)w + n - 1) / n : 0;
+}
+
+/* Lunghezza della mappa di calore di una simulazione. */
+static size_t lunghezza_calore(const Parametri_simulazione *p)
+{
+    return p->modello ? p->modello->mappa.lunghezza : LUNGHEZZA_MAPPA;
 }
 
 /*
- * Gestisce un combattimento a turni contro il nemico della stanza.
- * Usa attacco/difesa/fortuna del giocatore e aggiorna lo stato del nemico.
+ * Distribuisce p->partite semi consecutivi su p->esecutori processi figli
+ * e riassume gli esiti in r. Le partite dei processi caduti che non hanno
+ * prodotto un esito vengono contate come perse. I contatori per zona di
+ * ogni figlio stanno in memoria condivisa dopo gli anelli e vengono
+ * sommati in p->calore alla fine, anche per i figli caduti.
+ * Restituisce 0 se non e' stato possibile avviare la simulazione.
  */
-
-static int combatti(Giocatore *g, Tipo_nemico *nemico, int *vittoria_demotorzone)
+int simula_in_parallelo(const Parametri_simulazione *p, Riepilogo_simulazione *r)
 {
-    if (*nemico == nessun_nemico) {
-        stampa_lenta(15000000L, "Nessun nemico presente.\n");
-        return 1;
+    memset(r, 0, sizeof(*r));
+    int processi = p->esecutori;
+    if (processi < 1 || processi > PROCESSI_MAX || p->num_bot < 1) {
+        return 0;
+    }
+    size_t celle_calore = p->calore ? NUM_MONDI * lunghezza_calore(p) : 0;
+    size_t dimensione_anelli = (size_t)processi * sizeof(Anello_esiti);
+    size_t dimensione = dimensione_anelli + (size_t)processi * celle_calore * sizeof(Contatori_zona);
+    Anello_esiti *anelli = (Anello_esiti *)mmap(NULL, dimensione, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (anelli == MAP_FAILED) {
+        return 0;
+    }
+    memoria_conta(memoria_simulazione, (int64_t)dimensione, 1);
+    Contatori_zona *contatori = (Contatori_zona *)((char *)anelli + dimensione_anelli);
+    Mappa_calore calori[PROCESSI_MAX];
+    for (int w = 0; w < processi; w++) {
+        atomic_init(&anelli[w].testa, 0);
+        atomic_init(&anelli[w].coda, 0);
     }
 
-    NemicoStats stats = stats_nemico(*nemico);
-    int hp_nemico = stats.hp;
-    int hp_giocatore = 10 + g->difesa_psichica;
-
-    /* Inizia il ciclo principale del combattimento a turni. */
-    stampa_lenta(15000000L, "Combattimento contro %s!\n", nome_nemico(*nemico));
-    while (hp_nemico > 0 && hp_giocatore > 0) {
-        stampa_lenta(15000000L, "HP giocatore: %d | HP nemico: %d\n", hp_giocatore, hp_nemico);
-        stampa_lenta(15000000L, "1) Attacca 2) Usa oggetto\n");
-        int scelta = leggi_intero("Scelta: ", 1, 2);
-        if (scelta == 2) {
-            utilizza_oggetto(g, &hp_nemico);
-        } else {
-            int tiro_g = randint(1, 20) + g->attacco_psichico;
-            int tiro_n = randint(1, 20) + stats.difesa;
-            if (tiro_g >= tiro_n) {
-                int danno = 2 + g->attacco_psichico / 4;
-                int fortuna = randint(1, 20);
-                if (fortuna <= g->fortuna) {
-                    danno += 2;
-                    stampa_lenta(15000000L, "Colpo fortunato! Danni aumentati.\n");
-                }
-                hp_nemico -= danno;
-                stampa_lenta(15000000L, "Colpito! Danni %d.\n", danno);
-            } else {
-                stampa_lenta(15000000L, "Attacco respinto.\n");
-            }
+    pid_t figli[PROCESSI_MAX];
+    size_t ricevute[PROCESSI_MAX];
+    fflush(stdout);
+    scarica_classifica();
+    for (int w = 0; w < processi; w++) {
+        ricevute[w] = 0;
+        calori[w].lunghezza = celle_calore / NUM_MONDI;
+        calori[w].zone = contatori + (size_t)w * celle_calore;
+        figli[w] = fork();
+        if (figli[w] == 0) {
+            esegui_shard(&anelli[w], p->calore ? &calori[w] : NULL, p, w);
         }
-
-        if (hp_nemico <= 0) {
-            break;
+        if (figli[w] < 0) {
+            r->processi_caduti++;
         }
+    }
 
-        int tiro_n = randint(1, 20) + stats.attacco;
-        int tiro_g = randint(1, 20) + g->difesa_psichica;
-        if (tiro_n > tiro_g) {
-            int danno = 2 + stats.attacco / 5;
-            int fortuna = randint(1, 20);
-            if (fortuna <= g->fortuna) {
-                danno -= 2;
-                if (danno < 1) {
-                    danno = 1;
+    int attivi = processi - r->processi_caduti;
+    struct timespec ts = {0, 1000000L};
+    while (attivi > 0) {
+        size_t letti = 0;
+        for (int w = 0; w < processi; w++) {
+            if (figli[w] <= 0) {
+                continue;
+            }
+            size_t n = anello_svuota(&anelli[w], r);
+            ricevute[w] += n;
+            letti += n;
+            int stato;
+            if (waitpid(figli[w], &stato, WNOHANG) == figli[w]) {
+                /* Il figlio e' uscito: quello che ha scritto e' gia' tutto nell'anello. */
+                ricevute[w] += anello_svuota(&anelli[w], r);
+                if (!WIFEXITED(stato) || WEXITSTATUS(stato) != 0) {
+                    r->processi_caduti++;
                 }
-                stampa_lenta(15000000L, "La fortuna ti protegge! Danni ridotti.\n");
+                figli[w] = 0;
+                attivi--;
             }
-            hp_giocatore -= danno;
-            stampa_lenta(15000000L, "Il nemico colpisce! Danni %d.\n", danno);
-        } else {
-            stampa_lenta(15000000L, "Hai evitato l'attacco.\n");
         }
-    }
-
-    if (hp_giocatore <= 0) {
-        stampa_lenta(15000000L, "Il giocatore %s è morto.\n", g->nome);
-        for (int i = 0; i < MAX_GIOCATORI; i++) {
-            if (giocatori[i] == g) {
-                free(giocatori[i]);
-                giocatori[i] = NULL;
-                break;
-            }
+        if (letti == 0) {
+            nanosleep(&ts, NULL);
         }
-        return 0;
     }
 
-    stampa_lenta(15000000L, "Nemico sconfitto!\n");
-    if (*nemico == demotorzone) {
-        *vittoria_demotorzone = 1;
-    }
-    int scompare = randint(1, 100) <= 50;
-    if (scompare) {
-        *nemico = nessun_nemico;
-        stampa_lenta(15000000L, "Il nemico è scomparso dalla zona.\n");
+    for (int w = 0; w < processi; w++) {
+        r->perse += partite_assegnate(p, w) - ricevute[w];
+        if (p->calore) {
+            somma_calore(p->calore, &calori[w]);
+        }
     }
+    munmap(anelli, dimensione);
+    memoria_conta(memoria_simulazione, -(int64_t)dimensione, -1);
     return 1;
 }
 
 /*
- * Sposta il giocatore alla zona successiva nella mappa corrente,
- * se non ha già avanzato nel turno e dopo l'eventuale combattimento.
+ * Simulazione su piu' thread nello stesso processo: ogni thread gioca
+ * le sue partite con il proprio stato e deposita gli esiti in una coda
+ * MPSC senza lock (anello limitato con un numero di sequenza per cella).
+ * Un thread consumatore in background svuota la coda e aggiorna
+ * classifica e riepilogo, di cui e' l'unico scrittore.
  */
+#define CODA_CAPACITA 4096
+#define THREAD_MAX 64
 
-static int avanza(Giocatore *g, int *vittoria_demotorzone, int *ha_avanzato)
+typedef struct {
+    atomic_size_t sequenza;
+    Esito_partita esito;
+} Cella_esito;
+
+typedef struct {
+    Cella_esito celle[CODA_CAPACITA];
+    atomic_size_t testa;
+    size_t coda;
+    atomic_int produttori_attivi;
+} Coda_esiti;
+
+typedef struct {
+    Coda_esiti *coda;
+    const Parametri_simulazione *parametri;
+    int indice;
+    Mappa_calore calore;
+    size_t prodotte;
+    int fallito;
+} Lavoro_thread;
+
+typedef struct {
+    Coda_esiti *coda;
+    Riepilogo_simulazione *riepilogo;
+} Consumatore_esiti;
+
+/*
+ * Accoda un esito da un qualsiasi thread: si prenota una cella con una
+ * compare-and-swap sulla testa. Se la coda e' piena si cede il processore
+ * finche' il consumatore non libera una cella; non si prende mai un lock.
+ */
+static void coda_scrivi(Coda_esiti *c, const Esito_partita *e)
 {
-    if (*ha_avanzato) {
-        stampa_lenta(15000000L, "Hai già avanzato in questo turno.\n");
-        return 0;
-    }
-    if (g->mondo == 0) {
-        if (!combatti(g, &g->pos_mondoreale->nemico, vittoria_demotorzone)) {
-            return 0;
-        }
-        if (g->pos_mondoreale->avanti) {
-            g->pos_mondoreale = g->pos_mondoreale->avanti;
-            g->pos_soprasotto = g->pos_mondoreale->link_soprasotto;
-            *ha_avanzato = 1;
-            stampa_lenta(15000000L, "Avanzato nel Mondo Reale.\n");
-            return 1;
-        }
-    } else {
-        if (!combatti(g, &g->pos_soprasotto->nemico, vittoria_demotorzone)) {
-            return 0;
-        }
-        if (g->pos_soprasotto->avanti) {
-            g->pos_soprasotto = g->pos_soprasotto->avanti;
-            g->pos_mondoreale = g->pos_soprasotto->link_mondoreale;
-            *ha_avanzato = 1;
-            stampa_lenta(15000000L, "Avanzato nel Soprasotto.\n");
-            return 1;
+    size_t pos = atomic_load_explicit(&c->testa, memory_order_relaxed);
+    for (;;) {
+        Cella_esito *cella = &c->celle[pos % CODA_CAPACITA];
+        size_t sequenza = atomic_load_explicit(&cella->sequenza, memory_order_acquire);
+        if (sequenza == pos) {
+            if (atomic_compare_exchange_weak_explicit(&c->testa, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cella->esito = *e;
+                atomic_store_explicit(&cella->sequenza, pos + 1, memory_order_release);
+                return;
+            }
+        } else {
+            if (sequenza < pos) {
+                sched_yield();
+            }
+            pos = atomic_load_explicit(&c->testa, memory_order_relaxed);
         }
     }
-    stampa_lenta(15000000L, "Non puoi avanzare oltre.\n");
-    return 0;
 }
 
-/*
- * Sposta il giocatore alla zona precedente nella mappa corrente,
- * rispettando le stesse regole di avanzamento e combattimento.
- */
-
-static int indietreggia(Giocatore *g, int *vittoria_demotorzone, int *ha_avanzato)
+/* Toglie il prossimo esito pronto (lato consumatore). Restituisce 0 se non ce n'e'. */
+static int coda_leggi(Coda_esiti *c, Esito_partita *e)
 {
-    if (*ha_avanzato) {
-        stampa_lenta(15000000L, "Hai già avanzato in questo turno.\n");
+    Cella_esito *cella = &c->celle[c->coda % CODA_CAPACITA];
+    if (atomic_load_explicit(&cella->sequenza, memory_order_acquire) != c->coda + 1) {
         return 0;
     }
-    if (g->mondo == 0) {
-        if (!combatti(g, &g->pos_mondoreale->nemico, vittoria_demotorzone)) {
-            return 0;
+    *e = cella->esito;
+    atomic_store_explicit(&cella->sequenza, c->coda + CODA_CAPACITA, memory_order_release);
+    c->coda++;
+    return 1;
+}
+
+/* Corpo di un thread di gioco: i semi primo_seme + indice + k * esecutori. */
+static void *gioca_thread(void *arg)
+{
+    Lavoro_thread *l = (Lavoro_thread *)arg;
+    const Parametri_simulazione *p = l->parametri;
+    silenzioso = 1;
+    calore_thread = l->calore.zone ? &l->calore : NULL;
+    regole_mondo = p->regole ? *p->regole : (Regole_mondo){0};
+    for (size_t i = (size_t)l->indice; i < p->partite; i += (size_t)p->esecutori) {
+        Esito_partita e;
+        if (!simula_partita(p->primo_seme + i, p->num_bot, p->modello, &e)) {
+            l->fallito = 1;
+            break;
         }
-        if (g->pos_mondoreale->indietro) {
-            g->pos_mondoreale = g->pos_mondoreale->indietro;
-            g->pos_soprasotto = g->pos_mondoreale->link_soprasotto;
-            *ha_avanzato = 1;
-            stampa_lenta(15000000L, "Indietreggiato nel Mondo Reale.\n");
-            return 1;
+        coda_scrivi(l->coda, &e);
+        l->prodotte++;
+    }
+    libera_storia();
+    arena_libera(&arena_partita);
+    atomic_fetch_sub_explicit(&l->coda->produttori_attivi, 1, memory_order_release);
+    return NULL;
+}
+
+/* Thread consumatore: svuota la coda finche' ci sono produttori attivi. */
+static void *consuma_esiti(void *arg)
+{
+    Consumatore_esiti *c = (Consumatore_esiti *)arg;
+    struct timespec ts = {0, 100000L};
+    for (;;) {
+        int finiti = atomic_load_explicit(&c->coda->produttori_attivi, memory_order_acquire) == 0;
+        Esito_partita e;
+        size_t letti = 0;
+        while (coda_leggi(c->coda, &e)) {
+            aggrega_esito(c->riepilogo, &e);
+            letti++;
         }
-    } else {
-        if (!combatti(g, &g->pos_soprasotto->nemico, vittoria_demotorzone)) {
-            return 0;
+        if (finiti) {
+            return NULL;
         }
-        if (g->pos_soprasotto->indietro) {
-            g->pos_soprasotto = g->pos_soprasotto->indietro;
-            g->pos_mondoreale = g->pos_soprasotto->link_mondoreale;
-            *ha_avanzato = 1;
-            stampa_lenta(15000000L, "Indietreggiato nel Soprasotto.\n");
-            return 1;
+        if (letti == 0) {
+            nanosleep(&ts, NULL);
         }
     }
-    stampa_lenta(15000000L, "Non puoi indietreggiare oltre.\n");
-    return 0;
 }
 
 /*
- * Consente il passaggio tra Mondo Reale e Soprasotto:
- * nel Mondo Reale richiede un tiro fortuna e non permette
- * il cambio se si è già avanzato nel turno.
+ * Come simula_in_parallelo, ma con thread dello stesso processo
+ * al posto dei processi figli; ogni thread conta gli eventi per zona
+ * in un suo array, sommato in p->calore dopo la join.
+ * Restituisce 0 se non e' stato possibile avviare la simulazione.
  */
-
-static int cambia_mondo(Giocatore *g, int *vittoria_demotorzone, int *ha_avanzato)
+int simula_con_thread(const Parametri_simulazione *p, Riepilogo_simulazione *r)
 {
-    if (g->mondo == 0) {
-        if (*ha_avanzato) {
-            stampa_lenta(15000000L, "Hai già avanzato in questo turno.\n");
-            return 0;
+    memset(r, 0, sizeof(*r));
+    int thread = p->esecutori;
+    if (thread < 1 || thread > THREAD_MAX || p->num_bot < 1) {
+        return 0;
+    }
+    Coda_esiti *coda = (Coda_esiti *)mem_alloca(memoria_simulazione, sizeof(Coda_esiti));
+    if (!coda) {
+        return 0;
+    }
+    for (size_t i = 0; i < CODA_CAPACITA; i++) {
+        atomic_init(&coda->celle[i].sequenza, i);
+    }
+    atomic_init(&coda->testa, 0);
+    coda->coda = 0;
+    atomic_init(&coda->produttori_attivi, thread);
+
+    carica_classifica();
+    Consumatore_esiti consumatore = {coda, r};
+    pthread_t id_consumatore;
+    if (pthread_create(&id_consumatore, NULL, consuma_esiti, &consumatore) != 0) {
+        mem_libera(coda);
+        return 0;
+    }
+
+    Lavoro_thread lavori[THREAD_MAX];
+    pthread_t id[THREAD_MAX];
+    for (int t = 0; t < thread; t++) {
+        lavori[t] = (Lavoro_thread){coda, p, t, {0, NULL}, 0, 0};
+        if (p->calore && !mappa_calore_crea(&lavori[t].calore, lunghezza_calore(p))) {
+            lavori[t].fallito = 1;
+            id[t] = pthread_self();
+            atomic_fetch_sub_explicit(&coda->produttori_attivi, 1, memory_order_release);
+            continue;
         }
-        if (!combatti(g, &g->pos_mondoreale->nemico, vittoria_demotorzone)) {
-            return 0;
+        if (pthread_create(&id[t], NULL, gioca_thread, &lavori[t]) != 0) {
+            lavori[t].fallito = 1;
+            id[t] = pthread_self();
+            atomic_fetch_sub_explicit(&coda->produttori_attivi, 1, memory_order_release);
         }
-        int tiro = randint(1, 20);
-        if (tiro >= g->fortuna) {
-            stampa_lenta(15000000L, "Tentativo fallito (tiro %d, fortuna %d).\n", tiro, g->fortuna);
-            return 0;
+    }
+    for (int t = 0; t < thread; t++) {
+        if (!pthread_equal(id[t], pthread_self())) {
+            pthread_join(id[t], NULL);
         }
-        g->mondo = 1;
-        g->pos_soprasotto = g->pos_mondoreale->link_soprasotto;
-        *ha_avanzato = 1;
-        stampa_lenta(15000000L, "Sei entrato nel Soprasotto.\n");
-        return 1;
     }
+    pthread_join(id_consumatore, NULL);
 
-    g->mondo = 0;
-    g->pos_mondoreale = g->pos_soprasotto->link_mondoreale;
-    stampa_lenta(15000000L, "Sei tornato nel Mondo Reale.\n");
+    for (int t = 0; t < thread; t++) {
+        r->perse += partite_assegnate(p, t) - lavori[t].prodotte;
+        r->processi_caduti += lavori[t].fallito;
+        if (p->calore && lavori[t].calore.zone) {
+            somma_calore(p->calore, &lavori[t].calore);
+        }
+        mappa_calore_libera(&lavori[t].calore);
+    }
+    mem_libera(coda);
     return 1;
 }
 
-/*
- * Gestisce il menu delle azioni del singolo giocatore
- * per tutta la durata del suo turno.
- */
-
-static void turno_giocatore(Giocatore *g, int *vittoria_demotorzone)
+/* Stampa le righe non vuote di una mappa di calore, una per zona e mondo. */
+static void stampa_calore(const Mappa_calore *c)
 {
-    int ha_avanzato = 0;
-    int finito = 0;
-    while (!finito && g) {
-        stampa_lenta(15000000L, "\n--- Turno di %s ---\n", g->nome);
-        stampa_lenta(15000000L, "1) avanza\n");
-        stampa_lenta(15000000L, "2) indietreggia\n");
-        stampa_lenta(15000000L, "3) cambia_mondo\n");
-        stampa_lenta(15000000L, "4) combatti\n");
-        stampa_lenta(15000000L, "5) stampa_giocatore\n");
-        stampa_lenta(15000000L, "6) stampa_zona\n");
-        stampa_lenta(15000000L, "7) raccogli_oggetto\n");
-        stampa_lenta(15000000L, "8) utilizza_oggetto\n");
-        stampa_lenta(15000000L, "9) passa\n");
-        int scelta = leggi_intero("Scelta: ", 1, 9);
-        switch (scelta) {
-        case 1:
-            avanza(g, vittoria_demotorzone, &ha_avanzato);
-            break;
-        case 2:
-            indietreggia(g, vittoria_demotorzone, &ha_avanzato);
-            break;
-        case 3:
-            cambia_mondo(g, vittoria_demotorzone, &ha_avanzato);
-            break;
-        case 4:
-            if (g->mondo == 0) {
-                combatti(g, &g->pos_mondoreale->nemico, vittoria_demotorzone);
-            } else {
-                combatti(g, &g->pos_soprasotto->nemico, vittoria_demotorzone);
+    stampa_lenta(15000000L, "\nZona | Mondo       |   comb morti cambi  racc vitt\n");
+    for (size_t i = 0; i < c->lunghezza; i++) {
+        for (int m = 0; m < NUM_MONDI; m++) {
+            const uint64_t *e = c->zone[NUM_MONDI * i + (size_t)m].eventi;
+            uint64_t totale = 0;
+            for (int k = 0; k < calore_numero_eventi; k++) {
+                totale += e[k];
             }
-            break;
-        case 5:
-            stampa_giocatore(g);
-            break;
-        case 6:
-            stampa_zona_corrente(g);
-            break;
-        case 7:
-            raccogli_oggetto(g);
-            break;
-        case 8:
-            utilizza_oggetto(g, NULL);
-            break;
-        case 9:
-            finito = 1;
-            break;
-        default:
-            break;
-        }
-        if (*vittoria_demotorzone) {
-            finito = 1;
-        }
-        if (!g) {
-            finito = 1;
+            if (totale == 0) {
+                continue;
+            }
+            stampa_lenta(15000000L, "%4zu | %-11s | %6llu %5llu %5llu %5llu %4llu\n", i, nome_mondo(m),
+                         (unsigned long long)e[calore_combattimento], (unsigned long long)e[calore_morte],
+                         (unsigned long long)e[calore_cambio_mondo], (unsigned long long)e[calore_raccolta],
+                         (unsigned long long)e[calore_vittoria]);
         }
     }
 }
 
 /*
- * Posiziona i giocatori nella prima zona di entrambe le mappe.
+ * Chiede i parametri di una simulazione su piu' processi o thread
+ * e ne stampa il riepilogo e la mappa di calore per zona.
  */
-static void imposta_posizioni_iniziali(void)
+void simulazione(void)
 {
-    for (int i = 0; i < MAX_GIOCATORI; i++) {
-        if (!giocatori[i]) {
-            continue;
-        }
-        giocatori[i]->mondo = 0;
-        giocatori[i]->pos_mondoreale = prima_zona_mondoreale;
-        giocatori[i]->pos_soprasotto = prima_zona_soprasotto;
+    Parametri_simulazione p;
+    memset(&p, 0, sizeof(p));
+    p.partite = (size_t)leggi_intero("Numero partite: ", 1, 2147483647);
+    int con_thread = leggi_intero("Esecuzione: 0) processi 1) thread: ", 0, 1);
+    p.esecutori = leggi_intero(con_thread ? "Thread (1-64): " : "Processi (1-64): ", 1, PROCESSI_MAX);
+    p.num_bot = leggi_intero("Bot per partita (1-100): ", 1, 100);
+    p.primo_seme = (uint64_t)leggi_intero("Primo seme: ", 0, 2147483647);
+    if (modello_condiviso && leggi_intero("Mappa: 0) da seme 1) mappa condivisa: ", 0, 1) == 1) {
+        p.modello = modello_condiviso;
+    }
+    if (regole_mondo.attive) {
+        p.regole = &regole_mondo;
+    }
+
+    Mappa_calore calore;
+    if (mappa_calore_crea(&calore, lunghezza_calore(&p))) {
+        p.calore = &calore;
+    }
+    Riepilogo_simulazione r;
+    int avviata = con_thread ? simula_con_thread(&p, &r) : simula_in_parallelo(&p, &r);
+    if (!avviata) {
+        mappa_calore_libera(&calore);
+        stampa_lenta(15000000L, "Impossibile avviare la simulazione.\n");
+        return;
+    }
+    stampa_lenta(15000000L, "Partite simulate: %zu\n", r.partite);
+    stampa_lenta(15000000L, "Vittorie: %zu | Senza vincitore: %zu | Interrotte: %zu\n",
+                 r.vittorie, r.partite - r.vittorie - r.interrotte, r.interrotte);
+    if (r.partite > 0) {
+        stampa_lenta(15000000L, "Round medi per partita: %.2f\n", (double)r.round_totali / (double)r.partite);
+    }
+    if (r.processi_caduti > 0) {
+        stampa_lenta(15000000L, "%s caduti: %d | Partite perse: %zu\n",
+                     con_thread ? "Thread" : "Processi", r.processi_caduti, r.perse);
     }
+    if (p.calore) {
+        stampa_calore(&calore);
+    }
+    mappa_calore_libera(&calore);
 }
 
 /*
- * Avvia la partita, assegna le posizioni iniziali,
- * alterna i turni in ordine casuale e determina la vittoria.
+ * Carico di lavoro rappresentativo senza interazione, usato da make pgo per
+ * raccogliere il profilo: genera una mappa grande, ci applica lotti di
+ * modifiche e la ricomprime, legge e modifica una mappa virtuale, risolve
+ * scontri in lotto e gioca partite simulate, sia da seme sia su un
+ * modello condiviso. Restituisce 0 se un passo fallisce.
  */
+#define ALLENAMENTO_ZONE 100000
+#define ALLENAMENTO_LOTTI 20
+#define ALLENAMENTO_MODIFICHE 1000
+#define ALLENAMENTO_SCONTRI 200000
+#define ALLENAMENTO_PARTITE 4000
 
-void gioca(void)
+int allenamento(void)
 {
-    if (!mappa_chiusa || !prima_zona_mondoreale || num_giocatori == 0) {
-        stampa_lenta(15000000L, "Gioco non impostato correttamente.\n");
-        return;
-    }
+    int silenzioso_prima = silenzioso;
+    silenzioso = 1;
+    semina_rng(1);
+    azzera_sessione();
 
-    imposta_posizioni_iniziali();
-    int vittoria = 0;
-    char vincitore[NOME_MAX] = "";
-
-    /* A questo punto partita avviata: si alternano i turni finché non c'è vittoria o tutti morti. */
-    while (!vittoria && !tutti_morti()) {
-        int indici[MAX_GIOCATORI];
-        int count = 0;
-        for (int i = 0; i < MAX_GIOCATORI; i++) {
-            if (giocatori[i]) {
-                indici[count++] = i;
+    Mappa_compatta m = {NULL, 0};
+    Modifica_mappa *modifiche = (Modifica_mappa *)mem_alloca(memoria_mappe, ALLENAMENTO_MODIFICHE * sizeof(Modifica_mappa));
+    Scontro *scontri = (Scontro *)mem_alloca(memoria_simulazione, ALLENAMENTO_SCONTRI * sizeof(Scontro));
+    Esito_scontro *esiti = (Esito_scontro *)mem_alloca(memoria_simulazione, ALLENAMENTO_SCONTRI * sizeof(Esito_scontro));
+    int ok = modifiche && scontri && esiti && genera_mappa_compatta(&m, ALLENAMENTO_ZONE) && espandi_mappa(&m);
+
+    /* Meta' cancellazioni a posizioni distinte, meta' inserimenti senza demotorzone. */
+    for (int lotto = 0; ok && lotto < ALLENAMENTO_LOTTI; lotto++) {
+        size_t len = (size_t)conta_zone();
+        size_t passo = len / (ALLENAMENTO_MODIFICHE / 2);
+        for (size_t i = 0; i < ALLENAMENTO_MODIFICHE; i++) {
+            Modifica_mappa *mod = &modifiche[i];
+            if (i % 2 == 0) {
+                mod->tipo = modifica_cancella;
+                mod->posizione = (i / 2) * passo + 1 + (size_t)randint(0, (int)passo - 1);
+                mod->zona = 0;
+            } else {
+                mod->tipo = modifica_inserisci;
+                mod->posizione = (size_t)randint(1, (int)len + 1);
+                Tipo_nemico nemici[NUM_MONDI];
+                Tipo_zona tipo = random_tipo_zona();
+                for (int w = 0; w < NUM_MONDI; w++) {
+                    nemici[w] = w == mondo_reale ? random_nemico(w) : (randint(0, 1) ? democane : nessun_nemico);
+                }
+                mod->zona = zc_componi(tipo, nemici, random_oggetto());
             }
         }
-        for (int i = count - 1; i > 0; i--) {
-            int j = randint(0, i);
-            int tmp = indici[i];
-            indici[i] = indici[j];
-            indici[j] = tmp;
-        }
+        ok = applica_modifiche(modifiche, ALLENAMENTO_MODIFICHE);
+    }
+    libera_mappa_compatta(&m);
+    ok = ok && comprimi_mappa(&m);
+    libera_mappa();
 
-        for (int i = 0; i < count; i++) {
-            Giocatore *g = giocatori[indici[i]];
-            if (!g) {
-                continue;
-            }
-            int vittoria_demotorzone = 0;
-            turno_giocatore(g, &vittoria_demotorzone);
-            if (vittoria_demotorzone) {
-                vittoria = 1;
-                strncpy(vincitore, g->nome, NOME_MAX);
-                vincitore[NOME_MAX - 1] = '\0';
-                break;
-            }
-            if (tutti_morti()) {
-                break;
+    if (ok) {
+        Mappa_virtuale v;
+        mappa_virtuale_crea(&v, 1, ALLENAMENTO_ZONE);
+        size_t trovati = 0;
+        for (size_t i = 0; ok && i < ALLENAMENTO_ZONE; i++) {
+            Zona_compatta z = mappa_virtuale_zona(&v, i);
+            trovati += zc_nemico(z, MONDO_DEMOTORZONE) == demotorzone;
+            if (i % 16 == 0) {
+                ok = mappa_virtuale_modifica(&v, i, zc_con_nemico(z, mondo_reale, nessun_nemico));
             }
         }
+        ok = ok && trovati == 1;
+        mappa_virtuale_libera(&v);
     }
 
-    if (vittoria) {
-        stampa_lenta(15000000L, "Il vincitore e' %s!\n", vincitore);
-        registra_vincitore(vincitore);
-    } else {
-        stampa_lenta(15000000L, "Tutti i giocatori sono morti. Fine partita.\n");
-        registra_vincitore("Nessuno");
+    if (ok) {
+        for (size_t i = 0; i < ALLENAMENTO_SCONTRI; i++) {
+            scontri[i].attacco_psichico = randint(1, 20);
+            scontri[i].difesa_psichica = randint(1, 20);
+            scontri[i].fortuna = randint(1, 20);
+            scontri[i].nemico = (Tipo_nemico)randint(billi, demotorzone);
+        }
+        simula_scontri(scontri, ALLENAMENTO_SCONTRI, 1, esiti);
+    }
+
+    Modello_mappa *modello = ok ? cache_mappe_ottieni(1, LUNGHEZZA_MAPPA) : NULL;
+    for (uint64_t seme = 0; modello && ok && seme < ALLENAMENTO_PARTITE; seme++) {
+        Esito_partita esito;
+        ok = simula_partita(seme, 4, seme % 2 ? modello : NULL, &esito);
     }
+    ok = ok && modello;
+    modello_rilascia(modello);
+
+    libera_mappa_compatta(&m);
+    mem_libera(esiti);
+    mem_libera(scontri);
+    mem_libera(modifiche);
+    azzera_sessione();
+    silenzioso = silenzioso_prima;
+    return ok;
 }
 
 /*
  * Termina il gioco e libera tutte le risorse allocate.
  */
 /*
- * Termina il gioco e libera le risorse allocate.
+ * Termina il gioco e libera le risorse allocate, segnalando
+ * la memoria che risulta ancora in uso.
  */
 void termina_gioco(void)
 {
     stampa_lenta(15000000L, "Termine del gioco. Arrivederci!\n");
-    libera_mappa();
-    libera_giocatori();
-    mappa_chiusa = 0;
+    azzera_annulla();
+    azzera_sessione();
+    arena_libera(&arena_partita);
+    modello_rilascia(modello_condiviso);
+    modello_condiviso = NULL;
+    cache_mappe_svuota();
+    salvataggio_attendi();
+    chiudi_classifica();
+    libera_storia();
+    memoria_rapporto();
+    /* Zone e giocatori persi stavano nell'arena, ormai restituita. */
+    memoria_partita[memoria_zone].vivi = 0;
+    memoria_partita[memoria_giocatori].vivi = 0;
 }
 
 /*
@@ -1389,13 +6540,24 @@ void crediti(void)
 {
     stampa_lenta(15000000L, "\n--- Crediti ---\n");
     stampa_lenta(15000000L, "Creatore: Inserire Nome Cognome\n");
-    stampa_lenta(15000000L, "Partite giocate: %d\n", partite_giocate);
+    stampa_lenta(15000000L, "Partite giocate: %zu\n", classifica_partite());
+
+    Record_classifica recenti[3];
+    size_t n = classifica_recenti(recenti, 3);
     stampa_lenta(15000000L, "Vincitori ultime tre partite:\n");
-    if (vincitori_count == 0) {
+    if (n == 0) {
         stampa_lenta(15000000L, "- Nessuno\n");
-    } else {
-        for (int i = 0; i < vincitori_count; i++) {
-            stampa_lenta(15000000L, "- %s\n", vincitori[i]);
-        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        stampa_lenta(15000000L, "- %s (%d round)\n", recenti[i].vincitore, recenti[i].round);
+    }
+
+    Totale_giocatore migliori[5];
+    n = classifica_migliori(migliori, 5);
+    if (n > 0) {
+        stampa_lenta(15000000L, "Classifica vittorie:\n");
+    }
+    for (size_t i = 0; i < n; i++) {
+        stampa_lenta(15000000L, "%zu) %s: %zu vittorie\n", i + 1, migliori[i].nome, migliori[i].vittorie);
     }
 }
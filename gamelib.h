@@ -2,8 +2,10 @@
 #define GAMELIB_H
 
 #include <stddef.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
-#define MAX_GIOCATORI 4
+#define MAX_GIOCATORI 10000
 #define ZAINO_MAX 3
 #define NOME_MAX 64
 
@@ -38,51 +40,452 @@ typedef enum {
     schitarrata_metallica
 } Tipo_oggetto;
 
+struct Giocatore;
+
 /*
- * Zona del Mondo Reale, 
- * contiene il possibile oggetto e il link alla zona speculare.
+ * Mondi paralleli della mappa: condividono gli indici delle zone e
+ * differiscono solo per nemici e oggetti. Cambiare mondo cambia
+ * l'indice del mondo del giocatore, non la zona in cui si trova.
+ * Per aggiungere un mondo basta alzare NUM_MONDI: i mondi oltre il
+ * Soprasotto ne seguono le regole e il demotorzone sta nell'ultimo.
  */
-typedef struct Zona_mondoreale {
-    Tipo_zona tipo;
-    Tipo_nemico nemico;
-    Tipo_oggetto oggetto;
-    struct Zona_mondoreale *avanti;
-    struct Zona_mondoreale *indietro;
-    struct Zona_soprasotto *link_soprasotto;
-} Zona_mondoreale;
+#define NUM_MONDI 2
+
+typedef enum {
+    mondo_reale,
+    soprasotto
+} Tipo_mondo;
 
 /*
- * Zona del Soprasotto,
- * non contiene oggetti ma mantiene il link alla zona del Mondo Reale.
+ * Zona della mappa, comune a tutti i mondi: tipo e adiacenze sono
+ * condivisi, nemico e oggetto sono per mondo (nel Soprasotto non ci
+ * sono oggetti). giocatori e' l'indice inverso dei giocatori presenti
+ * nella zona, in qualunque mondo, indice la sua posizione (usato dalla
+ * mappa virtuale).
  */
-typedef struct Zona_soprasotto {
+typedef struct Zona {
     Tipo_zona tipo;
-    Tipo_nemico nemico;
-    struct Zona_soprasotto *avanti;
-    struct Zona_soprasotto *indietro;
-    struct Zona_mondoreale *link_mondoreale;
-} Zona_soprasotto;
+    Tipo_nemico nemico[NUM_MONDI];
+    Tipo_oggetto oggetto[NUM_MONDI];
+    struct Zona *avanti;
+    struct Zona *indietro;
+    struct Giocatore *giocatori;
+    size_t indice;
+} Zona;
 
 /*
  * Struttura che rappresenta un giocatore, con statistiche,
- * posizione nei due mondi e inventario limitato.
+ * zona e mondo in cui si trova e inventario limitato.
+ * indice_vivo e' la posizione nell'elenco dei vivi (-1 se morto),
+ * prossimo/precedente_in_zona collegano i giocatori della stessa zona.
  */
-typedef struct {
+typedef struct Giocatore {
     char nome[NOME_MAX];
+    int bot;
+    int direzione;
+    int indice_vivo;
     int mondo;
-    Zona_mondoreale *pos_mondoreale;
-    Zona_soprasotto *pos_soprasotto;
+    Zona *pos;
     int attacco_psichico;
     int difesa_psichica;
     int fortuna;
     Tipo_oggetto zaino[ZAINO_MAX];
+    struct Giocatore *prossimo_in_zona;
+    struct Giocatore *precedente_in_zona;
 } Giocatore;
 
+/*
+ * Zona compressa: bit 0-3 tipo, poi due bit per il nemico di ciascun
+ * mondo e tre per l'oggetto del Mondo Reale; con due mondi sta in 16 bit.
+ * Le adiacenze sono implicite: la zona successiva e' l'elemento seguente.
+ */
+#define ZONA_COMPATTA_BIT (4 + 2 * NUM_MONDI + 3)
+#if ZONA_COMPATTA_BIT <= 16
+typedef uint16_t Zona_compatta;
+#elif ZONA_COMPATTA_BIT <= 32
+typedef uint32_t Zona_compatta;
+#elif ZONA_COMPATTA_BIT <= 64
+typedef uint64_t Zona_compatta;
+#else
+#error "troppi mondi per una Zona_compatta"
+#endif
+
+/*
+ * Mappa in forma compatta: un array contiguo di coppie di zone.
+ * L'array si ottiene da genera_mappa_compatta o comprimi_mappa
+ * e si libera con libera_mappa_compatta.
+ */
+typedef struct {
+    Zona_compatta *zone;
+    size_t lunghezza;
+} Mappa_compatta;
+
+/* Tabella hash ad indirizzamento aperto da indice di zona a valore. */
+typedef struct {
+    uint64_t *chiavi;
+    uint64_t *valori;
+    size_t capacita;
+    size_t occupati;
+} Tabella_zone;
+
+/*
+ * Modello di mappa condiviso in sola lettura tra piu' partite:
+ * viene liberato quando l'ultima partita rilascia il suo riferimento.
+ * La posizione del demotorzone si calcola una volta alla creazione
+ * (SIZE_MAX se non ce n'e' esattamente uno).
+ */
+typedef struct {
+    Mappa_compatta mappa;
+    size_t indice_demotorzone;
+    atomic_int riferimenti;
+} Modello_mappa;
+
+/*
+ * Contatori della cache dei modelli generati da seme e lunghezza:
+ * richieste servite dalla cache, generate e voci espulse per far posto.
+ */
+typedef struct {
+    uint64_t successi;
+    uint64_t mancati;
+    uint64_t espulsi;
+    size_t voci;
+    size_t capacita;
+} Statistiche_cache_mappe;
+
+/*
+ * Mappa virtuale: ogni coppia di zone si ricava dal seme e dal suo indice
+ * (o dal modello condiviso, se presente), solo le zone modificate
+ * durante la partita vengono salvate nell'overlay.
+ */
+typedef struct {
+    uint64_t seme;
+    Modello_mappa *modello;
+    size_t lunghezza;
+    size_t raggio_demotorzone;
+    size_t indice_demotorzone;
+    Tabella_zone modificate;
+} Mappa_virtuale;
+
+/*
+ * Punteggio di una mappa generata da seme: posizione del demotorzone
+ * (da 0), zone con un nemico in ciascun mondo e zone con un oggetto,
+ * in millesimi della lunghezza, e stima in millesimi della probabilita'
+ * che un bot, con i valori tirati dal d20, arrivi al demotorzone e lo sconfigga.
+ */
+typedef struct {
+    uint64_t seme;
+    size_t indice_demotorzone;
+    int densita_nemici[NUM_MONDI];
+    int densita_oggetti;
+    int vittoria_stimata;
+} Punteggio_mappa;
+
+/*
+ * Criteri della ricerca di semi: semi consecutivi da primo_seme per mappe
+ * di lunghezza zone, divisi tra esecutori thread. Una mappa e' accettata
+ * se ogni valore del punteggio sta nel suo intervallo (estremi inclusi).
+ */
+typedef struct {
+    uint64_t primo_seme;
+    size_t semi;
+    size_t lunghezza;
+    int esecutori;
+    size_t demotorzone_min;
+    size_t demotorzone_max;
+    int densita_nemici_min[NUM_MONDI];
+    int densita_nemici_max[NUM_MONDI];
+    int densita_oggetti_min;
+    int vittoria_min;
+    int vittoria_max;
+} Criteri_mappa;
+
+/* Tipo di una modifica in un lotto di modifiche alla mappa. */
+typedef enum {
+    modifica_inserisci,
+    modifica_cancella
+} Tipo_modifica;
+
+/*
+ * Modifica di un lotto: la posizione (da 1) si riferisce alla mappa
+ * prima del lotto; zona e' usata solo dagli inserimenti.
+ */
+typedef struct {
+    Tipo_modifica tipo;
+    size_t posizione;
+    Zona_compatta zona;
+} Modifica_mappa;
+
+/* Combattimento simulato in lotto: si attacca sempre, senza oggetti. */
+typedef struct {
+    int attacco_psichico;
+    int difesa_psichica;
+    int fortuna;
+    Tipo_nemico nemico;
+} Scontro;
+
+/* Esito di un combattimento simulato. */
+typedef struct {
+    int vinto;
+    int round;
+    int hp_giocatore;
+} Esito_scontro;
+
+/* Esito di una partita di soli bot simulata senza interazione. */
+typedef struct {
+    uint64_t seme;
+    int vittoria;
+    int interrotta;
+    int round;
+    int sopravvissuti;
+    char vincitore[NOME_MAX];
+    int attacco_psichico;
+    int difesa_psichica;
+    int fortuna;
+} Esito_partita;
+
+/*
+ * Record di dimensione fissa del file della classifica:
+ * una partita conclusa, con seme, istante e statistiche del vincitore.
+ */
+typedef struct {
+    uint64_t seme;
+    int64_t istante;
+    int32_t round;
+    int32_t vittoria;
+    int32_t attacco_psichico;
+    int32_t difesa_psichica;
+    int32_t fortuna;
+    char vincitore[NOME_MAX];
+} Record_classifica;
+
+/* Giocatori con piu' vittorie tenuti in ordine per classifica_migliori. */
+#define CLASSIFICA_MIGLIORI 16
+
+/* Totali di un giocatore nella classifica. */
+typedef struct {
+    char nome[NOME_MAX];
+    size_t vittorie;
+    size_t round_totali;
+    int64_t ultima_vittoria;
+} Totale_giocatore;
+
+/* Riepilogo di una simulazione distribuita su piu' processi. */
+typedef struct {
+    size_t partite;
+    size_t vittorie;
+    size_t interrotte;
+    size_t round_totali;
+    size_t perse;
+    int processi_caduti;
+} Riepilogo_simulazione;
+
+/* Eventi contati per zona dalla mappa di calore delle simulazioni. */
+typedef enum {
+    calore_combattimento,
+    calore_morte,
+    calore_cambio_mondo,
+    calore_raccolta,
+    calore_vittoria,
+    calore_numero_eventi
+} Evento_calore;
+
+/* Contatori di una zona in un mondo. */
+typedef struct {
+    uint64_t eventi[calore_numero_eventi];
+} Contatori_zona;
+
+/*
+ * Mappa di calore di una simulazione: i contatori della zona i
+ * nel mondo m sono zone[NUM_MONDI * i + m].
+ */
+typedef struct {
+    size_t lunghezza;
+    Contatori_zona *zone;
+} Mappa_calore;
+
+/*
+ * Regole dell'aggiornamento del mondo a fine round, in millesimi:
+ * probabilita' che in una zona senza nemico ne compaia uno, per ciascun
+ * mondo, e che i nemici di due zone adiacenti si scambino di posto.
+ */
+typedef struct {
+    int attive;
+    int comparsa[NUM_MONDI];
+    int movimento;
+} Regole_mondo;
+
+/*
+ * Parametri di una simulazione: partite semi consecutivi da primo_seme,
+ * distribuiti su esecutori processi o thread. Con modello le partite si
+ * giocano sulla mappa condivisa, con regole il mondo si aggiorna a fine
+ * round; con calore si raccolgono i contatori per zona.
+ */
+typedef struct {
+    uint64_t primo_seme;
+    size_t partite;
+    int esecutori;
+    int num_bot;
+    Modello_mappa *modello;
+    const Regole_mondo *regole;
+    Mappa_calore *calore;
+} Parametri_simulazione;
+
+/* Tipi di evento della traccia di gioco. */
+typedef enum {
+    evento_inizio_turno,
+    evento_fine_turno,
+    evento_movimento,
+    evento_cambio_mondo,
+    evento_round_combattimento,
+    evento_uso_oggetto,
+    evento_morte,
+    evento_vittoria
+} Tipo_evento;
+
+/*
+ * Record binario di un evento: istante monotono in nanosecondi,
+ * indice del giocatore, due valori e un dettaglio che dipendono dal tipo
+ * (mondo, nemico o oggetto).
+ */
+typedef struct {
+    uint64_t istante_ns;
+    uint32_t giocatore;
+    int32_t valore;
+    int32_t valore2;
+    uint8_t tipo;
+    uint8_t dettaglio;
+} Evento_traccia;
+
+/* Stato di un giocatore nella storia della partita (zona -1 se morto). */
+typedef struct {
+    int vivo;
+    int mondo;
+    long zona;
+    int attacco_psichico;
+    int difesa_psichica;
+    int fortuna;
+    Tipo_oggetto zaino[ZAINO_MAX];
+} Stato_giocatore;
+
+/*
+ * Stato di una partita ricostruito a un turno: i giocatori e le coppie
+ * di zone che differiscono dalla mappa iniziale.
+ */
+typedef struct {
+    size_t turno;
+    int num_giocatori;
+    Stato_giocatore *giocatori;
+    size_t num_zone;
+    size_t *indici_zone;
+    Zona_compatta *zone;
+} Istantanea_partita;
+
+/*
+ * Ingresso e uscita del motore forniti da chi ospita la libreria.
+ * leggi_riga scrive in dest una riga senza newline e restituisce 0 a fine
+ * input; scrivi riceve testo gia' formattato; attendi fa la pausa tra i
+ * caratteri della stampa lenta e, restituendo un valore diverso da 0,
+ * fa uscire subito il resto del testo fino alla prossima lettura;
+ * orologio da' i secondi dall'epoca per semi e classifica.
+ * Con scrivi a NULL il testo non viene nemmeno formattato, con attendi
+ * a NULL esce tutto insieme, con orologio a NULL si usa time().
+ */
+typedef struct {
+    void *contesto;
+    int (*leggi_riga)(void *contesto, char *dest, size_t max_len);
+    void (*scrivi)(void *contesto, const char *testo, size_t len);
+    int (*attendi)(void *contesto, long nanosec);
+    int64_t (*orologio)(void *contesto);
+} Gioco_io;
+
+/*
+ * Sottosistemi a cui viene attribuita la memoria del motore.
+ * Zone e giocatori stanno dentro i blocchi dell'arena e sono contati
+ * anche a parte, per la partita del thread chiamante.
+ */
+typedef enum {
+    memoria_arena,
+    memoria_zone,
+    memoria_giocatori,
+    memoria_mappe,
+    memoria_mondo,
+    memoria_storia,
+    memoria_classifica,
+    memoria_simulazione,
+    memoria_traccia,
+    memoria_numero_sottosistemi
+} Sottosistema_memoria;
+
+/* Byte in uso, massimo dei byte in uso e numero di allocazioni e liberazioni. */
+typedef struct {
+    int64_t vivi;
+    int64_t picco;
+    uint64_t allocazioni;
+    uint64_t liberazioni;
+} Contatori_memoria;
+
 /* Funzioni pubbliche */
+void gioco_imposta_io(const Gioco_io *io);
+void memoria_statistiche(Contatori_memoria conti[memoria_numero_sottosistemi]);
+int memoria_rapporto(void);
 void imposta_gioco(void);
 void gioca(void);
 void termina_gioco(void);
 void crediti(void);
 void stampa_lenta(long nanosec_delay, const char *fmt, ...);
+void alterna_schermo_intero(void);
+int leggi_comando(int *valore);
+void alterna_traccia(void);
+void traccia_abilita(int attiva);
+int traccia_salva(const char *percorso);
+int traccia_esporta_chrome(const char *binario, const char *json);
+void alterna_salvataggi(void);
+int salvataggio_avvia(const char *percorso);
+int salvataggio_attendi(void);
+
+int genera_mappa_compatta(Mappa_compatta *m, size_t lunghezza);
+void libera_mappa_compatta(Mappa_compatta *m);
+size_t conta_demotorzone_compatta(const Mappa_compatta *m);
+int comprimi_mappa(Mappa_compatta *m);
+int espandi_mappa(const Mappa_compatta *m);
+
+void mappa_virtuale_crea(Mappa_virtuale *m, uint64_t seme, size_t lunghezza);
+void mappa_virtuale_libera(Mappa_virtuale *m);
+Zona_compatta mappa_virtuale_zona(const Mappa_virtuale *m, size_t indice);
+int mappa_virtuale_modifica(Mappa_virtuale *m, size_t indice, Zona_compatta z);
+
+Modello_mappa *modello_crea(Mappa_compatta *m);
+Modello_mappa *modello_acquisisci(Modello_mappa *modello);
+void modello_rilascia(Modello_mappa *modello);
+int mappa_virtuale_da_modello(Mappa_virtuale *m, Modello_mappa *modello);
+
+Modello_mappa *cache_mappe_ottieni(uint64_t seme, size_t lunghezza);
+void cache_mappe_imposta_capacita(size_t capacita);
+void cache_mappe_statistiche(Statistiche_cache_mappe *s);
+void cache_mappe_svuota(void);
+int cerca_semi(const Criteri_mappa *c, Punteggio_mappa *trovati, size_t max_trovati, size_t *accettati);
+
+int simula_partita(uint64_t seme, int num_bot, Modello_mappa *modello, Esito_partita *esito);
+int simula_in_parallelo(const Parametri_simulazione *p, Riepilogo_simulazione *r);
+int simula_con_thread(const Parametri_simulazione *p, Riepilogo_simulazione *r);
+int mappa_calore_crea(Mappa_calore *c, size_t lunghezza);
+void mappa_calore_libera(Mappa_calore *c);
+void simulazione(void);
+int allenamento(void);
+size_t classifica_partite(void);
+size_t classifica_migliori(Totale_giocatore *risultato, size_t k);
+int classifica_totale(const char *nome, Totale_giocatore *totale);
+size_t classifica_recenti(Record_classifica *recenti, size_t n);
+
+size_t storia_turni(void);
+int storia_ricostruisci(size_t turno, Istantanea_partita *ist);
+void libera_istantanea(Istantanea_partita *ist);
+void rivedi_partita(void);
+
+void simula_scontri(const Scontro *scontri, size_t n, uint64_t seme, Esito_scontro *esiti);
+
+int importa_mappa(const char *percorso);
+int esporta_mappa(const char *percorso, int binario);
+int applica_modifiche(const Modifica_mappa *modifiche, size_t n);
 
 #endif
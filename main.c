@@ -1,14 +1,19 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "gamelib.h"
 
 /*
  * Punto di ingresso del programma: mostra il menu principale,
  * valida l'input dell'utente e richiama le funzioni della libreria di gioco.
+ * Con --allenamento esegue solo il carico di lavoro usato da make pgo.
  */
-int main(void)
+int main(int argc, char **argv)
 {
     int scelta;
+    if (argc > 1 && strcmp(argv[1], "--allenamento") == 0) {
+        return allenamento() ? 0 : 1;
+    }
     const char *banner =
         "  ,- _~.                     -_-/    ,                          \n"
         " (' /|                      (_ /    ||          _               \n"
@@ -27,18 +32,17 @@ int main(void)
         stampa_lenta(15000000L, "2) gioca\n");
         stampa_lenta(15000000L, "3) termina gioco\n");
         stampa_lenta(15000000L, "4) crediti\n");
+        stampa_lenta(15000000L, "5) schermo intero on/off\n");
+        stampa_lenta(15000000L, "6) simulazione\n");
+        stampa_lenta(15000000L, "7) traccia eventi on/off\n");
+        stampa_lenta(15000000L, "8) rivedi partita\n");
+        stampa_lenta(15000000L, "9) salvataggio automatico on/off\n");
         stampa_lenta(15000000L, "Scelta: ");
-        if (scanf("%d", &scelta) != 1) {
+        if (!leggi_comando(&scelta)) {
             stampa_lenta(15000000L, "Comando non valido.\n");
-            int ch;
-            while ((ch = getchar()) != '\n' && ch != EOF) {
-            }
             scelta = 0;
             continue;
         }
-        int ch;
-        while ((ch = getchar()) != '\n' && ch != EOF) {
-        }
 
         switch (scelta) {
         case 1:
@@ -53,6 +57,21 @@ int main(void)
         case 4:
             crediti();
             break;
+        case 5:
+            alterna_schermo_intero();
+            break;
+        case 6:
+            simulazione();
+            break;
+        case 7:
+            alterna_traccia();
+            break;
+        case 8:
+            rivedi_partita();
+            break;
+        case 9:
+            alterna_salvataggi();
+            break;
         default:
             stampa_lenta(15000000L, "Comando non valido.\n");
             break;